@@ -0,0 +1,522 @@
+/* Sparse Game of Life on an unbounded plane.
+The plane is cut into 64x64 chunks, one word per row like in life.h, kept
+in a hash map by chunk coordinates. Only chunks that can change are stepped:
+a chunk is awake for a generation when it or one of its 8 neighbors changed
+in the one before, so still lifes and empty space cost nothing once they
+settle. Before a generation, awake chunks with live cells on an edge make
+sure the neighbors across it exist, as births can happen there, and after
+it, empty chunks that fell asleep are freed. Memory and time follow the
+live, changing area rather than its bounding box. Like HashLife, it takes
+any Life-like rule without births from 0 neighbors.
+*/
+#ifndef CHUNKS_H
+#define CHUNKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "life.h"
+#include "workers.h"
+
+#define CHK_SIZE 64
+// Awake chunks stepped as one task
+#define CHK_TASK_CHUNKS 16
+
+// Called with live cells (x + i, y) for every set bit i of `bits`
+typedef void (*ChkWordFn)(void *ctx, int64_t x, int64_t y, uint64_t bits);
+
+typedef struct ChkChunk ChkChunk;
+struct ChkChunk {
+    int64_t x, y;  // in chunks
+    uint64_t cells[CHK_SIZE];  // row y, bit x
+    uint64_t next[CHK_SIZE];
+    bool awake;
+    ChkChunk *hash_next;
+};
+
+typedef struct {
+    uint64_t generation;
+    ChkChunk **table;
+    size_t bucket_count;
+    size_t chunk_count;
+    ChkChunk **awake;  // chunks to step in the next generation
+    size_t awake_count;
+    ChkChunk **stepped;  // the awake chunks of the last generation
+    size_t stepped_count;
+    size_t list_capacity;  // of awake and stepped
+    LifeRule rule;
+} ChkWorld;
+
+// Returns false when memory couldn't be allocated. Worlds start with
+// B3/S23.
+bool chk_init(ChkWorld *world);
+// Wakes every chunk, as still lifes might not be still under the new rule.
+// Rules with B0 aren't supported.
+void chk_set_rule(ChkWorld *world, LifeRule rule);
+void chk_free(ChkWorld *world);
+// Removes every cell and resets the generation
+void chk_clear(ChkWorld *world);
+bool chk_get(const ChkWorld *world, int64_t x, int64_t y);
+void chk_set(ChkWorld *world, int64_t x, int64_t y, bool alive);
+uint64_t chk_population(const ChkWorld *world);
+// Steps the awake chunks, spread over the pool when it isn't NULL
+void chk_step(ChkWorld *world, WrkPool *pool);
+// Ors the live cells of [x, x + width) x [y, y + height) into rows of bit
+// packed words, `stride` words apart, laid out like a LifeBoard
+void chk_read_rows(
+    const ChkWorld *world,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    uint64_t *rows,
+    size_t stride
+);
+// Reports every live cell once, a chunk's row at a time and in no
+// particular order
+void chk_read_words(const ChkWorld *world, ChkWordFn word, void *ctx);
+// Ors the bits of rows of bit packed words, `stride` words apart and
+// cleared past the width, into the cells of [x, x + width) x [y, y + height)
+void chk_write_rows(
+    ChkWorld *world,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+);
+// Smallest [x0, x1) x [y0, y1) holding every live cell.
+// Returns false when there are none.
+bool chk_bounds(
+    const ChkWorld *world,
+    int64_t *x0,
+    int64_t *y0,
+    int64_t *x1,
+    int64_t *y1
+);
+
+#ifdef CHUNKS_IMPLEMENTATION
+
+static void chk_fail(void) {
+    fprintf(stderr, "Chunks: couldn't allocate memory.\n");
+    exit(-1);
+}
+
+static size_t chk_bucket(const ChkWorld *world, int64_t x, int64_t y) {
+    uint64_t h = (uint64_t)x * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (uint64_t)y) * 0xBF58476D1CE4E5B9ull;
+    return (h ^ h >> 31) & (world->bucket_count - 1);
+}
+
+static ChkChunk *chk_find(const ChkWorld *world, int64_t x, int64_t y) {
+    ChkChunk *chunk = world->table[chk_bucket(world, x, y)];
+    while (chunk != NULL && (chunk->x != x || chunk->y != y)) {
+        chunk = chunk->hash_next;
+    }
+    return chunk;
+}
+
+// Chunk of a cell coordinate, rounding toward negative infinity
+static int64_t chk_chunk_of(int64_t cell) {
+    return cell >= 0 ? cell / CHK_SIZE : -((-cell - 1) / CHK_SIZE) - 1;
+}
+
+static void chk_wake(ChkWorld *world, ChkChunk *chunk) {
+    if (chunk == NULL || chunk->awake) return;
+    if (world->awake_count == world->list_capacity) {
+        size_t capacity = 2 * world->list_capacity + 64;
+        ChkChunk **awake =
+            realloc(world->awake, capacity * sizeof(ChkChunk *));
+        ChkChunk **stepped =
+            realloc(world->stepped, capacity * sizeof(ChkChunk *));
+        if (awake == NULL || stepped == NULL) chk_fail();
+        world->awake = awake;
+        world->stepped = stepped;
+        world->list_capacity = capacity;
+    }
+    chunk->awake = true;
+    world->awake[world->awake_count++] = chunk;
+}
+
+static void chk_resize_table(ChkWorld *world, size_t bucket_count) {
+    ChkChunk **old = world->table;
+    size_t old_count = world->bucket_count;
+    world->table = calloc(bucket_count, sizeof(ChkChunk *));
+    if (world->table == NULL) chk_fail();
+    world->bucket_count = bucket_count;
+    for (size_t b = 0; b < old_count; b++) {
+        ChkChunk *chunk = old[b];
+        while (chunk != NULL) {
+            ChkChunk *next = chunk->hash_next;
+            size_t bucket = chk_bucket(world, chunk->x, chunk->y);
+            chunk->hash_next = world->table[bucket];
+            world->table[bucket] = chunk;
+            chunk = next;
+        }
+    }
+    free(old);
+}
+
+// Creates missing chunks empty and awake
+static ChkChunk *chk_find_or_add(ChkWorld *world, int64_t x, int64_t y) {
+    ChkChunk *chunk = chk_find(world, x, y);
+    if (chunk != NULL) return chunk;
+    if (world->chunk_count >= world->bucket_count) {
+        chk_resize_table(world, 2 * world->bucket_count);
+    }
+    chunk = calloc(1, sizeof(ChkChunk));
+    if (chunk == NULL) chk_fail();
+    chunk->x = x;
+    chunk->y = y;
+    size_t bucket = chk_bucket(world, x, y);
+    chunk->hash_next = world->table[bucket];
+    world->table[bucket] = chunk;
+    world->chunk_count++;
+    chk_wake(world, chunk);
+    return chunk;
+}
+
+static void chk_remove(ChkWorld *world, ChkChunk *chunk) {
+    ChkChunk **link = &world->table[chk_bucket(world, chunk->x, chunk->y)];
+    while (*link != chunk) link = &(*link)->hash_next;
+    *link = chunk->hash_next;
+    world->chunk_count--;
+    free(chunk);
+}
+
+bool chk_init(ChkWorld *world) {
+    memset(world, 0, sizeof(*world));
+    world->rule = LIFE_CONWAY;
+    world->bucket_count = 1024;
+    world->table = calloc(world->bucket_count, sizeof(ChkChunk *));
+    return world->table != NULL;
+}
+
+void chk_set_rule(ChkWorld *world, LifeRule rule) {
+    world->rule = rule;
+    for (size_t b = 0; b < world->bucket_count; b++) {
+        for (ChkChunk *c = world->table[b]; c != NULL; c = c->hash_next) {
+            chk_wake(world, c);
+        }
+    }
+}
+
+void chk_clear(ChkWorld *world) {
+    for (size_t b = 0; b < world->bucket_count; b++) {
+        ChkChunk *chunk = world->table[b];
+        while (chunk != NULL) {
+            ChkChunk *next = chunk->hash_next;
+            free(chunk);
+            chunk = next;
+        }
+        world->table[b] = NULL;
+    }
+    world->chunk_count = 0;
+    world->awake_count = 0;
+    world->stepped_count = 0;
+    world->generation = 0;
+}
+
+void chk_free(ChkWorld *world) {
+    if (world->table != NULL) chk_clear(world);
+    free(world->table);
+    free(world->awake);
+    free(world->stepped);
+    memset(world, 0, sizeof(*world));
+}
+
+bool chk_get(const ChkWorld *world, int64_t x, int64_t y) {
+    int64_t cx = chk_chunk_of(x), cy = chk_chunk_of(y);
+    const ChkChunk *chunk = chk_find(world, cx, cy);
+    if (chunk == NULL) return false;
+    return chunk->cells[y - cy * CHK_SIZE] >> (x - cx * CHK_SIZE) & 1;
+}
+
+void chk_set(ChkWorld *world, int64_t x, int64_t y, bool alive) {
+    int64_t cx = chk_chunk_of(x), cy = chk_chunk_of(y);
+    ChkChunk *chunk =
+        alive ? chk_find_or_add(world, cx, cy) : chk_find(world, cx, cy);
+    if (chunk == NULL) return;
+    uint64_t *row = &chunk->cells[y - cy * CHK_SIZE];
+    uint64_t bit = 1ull << (x - cx * CHK_SIZE);
+    *row = alive ? *row | bit : *row & ~bit;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            chk_wake(world, chk_find(world, cx + dx, cy + dy));
+        }
+    }
+}
+
+uint64_t chk_population(const ChkWorld *world) {
+    uint64_t population = 0;
+    for (size_t b = 0; b < world->bucket_count; b++) {
+        for (ChkChunk *c = world->table[b]; c != NULL; c = c->hash_next) {
+            for (int y = 0; y < CHK_SIZE; y++) {
+                population += __builtin_popcountll(c->cells[y]);
+            }
+        }
+    }
+    return population;
+}
+
+// Adds the neighbors across edges with live cells, where births can happen
+static void chk_grow(ChkWorld *world, const ChkChunk *chunk) {
+    uint64_t west = 0, east = 0;
+    for (int y = 0; y < CHK_SIZE; y++) {
+        west |= chunk->cells[y] & 1;
+        east |= chunk->cells[y] >> 63;
+    }
+    bool north = chunk->cells[0] != 0;
+    bool south = chunk->cells[CHK_SIZE - 1] != 0;
+    int64_t x = chunk->x, y = chunk->y;
+    if (west) chk_find_or_add(world, x - 1, y);
+    if (east) chk_find_or_add(world, x + 1, y);
+    if (north) chk_find_or_add(world, x, y - 1);
+    if (south) chk_find_or_add(world, x, y + 1);
+    if (chunk->cells[0] & 1) chk_find_or_add(world, x - 1, y - 1);
+    if (chunk->cells[0] >> 63) chk_find_or_add(world, x + 1, y - 1);
+    if (chunk->cells[CHK_SIZE - 1] & 1) chk_find_or_add(world, x - 1, y + 1);
+    if (chunk->cells[CHK_SIZE - 1] >> 63) {
+        chk_find_or_add(world, x + 1, y + 1);
+    }
+}
+
+static void chk_next(const ChkWorld *world, ChkChunk *chunk) {
+    static const uint64_t EMPTY[CHK_SIZE] = {0};
+    const uint64_t *around[3][3];  // [dy + 1][dx + 1]
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            const ChkChunk *c =
+                chk_find(world, chunk->x + dx, chunk->y + dy);
+            around[dy + 1][dx + 1] = c != NULL ? c->cells : EMPTY;
+        }
+    }
+    // Horizontal sums of rows -1 to 64, the outer two from the chunks
+    // above and below
+    uint64_t lo[CHK_SIZE + 2], hi[CHK_SIZE + 2];
+    LifeMasks masks = life_masks(world->rule);
+    for (int r = -1; r <= CHK_SIZE; r++) {
+        int band = r < 0 ? 0 : r < CHK_SIZE ? 1 : 2;
+        int y = (r + CHK_SIZE) % CHK_SIZE;
+        life_sum3(
+            around[band][1][y],
+            around[band][0][y],
+            around[band][2][y],
+            &lo[r + 1],
+            &hi[r + 1]
+        );
+    }
+    for (int y = 0; y < CHK_SIZE; y++) {
+        chunk->next[y] = life_combine_masks(
+            &masks,
+            lo[y],
+            hi[y],
+            lo[y + 1],
+            hi[y + 1],
+            lo[y + 2],
+            hi[y + 2],
+            chunk->cells[y]
+        );
+    }
+}
+
+static void chk_next_task(void *ctx, size_t task, size_t worker) {
+    ChkWorld *world = ctx;
+    size_t i0 = task * CHK_TASK_CHUNKS;
+    size_t i1 = i0 + CHK_TASK_CHUNKS;
+    (void)worker;
+    if (i1 > world->stepped_count) i1 = world->stepped_count;
+    for (size_t i = i0; i < i1; i++) chk_next(world, world->stepped[i]);
+}
+
+void chk_step(ChkWorld *world, WrkPool *pool) {
+    // Growing can add more awake chunks, which are empty and don't grow
+    for (size_t i = 0; i < world->awake_count; i++) {
+        chk_grow(world, world->awake[i]);
+    }
+    ChkChunk **stepped = world->stepped;
+    world->stepped = world->awake;
+    world->stepped_count = world->awake_count;
+    world->awake = stepped;
+    world->awake_count = 0;
+
+    size_t tasks =
+        (world->stepped_count + CHK_TASK_CHUNKS - 1) / CHK_TASK_CHUNKS;
+    if (pool != NULL && tasks > 1) {
+        wrk_run(pool, chk_next_task, world, tasks);
+    } else {
+        for (size_t k = 0; k < tasks; k++) chk_next_task(world, k, 0);
+    }
+
+    // Chunks that changed wake themselves and their neighbors
+    for (size_t i = 0; i < world->stepped_count; i++) {
+        world->stepped[i]->awake = false;
+    }
+    for (size_t i = 0; i < world->stepped_count; i++) {
+        ChkChunk *chunk = world->stepped[i];
+        if (memcmp(chunk->cells, chunk->next, sizeof(chunk->cells)) == 0) {
+            continue;
+        }
+        memcpy(chunk->cells, chunk->next, sizeof(chunk->cells));
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                ChkChunk *c = chk_find(world, chunk->x + dx, chunk->y + dy);
+                chk_wake(world, c);
+            }
+        }
+    }
+    // Empty chunks that fell asleep are gone for good until a neighbor
+    // grows into them again
+    for (size_t i = 0; i < world->stepped_count; i++) {
+        ChkChunk *chunk = world->stepped[i];
+        if (chunk->awake) continue;
+        uint64_t any = 0;
+        for (int y = 0; y < CHK_SIZE; y++) any |= chunk->cells[y];
+        if (any == 0) chk_remove(world, chunk);
+    }
+    world->stepped_count = 0;
+    world->generation++;
+}
+
+void chk_read_rows(
+    const ChkWorld *world,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    uint64_t *rows,
+    size_t stride
+) {
+    if (width == 0 || height == 0) return;
+    int64_t cx0 = chk_chunk_of(x), cx1 = chk_chunk_of(x + width - 1);
+    int64_t cy0 = chk_chunk_of(y), cy1 = chk_chunk_of(y + height - 1);
+    for (int64_t cy = cy0; cy <= cy1; cy++) {
+        for (int64_t cx = cx0; cx <= cx1; cx++) {
+            const ChkChunk *chunk = chk_find(world, cx, cy);
+            if (chunk == NULL) continue;
+            // Where bit 0 of the chunk's rows lands in the output rows
+            int64_t shift = cx * CHK_SIZE - x;
+            for (int r = 0; r < CHK_SIZE; r++) {
+                int64_t out_y = cy * CHK_SIZE + r - y;
+                uint64_t cells = chunk->cells[r];
+                if (out_y < 0 || out_y >= (int64_t)height || cells == 0) {
+                    continue;
+                }
+                uint64_t *row = rows + out_y * stride;
+                if (shift < 0) {
+                    row[0] |= cells >> -shift;
+                    continue;
+                }
+                size_t word = shift / 64, bit = shift % 64;
+                row[word] |= cells << bit;
+                if (bit != 0 && word + 1 < stride) {
+                    row[word + 1] |= cells >> (64 - bit);
+                }
+            }
+        }
+    }
+    // Cut what spilled past the width
+    if (width % 64 != 0) {
+        uint64_t mask = ~0ull >> (64 - width % 64);
+        for (size_t r = 0; r < height; r++) {
+            rows[r * stride + (width - 1) / 64] &= mask;
+        }
+    }
+}
+
+void chk_read_words(const ChkWorld *world, ChkWordFn word, void *ctx) {
+    for (size_t b = 0; b < world->bucket_count; b++) {
+        for (ChkChunk *c = world->table[b]; c != NULL; c = c->hash_next) {
+            for (int y = 0; y < CHK_SIZE; y++) {
+                if (c->cells[y] == 0) continue;
+                word(ctx, c->x * CHK_SIZE, c->y * CHK_SIZE + y, c->cells[y]);
+            }
+        }
+    }
+}
+
+void chk_write_rows(
+    ChkWorld *world,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+) {
+    if (width == 0 || height == 0) return;
+    int64_t cx0 = chk_chunk_of(x), cx1 = chk_chunk_of(x + width - 1);
+    int64_t cy0 = chk_chunk_of(y), cy1 = chk_chunk_of(y + height - 1);
+    for (int64_t cy = cy0; cy <= cy1; cy++) {
+        for (int64_t cx = cx0; cx <= cx1; cx++) {
+            // Where bit 0 of the chunk's rows is in the input rows
+            int64_t shift = cx * CHK_SIZE - x;
+            size_t word = shift < 0 ? 0 : shift / 64;
+            size_t bit = shift < 0 ? 0 : shift % 64;
+            uint64_t cells[CHK_SIZE] = {0}, any = 0;
+            for (int r = 0; r < CHK_SIZE; r++) {
+                int64_t in_y = cy * CHK_SIZE + r - y;
+                if (in_y < 0 || in_y >= (int64_t)height) continue;
+                const uint64_t *row = rows + in_y * stride;
+                if (shift < 0) {
+                    cells[r] = row[0] << -shift;
+                } else {
+                    cells[r] = row[word] >> bit;
+                    if (bit != 0 && word + 1 < stride) {
+                        cells[r] |= row[word + 1] << (64 - bit);
+                    }
+                }
+                any |= cells[r];
+            }
+            if (any == 0) continue;
+            ChkChunk *chunk = chk_find_or_add(world, cx, cy);
+            for (int r = 0; r < CHK_SIZE; r++) chunk->cells[r] |= cells[r];
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    chk_wake(world, chk_find(world, cx + dx, cy + dy));
+                }
+            }
+        }
+    }
+}
+
+bool chk_bounds(
+    const ChkWorld *world,
+    int64_t *x0,
+    int64_t *y0,
+    int64_t *x1,
+    int64_t *y1
+) {
+    bool found = false;
+    for (size_t b = 0; b < world->bucket_count; b++) {
+        for (ChkChunk *c = world->table[b]; c != NULL; c = c->hash_next) {
+            uint64_t columns = 0;
+            int top = CHK_SIZE, bottom = -1;
+            for (int y = 0; y < CHK_SIZE; y++) {
+                if (c->cells[y] == 0) continue;
+                columns |= c->cells[y];
+                if (top == CHK_SIZE) top = y;
+                bottom = y;
+            }
+            if (columns == 0) continue;
+            int64_t left = c->x * CHK_SIZE + __builtin_ctzll(columns);
+            int64_t right = c->x * CHK_SIZE + 64 - __builtin_clzll(columns);
+            int64_t upper = c->y * CHK_SIZE + top;
+            int64_t lower = c->y * CHK_SIZE + bottom + 1;
+            if (!found || left < *x0) *x0 = left;
+            if (!found || upper < *y0) *y0 = upper;
+            if (!found || right > *x1) *x1 = right;
+            if (!found || lower > *y1) *y1 = lower;
+            found = true;
+        }
+    }
+    return found;
+}
+
+#endif  // end of CHUNKS_IMPLEMENTATION
+#endif  // end of header guard
@@ -0,0 +1,271 @@
+/* Density image of weighted 2D points, for when there are too many points
+to draw one by one. Each point adds its weight to the pixel it falls in,
+and the sums are tone mapped with a log curve into RGBA8 pixels that can be
+uploaded as a texture in one go. Points are read through a byte stride like
+in spatial_grid.h, e.g.
+    dens_splat(&image, &items[0].r, &items[0].mass, count, sizeof(*items),
+               pool);
+*/
+#ifndef DENSITY_H
+#define DENSITY_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workers.h"
+
+// Points per splatting task and rows per reduction or tone mapping task
+#define DENS_POINT_BLOCK 8192
+#define DENS_ROW_BLOCK 16
+
+typedef struct {
+    size_t width;  // in pixels
+    size_t height;
+    float origin_x;
+    float origin_y;
+    float scale;       // pixels per unit
+    float *density;    // width * height
+    float *row_max;    // densest pixel of each row
+    uint8_t *pixels;   // RGBA8, width * height * 4
+    uint8_t palette[256][4];
+} DensityImage;
+
+// Returns false when memory couldn't be allocated
+bool dens_init(
+    DensityImage *image,
+    size_t width,
+    size_t height,
+    float x,
+    float y,
+    float scale
+);
+void dens_free(DensityImage *image);
+// Replaces the density with the weights of `count` points, points outside
+// of the image are skipped. With more than one thread, every worker splats
+// into its own layer and the layers are summed by rows.
+// Returns false when per worker memory couldn't be allocated.
+bool dens_splat(
+    DensityImage *image,
+    const void *positions,
+    const void *weights,
+    size_t count,
+    size_t stride,
+    WrkPool *pool
+);
+// Fills pixels from log(1 + d / unit) / log(1 + max / unit), so a pixel
+// with a single point of weight `unit` stays visible next to dense cores.
+// Empty pixels are transparent.
+void dens_tone_map(DensityImage *image, float unit, WrkPool *pool);
+
+#ifdef DENSITY_IMPLEMENTATION
+
+bool dens_init(
+    DensityImage *image,
+    size_t width,
+    size_t height,
+    float x,
+    float y,
+    float scale
+) {
+    memset(image, 0, sizeof(*image));
+    image->width = width;
+    image->height = height;
+    image->origin_x = x;
+    image->origin_y = y;
+    image->scale = scale;
+    image->density = calloc(width * height, sizeof(float));
+    image->row_max = calloc(height, sizeof(float));
+    image->pixels = calloc(width * height, 4);
+    if (image->density == NULL || image->row_max == NULL ||
+        image->pixels == NULL) {
+        dens_free(image);
+        return false;
+    }
+    // Dark red through orange to white
+    for (int k = 0; k < 256; k++) {
+        float t = k / 255.0f;
+        image->palette[k][0] = 255 * sqrtf(t);
+        image->palette[k][1] = 255 * t;
+        image->palette[k][2] = 255 * t * t;
+        image->palette[k][3] = k == 0 ? 0 : 255;
+    }
+    return true;
+}
+
+void dens_free(DensityImage *image) {
+    free(image->density);
+    free(image->row_max);
+    free(image->pixels);
+    memset(image, 0, sizeof(*image));
+}
+
+typedef struct {
+    DensityImage *image;
+    const char *positions;
+    const char *weights;
+    size_t count;
+    size_t stride;
+    WrkPool *pool;
+    float thresholds[256];  // lowest density of each palette entry
+} DensJob;
+
+static void dens_splat_points(
+    const DensJob *job, float *density, size_t i0, size_t i1
+) {
+    const DensityImage *image = job->image;
+    for (size_t i = i0; i < i1; i++) {
+        const float *r = (const float *)(job->positions + i * job->stride);
+        float x = (r[0] - image->origin_x) * image->scale;
+        float y = (r[1] - image->origin_y) * image->scale;
+        // Also skips NaN
+        if (!(x >= 0 && y >= 0 && x < image->width && y < image->height)) {
+            continue;
+        }
+        float weight = *(const float *)(job->weights + i * job->stride);
+        density[(size_t)y * image->width + (size_t)x] += weight;
+    }
+}
+
+static void dens_clear_task(void *ctx, size_t task, size_t worker) {
+    DensJob *job = ctx;
+    size_t pixels = job->image->width * job->image->height;
+    (void)worker;
+    memset(job->pool->scratch[task], 0, pixels * sizeof(float));
+}
+
+static void dens_splat_task(void *ctx, size_t task, size_t worker) {
+    DensJob *job = ctx;
+    size_t i0 = task * DENS_POINT_BLOCK;
+    size_t i1 = i0 + DENS_POINT_BLOCK;
+    if (i1 > job->count) i1 = job->count;
+    dens_splat_points(job, job->pool->scratch[worker], i0, i1);
+}
+
+static void dens_rows(
+    const DensityImage *image, size_t task, size_t *y0, size_t *y1
+) {
+    *y0 = task * DENS_ROW_BLOCK;
+    *y1 = *y0 + DENS_ROW_BLOCK;
+    if (*y1 > image->height) *y1 = image->height;
+}
+
+// Sums every worker's layer over a block of rows
+static void dens_reduce_task(void *ctx, size_t task, size_t worker) {
+    DensJob *job = ctx;
+    DensityImage *image = job->image;
+    size_t y0, y1;
+    (void)worker;
+    dens_rows(image, task, &y0, &y1);
+    size_t p0 = y0 * image->width, p1 = y1 * image->width;
+    memset(image->density + p0, 0, (p1 - p0) * sizeof(float));
+    for (size_t w = 0; w < job->pool->thread_count; w++) {
+        const float *layer = job->pool->scratch[w];
+        for (size_t p = p0; p < p1; p++) image->density[p] += layer[p];
+    }
+}
+
+bool dens_splat(
+    DensityImage *image,
+    const void *positions,
+    const void *weights,
+    size_t count,
+    size_t stride,
+    WrkPool *pool
+) {
+    DensJob job = {
+        .image = image,
+        .positions = positions,
+        .weights = weights,
+        .count = count,
+        .stride = stride,
+        .pool = pool,
+    };
+    size_t pixels = image->width * image->height;
+    if (pool == NULL || pool->thread_count <= 1) {
+        memset(image->density, 0, pixels * sizeof(float));
+        dens_splat_points(&job, image->density, 0, count);
+        return true;
+    }
+
+    if (!wrk_reserve_scratch(pool, pixels * sizeof(float))) return false;
+    size_t blocks = (count + DENS_POINT_BLOCK - 1) / DENS_POINT_BLOCK;
+    size_t row_blocks = (image->height + DENS_ROW_BLOCK - 1) / DENS_ROW_BLOCK;
+    wrk_run(pool, dens_clear_task, &job, pool->thread_count);
+    wrk_run(pool, dens_splat_task, &job, blocks);
+    wrk_run(pool, dens_reduce_task, &job, row_blocks);
+    return true;
+}
+
+static void dens_max_task(void *ctx, size_t task, size_t worker) {
+    DensityImage *image = ((DensJob *)ctx)->image;
+    size_t y0, y1;
+    (void)worker;
+    dens_rows(image, task, &y0, &y1);
+    for (size_t y = y0; y < y1; y++) {
+        const float *row = image->density + y * image->width;
+        float max = 0;
+        // Plain comparisons vectorize where fmaxf doesn't
+        for (size_t x = 0; x < image->width; x++) {
+            max = row[x] > max ? row[x] : max;
+        }
+        image->row_max[y] = max;
+    }
+}
+
+static void dens_tone_task(void *ctx, size_t task, size_t worker) {
+    DensJob *job = ctx;
+    DensityImage *image = job->image;
+    size_t y0, y1;
+    (void)worker;
+    dens_rows(image, task, &y0, &y1);
+    for (size_t p = y0 * image->width; p < y1 * image->width; p++) {
+        float d = image->density[p];
+        size_t k = 0;
+        if (d > 0) {
+            // Binary search of the thresholds instead of a log per pixel
+            k = 1;
+            for (size_t step = 128; step > 0; step /= 2) {
+                if (k + step < 256 && d >= job->thresholds[k + step]) {
+                    k += step;
+                }
+            }
+        }
+        memcpy(image->pixels + 4 * p, image->palette[k], 4);
+    }
+}
+
+void dens_tone_map(DensityImage *image, float unit, WrkPool *pool) {
+    DensJob job = {.image = image, .pool = pool};
+    size_t row_blocks = (image->height + DENS_ROW_BLOCK - 1) / DENS_ROW_BLOCK;
+    if (pool != NULL) {
+        wrk_run(pool, dens_max_task, &job, row_blocks);
+    } else {
+        for (size_t k = 0; k < row_blocks; k++) dens_max_task(&job, k, 0);
+    }
+    float max = 0;
+    for (size_t y = 0; y < image->height; y++) {
+        max = fmaxf(max, image->row_max[y]);
+    }
+    if (!(unit > 0)) unit = max > 0 ? max : 1;
+    // Entry k starts where log(1 + d / unit) / log(1 + max / unit) reaches
+    // k / 255. Entry 1 starts at any density, so a single point never
+    // rounds down to transparent.
+    float range = log1pf(max / unit);
+    job.thresholds[0] = job.thresholds[1] = 0;
+    for (int k = 2; k < 256; k++) {
+        job.thresholds[k] = unit * expm1f(range * k / 255);
+    }
+
+    if (pool != NULL) {
+        wrk_run(pool, dens_tone_task, &job, row_blocks);
+    } else {
+        for (size_t k = 0; k < row_blocks; k++) dens_tone_task(&job, k, 0);
+    }
+}
+
+#endif  // end of DENSITY_IMPLEMENTATION
+#endif  // end of header guard
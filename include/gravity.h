@@ -0,0 +1,1577 @@
+/* Gravitational force solvers for point masses in 2D.
+Bodies are kept as structure of arrays so solvers can stream through them.
+Force law follows n_body: a = G * m / r^2, with optional Plummer softening.
+Solvers can also write the potential at each body during the same pass,
+so energy diagnostics don't need a sweep of their own.
+*/
+#ifndef GRAVITY_H
+#define GRAVITY_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workers.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GRAV_X86
+#include <immintrin.h>
+#endif
+
+#define GRAV_BH_LEAF_SIZE 8
+#define GRAV_BH_MAX_DEPTH 24
+// Bodies per tile of the direct kernel, sized so a tile stays in L1
+#define GRAV_TILE_SIZE 512
+// Targets per task when walking the Barnes-Hut tree in parallel
+#define GRAV_BH_BLOCK_SIZE 1024
+// Targets per task of grav_direct_subset, each of them visits every body
+#define GRAV_SUBSET_BLOCK_SIZE 64
+// Cells per side of a particle mesh, past which sizes could overflow
+#define GRAV_PM_MAX_CELLS (1 << 24)
+
+typedef struct {
+    float *x;
+    float *y;
+    float *m;
+    float *ax;
+    float *ay;
+    float *phi;  // potential, only written when GravParams.potential is set
+    size_t capacity;
+    size_t count;
+} GravBodies;
+
+typedef struct {
+    float g;
+    float softening;  // Plummer softening length
+    float theta;      // Barnes-Hut opening angle, 0 means exact
+    bool potential;   // also write -G * sum of m_j / r at each body to phi
+    // Sum in an order that doesn't depend on the thread count or on task
+    // scheduling, so runs are bit reproducible on the same machine
+    bool deterministic;
+} GravParams;
+
+typedef struct {
+    float com_x;
+    float com_y;
+    float mass;
+    float center_x;
+    float center_y;
+    float half;     // half of the node's side length
+    float radius;   // bmax: size/theta plus offset of com from center
+    int32_t child;  // index of first of the four children, -1 for leaves
+    int32_t first;  // head of body list for leaves, -1 if empty
+    int32_t count;  // bodies inside the node
+} GravNode;
+
+// Quadtree used by Barnes-Hut. Nodes are stored in a flat pool and bodies
+// in a leaf are chained through `next`.
+typedef struct {
+    GravNode *items;
+    size_t capacity;
+    size_t count;
+    int32_t *next;
+    size_t next_capacity;
+} GravTree;
+
+// Particle-mesh solver. The mesh is twice the domain in each direction and
+// the extra half stays empty, so the FFT convolution sees no periodic images.
+typedef struct {
+    float origin_x;
+    float origin_y;
+    float cell;
+    size_t nx;       // padded mesh size, a power of two
+    size_t ny;       //
+    size_t used_nx;  // cells that can hold mass
+    size_t used_ny;  //
+    float *re;       // complex work mesh, nx * ny
+    float *im;       //
+    float *green;    // transformed Green's function, real since it's even
+    float *fx;       // mesh forces over the used cells
+    float *fy;       //
+    float *cos_table;
+    float *sin_table;
+    float green_g;  // parameters the Green's function was built for
+    float green_softening;
+} GravMesh;
+
+// Returns false when memory couldn't be allocated
+bool grav_bodies_reserve(GravBodies *b, size_t capacity);
+void grav_bodies_free(GravBodies *b);
+void grav_clear_accelerations(GravBodies *b);
+
+// Exact O(N^2) summation. Used as the reference for other solvers.
+void grav_direct(GravBodies *b, GravParams params);
+// Same forces as grav_direct, computed over pairs of cache sized tiles with
+// the inner loop on SIMD lanes (AVX2 or SSE). The float sums run in another
+// order, and 1/sqrt comes from the rsqrt estimate plus one Newton step, good
+// to a few ulp per pair. Rounding in the sums dominates and grows with N:
+// against double precision sums the worst body is off by about 4e-6, 2e-5
+// and 1e-4 relative at N = 1000, 4000 and 16000, like grav_direct itself.
+// `n_body --bench direct` fails past N * FLT_EPSILON / 4.
+// Tile pairs are spread over the pool's workers; pool may be NULL.
+// With params.deterministic, each tile of targets gathers from all tiles in
+// order instead, which takes twice the pair interactions.
+void grav_direct_tiled(GravBodies *b, GravParams params, WrkPool *pool);
+// Name of the instruction set grav_direct_tiled dispatches to
+const char *grav_simd_name(void);
+// Accelerations on the listed bodies only, gathered from all bodies, so the
+// cost is O(count * N). Other entries of b->ax/ay/phi are left untouched.
+void grav_direct_subset(
+    GravBodies *b,
+    GravParams params,
+    const uint32_t *targets,
+    size_t count,
+    WrkPool *pool
+);
+// Exact acceleration on a single body, accumulated in double precision
+void grav_direct_at(
+    const GravBodies *b, GravParams params, size_t i, double *ax, double *ay
+);
+
+// Total potential energy, -G * m_i * m_j / sqrt(r^2 + softening^2) summed
+// over pairs in double precision. O(N^2), meant for diagnostics.
+// Returns NAN when per worker memory couldn't be allocated.
+double grav_potential(const GravBodies *b, GravParams params, WrkPool *pool);
+
+// Builds a quadtree over all bodies. Returns false on allocation failure.
+bool grav_bh_build(GravTree *tree, const GravBodies *b, float theta);
+// Walks the tree for every body and writes accelerations into b->ax/ay.
+// Blocks of bodies are spread over the pool's workers; pool may be NULL.
+void grav_bh_forces(
+    const GravTree *tree, GravBodies *b, GravParams params, WrkPool *pool
+);
+// Same walk as grav_bh_forces, only for the listed bodies
+void grav_bh_forces_subset(
+    const GravTree *tree,
+    GravBodies *b,
+    GravParams params,
+    const uint32_t *targets,
+    size_t count,
+    WrkPool *pool
+);
+void grav_tree_free(GravTree *tree);
+
+// Sets up a mesh of `cell` sized cells over the given domain.
+// Bodies outside of the domain are clamped to its border.
+// Returns false when the cell isn't positive, the mesh would be too large
+// to index, or on allocation failure.
+bool grav_pm_init(
+    GravMesh *mesh, float x, float y, float width, float height, float cell
+);
+// Deposits mass with cloud-in-cell weights, solves for the potential with
+// an FFT convolution and interpolates mesh forces back to the bodies.
+// Softening is at least half a cell. The interpolated potential leaves out
+// each body's own cloud. Returns false on allocation failure.
+bool grav_pm_forces(
+    GravMesh *mesh, GravBodies *b, GravParams params, WrkPool *pool
+);
+void grav_pm_free(GravMesh *mesh);
+
+#ifdef GRAVITY_IMPLEMENTATION
+
+static bool grav_grow(void **items, size_t size, size_t capacity) {
+    void *new_items = realloc(*items, size * capacity);
+    if (new_items == NULL) return false;
+    *items = new_items;
+    return true;
+}
+
+bool grav_bodies_reserve(GravBodies *b, size_t capacity) {
+    if (capacity <= b->capacity) return true;
+    float **arrays[] = {&b->x, &b->y, &b->m, &b->ax, &b->ay, &b->phi};
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        if (!grav_grow((void **)arrays[i], sizeof(float), capacity)) {
+            return false;
+        }
+    }
+    b->capacity = capacity;
+    return true;
+}
+
+void grav_bodies_free(GravBodies *b) {
+    free(b->x);
+    free(b->y);
+    free(b->m);
+    free(b->ax);
+    free(b->ay);
+    free(b->phi);
+    memset(b, 0, sizeof(*b));
+}
+
+void grav_clear_accelerations(GravBodies *b) {
+    memset(b->ax, 0, b->count * sizeof(*b->ax));
+    memset(b->ay, 0, b->count * sizeof(*b->ay));
+}
+
+void grav_direct(GravBodies *b, GravParams params) {
+    const float eps_sq = params.softening * params.softening;
+    grav_clear_accelerations(b);
+    if (params.potential) memset(b->phi, 0, b->count * sizeof(*b->phi));
+    for (size_t i = 0; i < b->count; i++) {
+        for (size_t j = i + 1; j < b->count; j++) {
+            float dx = b->x[j] - b->x[i];
+            float dy = b->y[j] - b->y[i];
+            float r_sq = dx * dx + dy * dy + eps_sq;
+            if (r_sq == 0) continue;
+            float s = params.g / (r_sq * sqrtf(r_sq));
+            b->ax[i] += dx * s * b->m[j];
+            b->ay[i] += dy * s * b->m[j];
+            b->ax[j] -= dx * s * b->m[i];
+            b->ay[j] -= dy * s * b->m[i];
+            if (params.potential) {
+                float p = params.g / sqrtf(r_sq);
+                b->phi[i] -= p * b->m[j];
+                b->phi[j] -= p * b->m[i];
+            }
+        }
+    }
+}
+
+// Interactions between targets [i0, i1) and sources [j0, j1), visiting each
+// pair once: i gathers m_j * d / r^3 and j receives the opposite pull.
+// When phi isn't NULL, m / r is gathered the same way for the potential.
+// For a tile paired with itself only j > i is visited. G isn't applied.
+// Without `symmetric`, only i gathers and all of [j0, j1) is visited, the
+// body itself adding nothing, so targets never write outside [i0, i1).
+// The bodies are inlined into wrappers that pass a NULL or non-NULL phi and
+// a constant `symmetric`, so each loop only pays for what it computes.
+static inline __attribute__((always_inline)) void grav_pairs_scalar_body(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1,
+    bool symmetric
+) {
+    for (size_t i = i0; i < i1; i++) {
+        const float x = b->x[i];
+        const float y = b->y[i];
+        const float m = b->m[i];
+        float sum_x = 0, sum_y = 0, sum_phi = 0;
+        for (size_t j = symmetric && j0 <= i ? i + 1 : j0; j < j1; j++) {
+            float dx = b->x[j] - x;
+            float dy = b->y[j] - y;
+            float r_sq = dx * dx + dy * dy + eps_sq;
+            float inv_r3 = r_sq > 0 ? 1 / (r_sq * sqrtf(r_sq)) : 0;
+            sum_x += dx * inv_r3 * b->m[j];
+            sum_y += dy * inv_r3 * b->m[j];
+            if (symmetric) {
+                ax[j] -= dx * inv_r3 * m;
+                ay[j] -= dy * inv_r3 * m;
+            }
+            if (phi != NULL && (symmetric || j != i)) {
+                float inv_r = r_sq > 0 ? 1 / sqrtf(r_sq) : 0;
+                sum_phi += inv_r * b->m[j];
+                if (symmetric) phi[j] += inv_r * m;
+            }
+        }
+        ax[i] += sum_x;
+        ay[i] += sum_y;
+        if (phi != NULL) phi[i] += sum_phi;
+    }
+}
+
+static void grav_pairs_scalar(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_scalar_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, true);
+    } else {
+        grav_pairs_scalar_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, true);
+    }
+}
+
+static void grav_gather_scalar(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_scalar_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, false);
+    } else {
+        grav_pairs_scalar_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, false);
+    }
+}
+
+#ifdef GRAV_X86
+static inline __attribute__((always_inline)) void grav_pairs_sse_body(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1,
+    bool symmetric
+) {
+    const __m128 eps = _mm_set1_ps(eps_sq);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    for (size_t i = i0; i < i1; i++) {
+        const __m128 x = _mm_set1_ps(b->x[i]);
+        const __m128 y = _mm_set1_ps(b->y[i]);
+        const __m128 m = _mm_set1_ps(b->m[i]);
+        const __m128i self = _mm_set1_epi32((int32_t)i);
+        const size_t start = symmetric && j0 <= i ? i + 1 : j0;
+        const size_t end = start + (j1 - start) / 4 * 4;
+        __m128 sum_x = zero, sum_y = zero, sum_phi = zero;
+        for (size_t j = start; j < end; j += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(b->x + j), x);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(b->y + j), y);
+            __m128 r_sq = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), eps
+            );
+            __m128 inv_r = _mm_rsqrt_ps(r_sq);
+            __m128 e = _mm_mul_ps(_mm_mul_ps(r_sq, inv_r), inv_r);
+            inv_r = _mm_mul_ps(_mm_mul_ps(inv_r, half), _mm_sub_ps(three, e));
+            __m128 inv_r3 = _mm_mul_ps(inv_r, _mm_mul_ps(inv_r, inv_r));
+            inv_r3 = _mm_and_ps(inv_r3, _mm_cmpgt_ps(r_sq, zero));
+
+            __m128 s = _mm_mul_ps(_mm_loadu_ps(b->m + j), inv_r3);
+            sum_x = _mm_add_ps(sum_x, _mm_mul_ps(dx, s));
+            sum_y = _mm_add_ps(sum_y, _mm_mul_ps(dy, s));
+            if (symmetric) {
+                s = _mm_mul_ps(m, inv_r3);
+                _mm_storeu_ps(
+                    ax + j, _mm_sub_ps(_mm_loadu_ps(ax + j), _mm_mul_ps(dx, s))
+                );
+                _mm_storeu_ps(
+                    ay + j, _mm_sub_ps(_mm_loadu_ps(ay + j), _mm_mul_ps(dy, s))
+                );
+            }
+            if (phi != NULL) {
+                inv_r = _mm_and_ps(inv_r, _mm_cmpgt_ps(r_sq, zero));
+                if (!symmetric) {
+                    __m128i index = _mm_add_epi32(
+                        _mm_set1_epi32((int32_t)j), lanes
+                    );
+                    inv_r = _mm_andnot_ps(
+                        _mm_castsi128_ps(_mm_cmpeq_epi32(index, self)), inv_r
+                    );
+                }
+                sum_phi = _mm_add_ps(
+                    sum_phi, _mm_mul_ps(_mm_loadu_ps(b->m + j), inv_r)
+                );
+                if (symmetric) {
+                    _mm_storeu_ps(
+                        phi + j,
+                        _mm_add_ps(_mm_loadu_ps(phi + j), _mm_mul_ps(m, inv_r))
+                    );
+                }
+            }
+        }
+        float lanes_x[4], lanes_y[4];
+        _mm_storeu_ps(lanes_x, sum_x);
+        _mm_storeu_ps(lanes_y, sum_y);
+        ax[i] += (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        ay[i] += (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+        if (phi != NULL) {
+            float lanes_phi[4];
+            _mm_storeu_ps(lanes_phi, sum_phi);
+            phi[i] += (lanes_phi[0] + lanes_phi[1]) +
+                      (lanes_phi[2] + lanes_phi[3]);
+        }
+        if (symmetric) {
+            grav_pairs_scalar(b, ax, ay, phi, eps_sq, i, i + 1, end, j1);
+        } else {
+            grav_gather_scalar(b, ax, ay, phi, eps_sq, i, i + 1, end, j1);
+        }
+    }
+}
+
+static void grav_pairs_sse(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_sse_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, true);
+    } else {
+        grav_pairs_sse_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, true);
+    }
+}
+
+static void grav_gather_sse(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_sse_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, false);
+    } else {
+        grav_pairs_sse_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, false);
+    }
+}
+
+__attribute__((target("avx2,fma"), always_inline)) static inline void
+grav_pairs_avx2_body(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1,
+    bool symmetric
+) {
+    const __m256 eps = _mm256_set1_ps(eps_sq);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (size_t i = i0; i < i1; i++) {
+        const __m256 x = _mm256_set1_ps(b->x[i]);
+        const __m256 y = _mm256_set1_ps(b->y[i]);
+        const __m256 m = _mm256_set1_ps(b->m[i]);
+        const __m256i self = _mm256_set1_epi32((int32_t)i);
+        const size_t start = symmetric && j0 <= i ? i + 1 : j0;
+        const size_t end = start + (j1 - start) / 8 * 8;
+        __m256 sum_x = zero, sum_y = zero, sum_phi = zero;
+        for (size_t j = start; j < end; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(b->x + j), x);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(b->y + j), y);
+            __m256 r_sq =
+                _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, eps));
+            // rsqrt estimate refined by one Newton step to full precision
+            __m256 inv_r = _mm256_rsqrt_ps(r_sq);
+            __m256 e = _mm256_mul_ps(_mm256_mul_ps(r_sq, inv_r), inv_r);
+            inv_r = _mm256_mul_ps(
+                _mm256_mul_ps(inv_r, half), _mm256_sub_ps(three, e)
+            );
+            __m256 inv_r3 = _mm256_mul_ps(inv_r, _mm256_mul_ps(inv_r, inv_r));
+            inv_r3 = _mm256_and_ps(
+                inv_r3, _mm256_cmp_ps(r_sq, zero, _CMP_GT_OQ)
+            );
+
+            __m256 s = _mm256_mul_ps(_mm256_loadu_ps(b->m + j), inv_r3);
+            sum_x = _mm256_fmadd_ps(dx, s, sum_x);
+            sum_y = _mm256_fmadd_ps(dy, s, sum_y);
+            if (symmetric) {
+                s = _mm256_mul_ps(m, inv_r3);
+                _mm256_storeu_ps(
+                    ax + j, _mm256_fnmadd_ps(dx, s, _mm256_loadu_ps(ax + j))
+                );
+                _mm256_storeu_ps(
+                    ay + j, _mm256_fnmadd_ps(dy, s, _mm256_loadu_ps(ay + j))
+                );
+            }
+            if (phi != NULL) {
+                inv_r = _mm256_and_ps(
+                    inv_r, _mm256_cmp_ps(r_sq, zero, _CMP_GT_OQ)
+                );
+                if (!symmetric) {
+                    __m256i index = _mm256_add_epi32(
+                        _mm256_set1_epi32((int32_t)j), lanes
+                    );
+                    inv_r = _mm256_andnot_ps(
+                        _mm256_castsi256_ps(_mm256_cmpeq_epi32(index, self)),
+                        inv_r
+                    );
+                }
+                sum_phi =
+                    _mm256_fmadd_ps(_mm256_loadu_ps(b->m + j), inv_r, sum_phi);
+                if (symmetric) {
+                    _mm256_storeu_ps(
+                        phi + j,
+                        _mm256_fmadd_ps(m, inv_r, _mm256_loadu_ps(phi + j))
+                    );
+                }
+            }
+        }
+        float lanes_x[8], lanes_y[8];
+        _mm256_storeu_ps(lanes_x, sum_x);
+        _mm256_storeu_ps(lanes_y, sum_y);
+        ax[i] += ((lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3])) +
+                 ((lanes_x[4] + lanes_x[5]) + (lanes_x[6] + lanes_x[7]));
+        ay[i] += ((lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3])) +
+                 ((lanes_y[4] + lanes_y[5]) + (lanes_y[6] + lanes_y[7]));
+        if (phi != NULL) {
+            float lanes_phi[8];
+            _mm256_storeu_ps(lanes_phi, sum_phi);
+            phi[i] +=
+                ((lanes_phi[0] + lanes_phi[1]) +
+                 (lanes_phi[2] + lanes_phi[3])) +
+                ((lanes_phi[4] + lanes_phi[5]) + (lanes_phi[6] + lanes_phi[7]));
+        }
+        if (symmetric) {
+            grav_pairs_scalar(b, ax, ay, phi, eps_sq, i, i + 1, end, j1);
+        } else {
+            grav_gather_scalar(b, ax, ay, phi, eps_sq, i, i + 1, end, j1);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void grav_pairs_avx2(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_avx2_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, true);
+    } else {
+        grav_pairs_avx2_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, true);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void grav_gather_avx2(
+    const GravBodies *b,
+    float *ax,
+    float *ay,
+    float *phi,
+    float eps_sq,
+    size_t i0,
+    size_t i1,
+    size_t j0,
+    size_t j1
+) {
+    if (phi == NULL) {
+        grav_pairs_avx2_body(b, ax, ay, NULL, eps_sq, i0, i1, j0, j1, false);
+    } else {
+        grav_pairs_avx2_body(b, ax, ay, phi, eps_sq, i0, i1, j0, j1, false);
+    }
+}
+#endif
+
+typedef void (*GravPairKernel)(
+    const GravBodies *,
+    float *,
+    float *,
+    float *,
+    float,
+    size_t,
+    size_t,
+    size_t,
+    size_t
+);
+
+static GravPairKernel grav_pair_kernel(void) {
+    static GravPairKernel kernel = NULL;
+    if (kernel != NULL) return kernel;
+    kernel = grav_pairs_scalar;
+#ifdef GRAV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel = grav_pairs_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = grav_pairs_sse;
+    }
+#endif
+    return kernel;
+}
+
+// One sided counterpart of grav_pair_kernel, on the same instruction set
+static GravPairKernel grav_gather_kernel(void) {
+    GravPairKernel kernel = grav_pair_kernel();
+#ifdef GRAV_X86
+    if (kernel == grav_pairs_avx2) return grav_gather_avx2;
+    if (kernel == grav_pairs_sse) return grav_gather_sse;
+#endif
+    (void)kernel;
+    return grav_gather_scalar;
+}
+
+const char *grav_simd_name(void) {
+    GravPairKernel kernel = grav_pair_kernel();
+#ifdef GRAV_X86
+    if (kernel == grav_pairs_avx2) return "avx2";
+    if (kernel == grav_pairs_sse) return "sse2";
+#endif
+    (void)kernel;
+    return "scalar";
+}
+
+typedef struct {
+    GravBodies *b;
+    WrkPool *pool;
+    GravPairKernel kernel;
+    float eps_sq;
+    float g;
+    size_t arrays;  // per worker accumulators, 3 when phi is wanted
+} GravDirectJob;
+
+// Maps a task index to the tile pair (ti, tj) with ti <= tj
+static void grav_tile_pair(size_t task, size_t *ti, size_t *tj) {
+    size_t j = (size_t)((sqrt(8.0 * task + 1) - 1) / 2);
+    while (j * (j + 1) / 2 > task) j--;
+    while ((j + 1) * (j + 2) / 2 <= task) j++;
+    *tj = j;
+    *ti = task - j * (j + 1) / 2;
+}
+
+static void grav_clear_task(void *ctx, size_t task, size_t worker) {
+    GravDirectJob *job = ctx;
+    (void)worker;
+    memset(
+        job->pool->scratch[task], 0, job->arrays * job->b->count * sizeof(float)
+    );
+}
+
+static void grav_pairs_task(void *ctx, size_t task, size_t worker) {
+    GravDirectJob *job = ctx;
+    size_t n = job->b->count;
+    float *ax = job->pool->scratch[worker];
+    float *ay = ax + n;
+    float *phi = job->arrays > 2 ? ay + n : NULL;
+    size_t ti, tj;
+    grav_tile_pair(task, &ti, &tj);
+    size_t i1 = (ti + 1) * GRAV_TILE_SIZE;
+    size_t j1 = (tj + 1) * GRAV_TILE_SIZE;
+    job->kernel(
+        job->b,
+        ax,
+        ay,
+        phi,
+        job->eps_sq,
+        ti * GRAV_TILE_SIZE,
+        i1 < n ? i1 : n,
+        tj * GRAV_TILE_SIZE,
+        j1 < n ? j1 : n
+    );
+}
+
+// Sums every worker's private accumulators for one tile of bodies
+static void grav_reduce_task(void *ctx, size_t task, size_t worker) {
+    GravDirectJob *job = ctx;
+    GravBodies *b = job->b;
+    (void)worker;
+    size_t i0 = task * GRAV_TILE_SIZE;
+    size_t i1 = i0 + GRAV_TILE_SIZE;
+    if (i1 > b->count) i1 = b->count;
+    memset(b->ax + i0, 0, (i1 - i0) * sizeof(float));
+    memset(b->ay + i0, 0, (i1 - i0) * sizeof(float));
+    for (size_t w = 0; w < job->pool->thread_count; w++) {
+        const float *ax = job->pool->scratch[w];
+        const float *ay = ax + b->count;
+        for (size_t i = i0; i < i1; i++) {
+            b->ax[i] += ax[i];
+            b->ay[i] += ay[i];
+        }
+    }
+    for (size_t i = i0; i < i1; i++) {
+        b->ax[i] *= job->g;
+        b->ay[i] *= job->g;
+    }
+    if (job->arrays < 3) return;
+
+    memset(b->phi + i0, 0, (i1 - i0) * sizeof(float));
+    for (size_t w = 0; w < job->pool->thread_count; w++) {
+        const float *phi = (const float *)job->pool->scratch[w] + 2 * b->count;
+        for (size_t i = i0; i < i1; i++) b->phi[i] += phi[i];
+    }
+    for (size_t i = i0; i < i1; i++) b->phi[i] *= -job->g;
+}
+
+// Fills one tile of targets from every tile of sources in index order, so
+// its sums come out the same whichever worker runs it
+static void grav_gather_tile_task(void *ctx, size_t task, size_t worker) {
+    GravDirectJob *job = ctx;
+    GravBodies *b = job->b;
+    float *phi = job->arrays > 2 ? b->phi : NULL;
+    (void)worker;
+    size_t i0 = task * GRAV_TILE_SIZE;
+    size_t i1 = i0 + GRAV_TILE_SIZE;
+    if (i1 > b->count) i1 = b->count;
+    memset(b->ax + i0, 0, (i1 - i0) * sizeof(float));
+    memset(b->ay + i0, 0, (i1 - i0) * sizeof(float));
+    if (phi != NULL) memset(phi + i0, 0, (i1 - i0) * sizeof(float));
+    for (size_t j0 = 0; j0 < b->count; j0 += GRAV_TILE_SIZE) {
+        size_t j1 = j0 + GRAV_TILE_SIZE;
+        job->kernel(
+            b,
+            b->ax,
+            b->ay,
+            phi,
+            job->eps_sq,
+            i0,
+            i1,
+            j0,
+            j1 < b->count ? j1 : b->count
+        );
+    }
+    for (size_t i = i0; i < i1; i++) {
+        b->ax[i] *= job->g;
+        b->ay[i] *= job->g;
+    }
+    if (phi == NULL) return;
+    for (size_t i = i0; i < i1; i++) phi[i] *= -job->g;
+}
+
+void grav_direct_tiled(GravBodies *b, GravParams params, WrkPool *pool) {
+    GravDirectJob job = {
+        .b = b,
+        .pool = pool,
+        .kernel = grav_pair_kernel(),
+        .eps_sq = params.softening * params.softening,
+        .g = params.g,
+        .arrays = params.potential ? 3 : 2,
+    };
+    size_t tiles = (b->count + GRAV_TILE_SIZE - 1) / GRAV_TILE_SIZE;
+    float *phi = params.potential ? b->phi : NULL;
+
+    if (params.deterministic) {
+        job.kernel = grav_gather_kernel();
+        if (pool != NULL) {
+            wrk_run(pool, grav_gather_tile_task, &job, tiles);
+        } else {
+            for (size_t k = 0; k < tiles; k++) {
+                grav_gather_tile_task(&job, k, 0);
+            }
+        }
+        return;
+    }
+
+    // Symmetric updates write to both tiles of a pair, so each worker adds
+    // into its own buffer and the buffers are reduced at the end.
+    if (pool != NULL && pool->thread_count > 1 &&
+        wrk_reserve_scratch(pool, job.arrays * b->count * sizeof(float))) {
+        wrk_run(pool, grav_clear_task, &job, pool->thread_count);
+        wrk_run(pool, grav_pairs_task, &job, tiles * (tiles + 1) / 2);
+        wrk_run(pool, grav_reduce_task, &job, tiles);
+        return;
+    }
+
+    grav_clear_accelerations(b);
+    if (phi != NULL) memset(phi, 0, b->count * sizeof(*phi));
+    for (size_t tj = 0; tj < tiles; tj++) {
+        for (size_t ti = 0; ti <= tj; ti++) {
+            size_t i1 = (ti + 1) * GRAV_TILE_SIZE;
+            size_t j1 = (tj + 1) * GRAV_TILE_SIZE;
+            job.kernel(
+                b,
+                b->ax,
+                b->ay,
+                phi,
+                job.eps_sq,
+                ti * GRAV_TILE_SIZE,
+                i1 < b->count ? i1 : b->count,
+                tj * GRAV_TILE_SIZE,
+                j1 < b->count ? j1 : b->count
+            );
+        }
+    }
+    for (size_t i = 0; i < b->count; i++) {
+        b->ax[i] *= params.g;
+        b->ay[i] *= params.g;
+    }
+    if (phi == NULL) return;
+    for (size_t i = 0; i < b->count; i++) phi[i] *= -params.g;
+}
+
+typedef struct {
+    GravBodies *b;
+    GravParams params;
+    const uint32_t *targets;
+    size_t count;
+} GravSubsetJob;
+
+// Inlined with a constant `potential`, like the pair kernels
+static inline __attribute__((always_inline)) void grav_gather_body(
+    GravSubsetJob *job, size_t k0, size_t k1, bool potential
+) {
+    GravBodies *b = job->b;
+    const float eps_sq = job->params.softening * job->params.softening;
+    for (size_t k = k0; k < k1; k++) {
+        size_t i = job->targets[k];
+        const float x = b->x[i];
+        const float y = b->y[i];
+        float ax = 0, ay = 0, phi = 0;
+        // The body itself adds 0 unless r_sq is 0, which is masked out
+        for (size_t j = 0; j < b->count; j++) {
+            float dx = b->x[j] - x;
+            float dy = b->y[j] - y;
+            float r_sq = dx * dx + dy * dy + eps_sq;
+            float s = r_sq > 0 ? b->m[j] / (r_sq * sqrtf(r_sq)) : 0;
+            ax += dx * s;
+            ay += dy * s;
+            // But its potential isn't 0 with softening
+            if (potential && j != i && r_sq > 0) phi += b->m[j] / sqrtf(r_sq);
+        }
+        b->ax[i] = ax * job->params.g;
+        b->ay[i] = ay * job->params.g;
+        if (potential) b->phi[i] = -phi * job->params.g;
+    }
+}
+
+static void grav_gather_task(void *ctx, size_t task, size_t worker) {
+    GravSubsetJob *job = ctx;
+    (void)worker;
+    size_t k0 = task * GRAV_SUBSET_BLOCK_SIZE;
+    size_t k1 = k0 + GRAV_SUBSET_BLOCK_SIZE;
+    if (k1 > job->count) k1 = job->count;
+    if (job->params.potential) {
+        grav_gather_body(job, k0, k1, true);
+    } else {
+        grav_gather_body(job, k0, k1, false);
+    }
+}
+
+void grav_direct_subset(
+    GravBodies *b,
+    GravParams params,
+    const uint32_t *targets,
+    size_t count,
+    WrkPool *pool
+) {
+    GravSubsetJob job = {
+        .b = b, .params = params, .targets = targets, .count = count
+    };
+    size_t blocks =
+        (count + GRAV_SUBSET_BLOCK_SIZE - 1) / GRAV_SUBSET_BLOCK_SIZE;
+    if (pool == NULL) {
+        for (size_t task = 0; task < blocks; task++) {
+            grav_gather_task(&job, task, 0);
+        }
+        return;
+    }
+    wrk_run(pool, grav_gather_task, &job, blocks);
+}
+
+void grav_direct_at(
+    const GravBodies *b, GravParams params, size_t i, double *ax, double *ay
+) {
+    const double eps_sq = (double)params.softening * params.softening;
+    *ax = 0;
+    *ay = 0;
+    for (size_t j = 0; j < b->count; j++) {
+        if (j == i) continue;
+        double dx = (double)b->x[j] - b->x[i];
+        double dy = (double)b->y[j] - b->y[i];
+        double r_sq = dx * dx + dy * dy + eps_sq;
+        if (r_sq == 0) continue;
+        double s = params.g * b->m[j] / (r_sq * sqrt(r_sq));
+        *ax += dx * s;
+        *ay += dy * s;
+    }
+}
+
+typedef struct {
+    const GravBodies *b;
+    GravParams params;
+    WrkPool *pool;
+} GravPotentialJob;
+
+static double grav_potential_rows(
+    const GravBodies *b, GravParams params, size_t i0, size_t i1
+) {
+    const double eps_sq = (double)params.softening * params.softening;
+    double sum = 0;
+    for (size_t i = i0; i < i1; i++) {
+        double row = 0;
+        for (size_t j = i + 1; j < b->count; j++) {
+            double dx = (double)b->x[j] - b->x[i];
+            double dy = (double)b->y[j] - b->y[i];
+            double r_sq = dx * dx + dy * dy + eps_sq;
+            if (r_sq > 0) row += b->m[j] / sqrt(r_sq);
+        }
+        sum += row * b->m[i];
+    }
+    return -params.g * sum;
+}
+
+static void grav_potential_task(void *ctx, size_t task, size_t worker) {
+    GravPotentialJob *job = ctx;
+    size_t i0 = task * GRAV_SUBSET_BLOCK_SIZE;
+    size_t i1 = i0 + GRAV_SUBSET_BLOCK_SIZE;
+    if (i1 > job->b->count) i1 = job->b->count;
+    double *sum = job->pool->scratch[worker];
+    *sum += grav_potential_rows(job->b, job->params, i0, i1);
+}
+
+double grav_potential(const GravBodies *b, GravParams params, WrkPool *pool) {
+    if (pool == NULL || pool->thread_count <= 1) {
+        return grav_potential_rows(b, params, 0, b->count);
+    }
+    if (!wrk_reserve_scratch(pool, sizeof(double))) return NAN;
+    for (size_t w = 0; w < pool->thread_count; w++) {
+        *(double *)pool->scratch[w] = 0;
+    }
+    GravPotentialJob job = {.b = b, .params = params, .pool = pool};
+    size_t blocks =
+        (b->count + GRAV_SUBSET_BLOCK_SIZE - 1) / GRAV_SUBSET_BLOCK_SIZE;
+    wrk_run(pool, grav_potential_task, &job, blocks);
+    double sum = 0;
+    for (size_t w = 0; w < pool->thread_count; w++) {
+        sum += *(double *)pool->scratch[w];
+    }
+    return sum;
+}
+
+static int32_t grav_tree_new_node(
+    GravTree *tree, float center_x, float center_y, float half
+) {
+    if (tree->count >= tree->capacity) {
+        size_t capacity = tree->capacity < 64 ? 64 : tree->capacity * 2;
+        if (!grav_grow((void **)&tree->items, sizeof(GravNode), capacity)) {
+            return -1;
+        }
+        tree->capacity = capacity;
+    }
+    GravNode *node = tree->items + tree->count;
+    memset(node, 0, sizeof(*node));
+    node->center_x = center_x;
+    node->center_y = center_y;
+    node->half = half;
+    node->child = -1;
+    node->first = -1;
+    return tree->count++;
+}
+
+static int grav_quadrant(const GravNode *node, float x, float y) {
+    return (x >= node->center_x) | ((y >= node->center_y) << 1);
+}
+
+// Turns a leaf into an internal node with four empty children
+static bool grav_tree_split(GravTree *tree, int32_t node_index) {
+    GravNode node = tree->items[node_index];
+    float quarter = node.half / 2;
+    int32_t first_child = -1;
+    for (int q = 0; q < 4; q++) {
+        int32_t child = grav_tree_new_node(
+            tree,
+            node.center_x + ((q & 1) ? quarter : -quarter),
+            node.center_y + ((q & 2) ? quarter : -quarter),
+            quarter
+        );
+        if (child < 0) return false;
+        if (q == 0) first_child = child;
+    }
+    tree->items[node_index].child = first_child;
+    tree->items[node_index].first = -1;
+    return true;
+}
+
+bool grav_bh_build(GravTree *tree, const GravBodies *b, float theta) {
+    tree->count = 0;
+    if (b->count > tree->next_capacity) {
+        if (!grav_grow((void **)&tree->next, sizeof(int32_t), b->count)) {
+            return false;
+        }
+        tree->next_capacity = b->count;
+    }
+
+    // Root is a square covering all bodies
+    float min_x = INFINITY, min_y = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    for (size_t i = 0; i < b->count; i++) {
+        min_x = fminf(min_x, b->x[i]);
+        min_y = fminf(min_y, b->y[i]);
+        max_x = fmaxf(max_x, b->x[i]);
+        max_y = fmaxf(max_y, b->y[i]);
+    }
+    if (b->count == 0) min_x = min_y = max_x = max_y = 0;
+    float half = fmaxf(max_x - min_x, max_y - min_y) / 2 * 1.0001f + 1e-3f;
+    if (grav_tree_new_node(
+            tree, (min_x + max_x) / 2, (min_y + max_y) / 2, half
+        ) < 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < b->count; i++) {
+        float x = b->x[i];
+        float y = b->y[i];
+        int32_t node_index = 0;
+        int depth = 0;
+        for (;;) {
+            GravNode *node = tree->items + node_index;
+            node->count++;
+            if (node->child >= 0) {
+                node_index = node->child + grav_quadrant(node, x, y);
+                depth++;
+                continue;
+            }
+            if (node->count <= GRAV_BH_LEAF_SIZE ||
+                depth >= GRAV_BH_MAX_DEPTH) {
+                tree->next[i] = node->first;
+                node->first = i;
+                break;
+            }
+            // Leaf is full: push its bodies one level down and retry
+            int32_t body = node->first;
+            if (!grav_tree_split(tree, node_index)) return false;
+            node = tree->items + node_index;
+            while (body >= 0) {
+                int32_t next = tree->next[body];
+                int32_t child =
+                    node->child + grav_quadrant(node, b->x[body], b->y[body]);
+                GravNode *child_node = tree->items + child;
+                child_node->count++;
+                tree->next[body] = child_node->first;
+                child_node->first = body;
+                body = next;
+            }
+            node_index = node->child + grav_quadrant(node, x, y);
+            depth++;
+        }
+    }
+
+    // Children are always created after their parent, so a reverse sweep
+    // computes centers of mass bottom up.
+    for (size_t n = tree->count; n-- > 0;) {
+        GravNode *node = tree->items + n;
+        float mass = 0, mx = 0, my = 0;
+        if (node->child >= 0) {
+            for (int q = 0; q < 4; q++) {
+                const GravNode *child = tree->items + node->child + q;
+                mass += child->mass;
+                mx += child->com_x * child->mass;
+                my += child->com_y * child->mass;
+            }
+        } else {
+            for (int32_t body = node->first; body >= 0;
+                 body = tree->next[body]) {
+                mass += b->m[body];
+                mx += b->x[body] * b->m[body];
+                my += b->y[body] * b->m[body];
+            }
+        }
+        node->mass = mass;
+        node->com_x = mass > 0 ? mx / mass : node->center_x;
+        node->com_y = mass > 0 ? my / mass : node->center_y;
+
+        // Opening radius, see Salmon & Warren's bmax criterion
+        float offset = hypotf(
+            node->com_x - node->center_x, node->com_y - node->center_y
+        );
+        node->radius = theta > 0 ? 2 * node->half / theta + offset : INFINITY;
+    }
+    return true;
+}
+
+// Walks targets[k0..k1), or bodies k0..k1 when targets is NULL
+static void grav_bh_walk(
+    const GravTree *tree,
+    GravBodies *b,
+    GravParams params,
+    const uint32_t *targets,
+    size_t k0,
+    size_t k1
+) {
+    const float eps_sq = params.softening * params.softening;
+    int32_t stack[4 * GRAV_BH_MAX_DEPTH + 8];
+
+    for (size_t k = k0; k < k1; k++) {
+        size_t i = targets == NULL ? k : targets[k];
+        const float x = b->x[i];
+        const float y = b->y[i];
+        float ax = 0, ay = 0, phi = 0;
+        int top = 0;
+        if (tree->count > 0) stack[top++] = 0;
+
+        while (top > 0) {
+            const GravNode *node = tree->items + stack[--top];
+            if (node->count == 0) continue;
+
+            float dx = node->com_x - x;
+            float dy = node->com_y - y;
+            float d_sq = dx * dx + dy * dy;
+            if (d_sq > node->radius * node->radius) {
+                // Far enough: treat the whole node as one point mass
+                float r_sq = d_sq + eps_sq;
+                float s = params.g * node->mass / (r_sq * sqrtf(r_sq));
+                ax += dx * s;
+                ay += dy * s;
+                if (params.potential) phi += node->mass / sqrtf(r_sq);
+            } else if (node->child >= 0) {
+                for (int q = 0; q < 4; q++) stack[top++] = node->child + q;
+            } else {
+                for (int32_t j = node->first; j >= 0; j = tree->next[j]) {
+                    if ((size_t)j == i) continue;
+                    float bx = b->x[j] - x;
+                    float by = b->y[j] - y;
+                    float r_sq = bx * bx + by * by + eps_sq;
+                    if (r_sq == 0) continue;
+                    float s = params.g * b->m[j] / (r_sq * sqrtf(r_sq));
+                    ax += bx * s;
+                    ay += by * s;
+                    if (params.potential) phi += b->m[j] / sqrtf(r_sq);
+                }
+            }
+        }
+        b->ax[i] = ax;
+        b->ay[i] = ay;
+        if (params.potential) b->phi[i] = -params.g * phi;
+    }
+}
+
+typedef struct {
+    const GravTree *tree;
+    GravBodies *b;
+    GravParams params;
+    const uint32_t *targets;
+    size_t count;
+} GravWalkJob;
+
+static void grav_bh_task(void *ctx, size_t task, size_t worker) {
+    GravWalkJob *job = ctx;
+    (void)worker;
+    size_t k0 = task * GRAV_BH_BLOCK_SIZE;
+    size_t k1 = k0 + GRAV_BH_BLOCK_SIZE;
+    if (k1 > job->count) k1 = job->count;
+    grav_bh_walk(job->tree, job->b, job->params, job->targets, k0, k1);
+}
+
+void grav_bh_forces(
+    const GravTree *tree, GravBodies *b, GravParams params, WrkPool *pool
+) {
+    grav_bh_forces_subset(tree, b, params, NULL, b->count, pool);
+}
+
+void grav_bh_forces_subset(
+    const GravTree *tree,
+    GravBodies *b,
+    GravParams params,
+    const uint32_t *targets,
+    size_t count,
+    WrkPool *pool
+) {
+    if (pool == NULL) {
+        grav_bh_walk(tree, b, params, targets, 0, count);
+        return;
+    }
+    GravWalkJob job = {
+        .tree = tree,
+        .b = b,
+        .params = params,
+        .targets = targets,
+        .count = count,
+    };
+    size_t blocks = (count + GRAV_BH_BLOCK_SIZE - 1) / GRAV_BH_BLOCK_SIZE;
+    wrk_run(pool, grav_bh_task, &job, blocks);
+}
+
+void grav_tree_free(GravTree *tree) {
+    free(tree->items);
+    free(tree->next);
+    memset(tree, 0, sizeof(*tree));
+}
+
+static size_t grav_next_pow2(size_t n) {
+    size_t result = 1;
+    while (result < n) result *= 2;
+    return result;
+}
+
+bool grav_pm_init(
+    GravMesh *mesh, float x, float y, float width, float height, float cell
+) {
+    memset(mesh, 0, sizeof(*mesh));
+    // Also rejects NaN
+    if (!(cell > 0) || !(width / cell < GRAV_PM_MAX_CELLS) ||
+        !(height / cell < GRAV_PM_MAX_CELLS)) {
+        return false;
+    }
+    mesh->origin_x = x;
+    mesh->origin_y = y;
+    mesh->cell = cell;
+    // +2 so cloud-in-cell weights of bodies on the far edge stay inside
+    mesh->used_nx = (size_t)ceilf(width / cell) + 2;
+    mesh->used_ny = (size_t)ceilf(height / cell) + 2;
+    mesh->nx = grav_next_pow2(2 * mesh->used_nx);
+    mesh->ny = grav_next_pow2(2 * mesh->used_ny);
+
+    size_t size = mesh->nx * mesh->ny;
+    size_t used = mesh->used_nx * mesh->used_ny;
+    size_t max_n = mesh->nx > mesh->ny ? mesh->nx : mesh->ny;
+    mesh->re = malloc(size * sizeof(float));
+    mesh->im = malloc(size * sizeof(float));
+    mesh->green = malloc(size * sizeof(float));
+    mesh->fx = malloc(used * sizeof(float));
+    mesh->fy = malloc(used * sizeof(float));
+    mesh->cos_table = malloc(max_n / 2 * sizeof(float));
+    mesh->sin_table = malloc(max_n / 2 * sizeof(float));
+    if (mesh->re == NULL || mesh->im == NULL || mesh->green == NULL ||
+        mesh->fx == NULL || mesh->fy == NULL || mesh->cos_table == NULL ||
+        mesh->sin_table == NULL) {
+        grav_pm_free(mesh);
+        return false;
+    }
+    for (size_t k = 0; k < max_n / 2; k++) {
+        double angle = -2 * 3.14159265358979323846 * k / max_n;
+        mesh->cos_table[k] = cos(angle);
+        mesh->sin_table[k] = sin(angle);
+    }
+    mesh->green_softening = -1;
+    return true;
+}
+
+void grav_pm_free(GravMesh *mesh) {
+    free(mesh->re);
+    free(mesh->im);
+    free(mesh->green);
+    free(mesh->fx);
+    free(mesh->fy);
+    free(mesh->cos_table);
+    free(mesh->sin_table);
+    memset(mesh, 0, sizeof(*mesh));
+}
+
+// In place radix-2 FFT of n complex values. The inverse isn't normalized.
+static void grav_fft(
+    const GravMesh *mesh,
+    float *re,
+    float *im,
+    size_t n,
+    bool inverse
+) {
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    size_t max_n = mesh->nx > mesh->ny ? mesh->nx : mesh->ny;
+    float sign = inverse ? -1 : 1;
+    for (size_t len = 2; len <= n; len *= 2) {
+        size_t step = max_n / len;
+        for (size_t start = 0; start < n; start += len) {
+            for (size_t k = 0; k < len / 2; k++) {
+                float w_re = mesh->cos_table[k * step];
+                float w_im = sign * mesh->sin_table[k * step];
+                size_t a = start + k;
+                size_t b = start + k + len / 2;
+                float t_re = re[b] * w_re - im[b] * w_im;
+                float t_im = re[b] * w_im + im[b] * w_re;
+                re[b] = re[a] - t_re;
+                im[b] = im[a] - t_im;
+                re[a] += t_re;
+                im[a] += t_im;
+            }
+        }
+    }
+}
+
+typedef struct {
+    GravMesh *mesh;
+    GravBodies *b;
+    WrkPool *pool;
+    bool inverse;
+    bool potential;
+    float self[3];  // potential of a unit mass at 0, 1 and 2 axis offsets
+} GravMeshJob;
+
+static void grav_fft_row_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    GravMesh *mesh = job->mesh;
+    size_t offset = task * mesh->nx;
+    (void)worker;
+    grav_fft(
+        mesh, mesh->re + offset, mesh->im + offset, mesh->nx, job->inverse
+    );
+}
+
+// Columns are copied out first, strided butterflies thrash the cache
+static void grav_fft_column_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    GravMesh *mesh = job->mesh;
+    float re[mesh->ny];
+    float im[mesh->ny];
+    (void)worker;
+    for (size_t y = 0; y < mesh->ny; y++) {
+        re[y] = mesh->re[y * mesh->nx + task];
+        im[y] = mesh->im[y * mesh->nx + task];
+    }
+    grav_fft(mesh, re, im, mesh->ny, job->inverse);
+    for (size_t y = 0; y < mesh->ny; y++) {
+        mesh->re[y * mesh->nx + task] = re[y];
+        mesh->im[y * mesh->nx + task] = im[y];
+    }
+}
+
+// Only the first `rows` rows hold data on the way in, or are needed on the
+// way out, so the other row transforms are skipped.
+static void grav_fft_2d(GravMeshJob *job, size_t rows, bool inverse) {
+    GravMesh *mesh = job->mesh;
+    job->inverse = inverse;
+    if (!inverse) {
+        if (job->pool != NULL) {
+            wrk_run(job->pool, grav_fft_row_task, job, rows);
+            wrk_run(job->pool, grav_fft_column_task, job, mesh->nx);
+        } else {
+            for (size_t y = 0; y < rows; y++) grav_fft_row_task(job, y, 0);
+            for (size_t x = 0; x < mesh->nx; x++) {
+                grav_fft_column_task(job, x, 0);
+            }
+        }
+    } else {
+        if (job->pool != NULL) {
+            wrk_run(job->pool, grav_fft_column_task, job, mesh->nx);
+            wrk_run(job->pool, grav_fft_row_task, job, rows);
+        } else {
+            for (size_t x = 0; x < mesh->nx; x++) {
+                grav_fft_column_task(job, x, 0);
+            }
+            for (size_t y = 0; y < rows; y++) grav_fft_row_task(job, y, 0);
+        }
+    }
+}
+
+// Potential of a unit mass, -G / r, sampled at mesh offsets and transformed.
+// Offsets past half of the mesh stand for negative distances.
+static void grav_pm_green(GravMeshJob *job, GravParams params) {
+    GravMesh *mesh = job->mesh;
+    float eps = fmaxf(params.softening, mesh->cell / 2);
+    for (size_t y = 0; y < mesh->ny; y++) {
+        float dy = (y <= mesh->ny / 2 ? (float)y : (float)y - mesh->ny);
+        for (size_t x = 0; x < mesh->nx; x++) {
+            float dx = (x <= mesh->nx / 2 ? (float)x : (float)x - mesh->nx);
+            float r_sq = (dx * dx + dy * dy) * mesh->cell * mesh->cell;
+            mesh->re[y * mesh->nx + x] = -params.g / sqrtf(r_sq + eps * eps);
+            mesh->im[y * mesh->nx + x] = 0;
+        }
+    }
+    grav_fft_2d(job, mesh->ny, false);
+    // Fold in the normalization of the inverse transform
+    float scale = 1.0f / (mesh->nx * mesh->ny);
+    for (size_t i = 0; i < mesh->nx * mesh->ny; i++) {
+        mesh->green[i] = mesh->re[i] * scale;
+    }
+    mesh->green_g = params.g;
+    mesh->green_softening = params.softening;
+}
+
+// Cloud-in-cell cell and weights of a body, clamped to the used cells
+static void grav_pm_cell(
+    const GravMesh *mesh,
+    float x,
+    float y,
+    size_t *ix,
+    size_t *iy,
+    float *wx,
+    float *wy
+) {
+    float gx = (x - mesh->origin_x) / mesh->cell;
+    float gy = (y - mesh->origin_y) / mesh->cell;
+    gx = fminf(fmaxf(gx, 0), mesh->used_nx - 1.001f);
+    gy = fminf(fmaxf(gy, 0), mesh->used_ny - 1.001f);
+    *ix = (size_t)gx;
+    *iy = (size_t)gy;
+    *wx = gx - *ix;
+    *wy = gy - *iy;
+}
+
+static void grav_pm_deposit(
+    const GravMesh *mesh,
+    const GravBodies *b,
+    float *rho,
+    size_t stride,
+    size_t i0,
+    size_t i1
+) {
+    for (size_t i = i0; i < i1; i++) {
+        size_t ix, iy;
+        float wx, wy;
+        grav_pm_cell(mesh, b->x[i], b->y[i], &ix, &iy, &wx, &wy);
+        float *cell = rho + iy * stride + ix;
+        float m = b->m[i];
+        cell[0] += m * (1 - wx) * (1 - wy);
+        cell[1] += m * wx * (1 - wy);
+        cell[stride] += m * (1 - wx) * wy;
+        cell[stride + 1] += m * wx * wy;
+    }
+}
+
+static void grav_pm_clear_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    size_t used = job->mesh->used_nx * job->mesh->used_ny;
+    (void)worker;
+    memset(job->pool->scratch[task], 0, used * sizeof(float));
+}
+
+// Each worker deposits into its own copy of the used cells
+static void grav_pm_deposit_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    size_t i0 = task * GRAV_BH_BLOCK_SIZE;
+    size_t i1 = i0 + GRAV_BH_BLOCK_SIZE;
+    if (i1 > job->b->count) i1 = job->b->count;
+    grav_pm_deposit(
+        job->mesh,
+        job->b,
+        job->pool->scratch[worker],
+        job->mesh->used_nx,
+        i0,
+        i1
+    );
+}
+
+static void grav_pm_reduce_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    GravMesh *mesh = job->mesh;
+    float *row = mesh->re + task * mesh->nx;
+    (void)worker;
+    for (size_t w = 0; w < job->pool->thread_count; w++) {
+        const float *rho = job->pool->scratch[w];
+        rho += task * mesh->used_nx;
+        for (size_t x = 0; x < mesh->used_nx; x++) row[x] += rho[x];
+    }
+}
+
+// Central differences of the potential. Mesh indices wrap, which is correct
+// for the padded convolution as long as the domain fills at most half of it.
+static void grav_pm_gradient_task(void *ctx, size_t task, size_t worker) {
+    GravMesh *mesh = ((GravMeshJob *)ctx)->mesh;
+    size_t nx = mesh->nx, ny = mesh->ny;
+    size_t y = task;
+    const float *phi = mesh->re;
+    float scale = -0.5f / mesh->cell;
+    (void)worker;
+    for (size_t x = 0; x < mesh->used_nx; x++) {
+        size_t left = (x + nx - 1) % nx, right = (x + 1) % nx;
+        size_t up = (y + ny - 1) % ny, down = (y + 1) % ny;
+        mesh->fx[y * mesh->used_nx + x] =
+            scale * (phi[y * nx + right] - phi[y * nx + left]);
+        mesh->fy[y * mesh->used_nx + x] =
+            scale * (phi[down * nx + x] - phi[up * nx + x]);
+    }
+}
+
+static void grav_pm_interpolate_task(void *ctx, size_t task, size_t worker) {
+    GravMeshJob *job = ctx;
+    const GravMesh *mesh = job->mesh;
+    GravBodies *b = job->b;
+    size_t stride = mesh->used_nx;
+    size_t i0 = task * GRAV_BH_BLOCK_SIZE;
+    size_t i1 = i0 + GRAV_BH_BLOCK_SIZE;
+    if (i1 > b->count) i1 = b->count;
+    (void)worker;
+    for (size_t i = i0; i < i1; i++) {
+        size_t ix, iy;
+        float wx, wy;
+        grav_pm_cell(mesh, b->x[i], b->y[i], &ix, &iy, &wx, &wy);
+        size_t c = iy * stride + ix;
+        float w00 = (1 - wx) * (1 - wy), w10 = wx * (1 - wy);
+        float w01 = (1 - wx) * wy, w11 = wx * wy;
+        b->ax[i] = w00 * mesh->fx[c] + w10 * mesh->fx[c + 1] +
+                   w01 * mesh->fx[c + stride] + w11 * mesh->fx[c + stride + 1];
+        b->ay[i] = w00 * mesh->fy[c] + w10 * mesh->fy[c + 1] +
+                   w01 * mesh->fy[c + stride] + w11 * mesh->fy[c + stride + 1];
+        if (!job->potential) continue;
+
+        // The mesh potential includes the body's own cloud, which sees
+        // itself through the Green's function at offsets of 0 or 1 cell
+        const float *phi = mesh->re + iy * mesh->nx + ix;
+        float mesh_phi = w00 * phi[0] + w10 * phi[1] +
+                         w01 * phi[mesh->nx] + w11 * phi[mesh->nx + 1];
+        float same_x = (1 - wx) * (1 - wx) + wx * wx;
+        float same_y = (1 - wy) * (1 - wy) + wy * wy;
+        float self = same_x * same_y * job->self[0] +
+                     (same_x * 2 * wy * (1 - wy) +
+                      same_y * 2 * wx * (1 - wx)) *
+                         job->self[1] +
+                     4 * wx * (1 - wx) * wy * (1 - wy) * job->self[2];
+        b->phi[i] = mesh_phi - b->m[i] * self;
+    }
+}
+
+bool grav_pm_forces(
+    GravMesh *mesh, GravBodies *b, GravParams params, WrkPool *pool
+) {
+    GravMeshJob job = {
+        .mesh = mesh, .b = b, .pool = pool, .potential = params.potential
+    };
+    size_t size = mesh->nx * mesh->ny;
+    size_t used = mesh->used_nx * mesh->used_ny;
+    size_t blocks = (b->count + GRAV_BH_BLOCK_SIZE - 1) / GRAV_BH_BLOCK_SIZE;
+
+    if (mesh->green_g != params.g ||
+        mesh->green_softening != params.softening) {
+        grav_pm_green(&job, params);
+    }
+    float eps = fmaxf(params.softening, mesh->cell / 2);
+    for (int k = 0; k < 3; k++) {
+        float r_sq = k * mesh->cell * mesh->cell;
+        job.self[k] = -params.g / sqrtf(r_sq + eps * eps);
+    }
+
+    memset(mesh->re, 0, size * sizeof(float));
+    memset(mesh->im, 0, size * sizeof(float));
+    // The per worker copies would be summed in an order that depends on
+    // which worker got which bodies, so deterministic runs deposit serially
+    if (pool != NULL && pool->thread_count > 1 && !params.deterministic) {
+        if (!wrk_reserve_scratch(pool, used * sizeof(float))) return false;
+        wrk_run(pool, grav_pm_clear_task, &job, pool->thread_count);
+        wrk_run(pool, grav_pm_deposit_task, &job, blocks);
+        wrk_run(pool, grav_pm_reduce_task, &job, mesh->used_ny);
+    } else {
+        grav_pm_deposit(mesh, b, mesh->re, mesh->nx, 0, b->count);
+    }
+
+    // Convolve the mass with the Green's function to get the potential
+    grav_fft_2d(&job, mesh->used_ny, false);
+    for (size_t i = 0; i < size; i++) {
+        mesh->re[i] *= mesh->green[i];
+        mesh->im[i] *= mesh->green[i];
+    }
+    // Gradient reads one row past the used ones, which wraps to the last
+    size_t rows = mesh->used_ny + 1;
+    grav_fft_2d(&job, rows, true);
+    grav_fft_row_task(&job, mesh->ny - 1, 0);
+
+    if (pool != NULL) {
+        wrk_run(pool, grav_pm_gradient_task, &job, mesh->used_ny);
+        wrk_run(pool, grav_pm_interpolate_task, &job, blocks);
+    } else {
+        for (size_t y = 0; y < mesh->used_ny; y++) {
+            grav_pm_gradient_task(&job, y, 0);
+        }
+        for (size_t k = 0; k < blocks; k++) {
+            grav_pm_interpolate_task(&job, k, 0);
+        }
+    }
+    return true;
+}
+
+#endif  // end of GRAVITY_IMPLEMENTATION
+#endif  // end of header guard
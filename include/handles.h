@@ -0,0 +1,152 @@
+/* Stable handles to items that are kept packed in parallel arrays.
+Items are removed by moving the last one into the hole, so their indices
+change, but a handle keeps referring to the same item until it's removed.
+Freed slots go on a free list and come back with a new generation, so a
+stale handle is rejected instead of aliasing a newer item, e.g.
+    HdlHandle h = hdl_push(&table);  // item goes to index table.count - 1
+    ...
+    size_t i;
+    if (hdl_index(&table, h, &i)) {
+        items[i] = items[table.count - 1];
+        hdl_swap_remove(&table, i);
+    }
+*/
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HDL_NONE 0
+#define HDL_NO_SLOT UINT32_MAX
+
+typedef uint64_t HdlHandle;  // generation << 32 | slot, never HDL_NONE
+
+typedef struct {
+    uint32_t *slot_index;       // slot to item index, or to next free slot
+    uint32_t *slot_generation;  // odd while the slot is in use
+    uint32_t *owner;            // item index to slot
+    uint32_t free_slot;         // head of the free list
+    size_t slots;               // slots handed out so far
+    size_t count;               // live items
+    size_t capacity;
+    uint32_t *spare_owner;  // hdl_permute gathers into it, then swaps
+    size_t spare_capacity;
+} HandleTable;
+
+void hdl_init(HandleTable *table);
+// Grows geometrically, so pushing one item at a time stays amortized O(1).
+// Returns false when memory couldn't be allocated.
+bool hdl_reserve(HandleTable *table, size_t capacity);
+// Handle of a new item at index count. Returns HDL_NONE when memory
+// couldn't be allocated.
+HdlHandle hdl_push(HandleTable *table);
+// Returns false when the handle's item has been removed
+bool hdl_index(const HandleTable *table, HdlHandle handle, size_t *index);
+HdlHandle hdl_handle(const HandleTable *table, size_t index);
+// Removes item `index` and moves the last item in its place
+void hdl_swap_remove(HandleTable *table, size_t index);
+// Moves item order[k] to index k for every item, all at once.
+// Returns false when memory for the spare array couldn't be allocated.
+bool hdl_permute(HandleTable *table, const uint32_t *order);
+void hdl_free(HandleTable *table);
+
+#ifdef HANDLES_IMPLEMENTATION
+
+void hdl_init(HandleTable *table) {
+    memset(table, 0, sizeof(*table));
+    table->free_slot = HDL_NO_SLOT;
+}
+
+static bool hdl_realloc(uint32_t **items, size_t count) {
+    uint32_t *new_items = realloc(*items, count * sizeof(uint32_t));
+    if (new_items == NULL) return false;
+    *items = new_items;
+    return true;
+}
+
+bool hdl_reserve(HandleTable *table, size_t capacity) {
+    if (capacity <= table->capacity) return true;
+    if (capacity < 2 * table->capacity) capacity = 2 * table->capacity;
+    // Slots are only added when none are free, so they never outnumber
+    // live items and share the capacity
+    if (!hdl_realloc(&table->slot_index, capacity) ||
+        !hdl_realloc(&table->slot_generation, capacity) ||
+        !hdl_realloc(&table->owner, capacity)) {
+        return false;
+    }
+    table->capacity = capacity;
+    return true;
+}
+
+HdlHandle hdl_push(HandleTable *table) {
+    if (!hdl_reserve(table, table->count + 1)) return HDL_NONE;
+    uint32_t slot = table->free_slot;
+    if (slot == HDL_NO_SLOT) {
+        slot = table->slots++;
+        table->slot_generation[slot] = 0;
+    } else {
+        table->free_slot = table->slot_index[slot];
+    }
+    table->slot_generation[slot]++;
+    table->slot_index[slot] = table->count;
+    table->owner[table->count++] = slot;
+    return hdl_handle(table, table->count - 1);
+}
+
+bool hdl_index(const HandleTable *table, HdlHandle handle, size_t *index) {
+    uint32_t slot = (uint32_t)handle;
+    uint32_t generation = handle >> 32;
+    if (slot >= table->slots || table->slot_generation[slot] != generation ||
+        generation % 2 == 0) {
+        return false;
+    }
+    *index = table->slot_index[slot];
+    return true;
+}
+
+HdlHandle hdl_handle(const HandleTable *table, size_t index) {
+    uint32_t slot = table->owner[index];
+    return (HdlHandle)table->slot_generation[slot] << 32 | slot;
+}
+
+void hdl_swap_remove(HandleTable *table, size_t index) {
+    uint32_t slot = table->owner[index];
+    uint32_t last = table->owner[--table->count];
+    table->owner[index] = last;
+    table->slot_index[last] = index;
+
+    table->slot_generation[slot]++;
+    table->slot_index[slot] = table->free_slot;
+    table->free_slot = slot;
+}
+
+bool hdl_permute(HandleTable *table, const uint32_t *order) {
+    if (table->count == 0) return true;
+    if (table->spare_capacity != table->capacity) {
+        if (!hdl_realloc(&table->spare_owner, table->capacity)) return false;
+        table->spare_capacity = table->capacity;
+    }
+    uint32_t *owner = table->spare_owner;
+    for (size_t k = 0; k < table->count; k++) {
+        owner[k] = table->owner[order[k]];
+        table->slot_index[owner[k]] = k;
+    }
+    table->spare_owner = table->owner;
+    table->owner = owner;
+    return true;
+}
+
+void hdl_free(HandleTable *table) {
+    free(table->slot_index);
+    free(table->slot_generation);
+    free(table->owner);
+    free(table->spare_owner);
+    hdl_init(table);
+}
+
+#endif  // end of HANDLES_IMPLEMENTATION
+#endif  // end of header guard
@@ -0,0 +1,822 @@
+/* HashLife on an unbounded plane.
+The universe is a quadtree whose nodes are hash consed, so equal regions
+share one node wherever and whenever they appear. Leaves are 8x8 blocks
+with row y in byte y and x in bit x of that byte. A node of level L is
+2^L cells wide and memoizes its result: the center 2^(L-1) square after
+2^min(step_log, L-2) generations, computed from nine overlapping children
+of level L-1. hl_step advances the whole universe by 2^step_log
+generations at once, so patterns with any regularity can be run for
+billions of generations. Any Life-like rule without births from 0
+neighbors works, as empty space has to stay empty.
+Nodes live in blocks and are garbage collected when their count reaches
+the memory cap: nodes reachable from the root, the empty nodes and the
+nodes that a step in progress keeps on `keep` survive, with their
+memoized results when there is room for them. When even the live nodes
+don't fit in half the cap, the cap grows and a warning is printed.
+*/
+#ifndef HASHLIFE_H
+#define HASHLIFE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "life.h"
+
+#define HL_LEAF_LEVEL 3
+// Coordinates are int64_t, which a root of this level just about covers
+#define HL_MAX_LEVEL 62
+#define HL_BLOCK_NODES 4096
+// Nodes that are read whole when reporting rows of 64 cells
+#define HL_WORD_LEVEL 6
+
+typedef struct HlNode HlNode;
+struct HlNode {
+    HlNode *nw, *ne, *sw, *se;  // NULL for leaves
+    HlNode *result;             // memoized, NULL until computed
+    HlNode *hash_next;          // bucket chain, or free list
+    uint64_t cells;             // of leaves
+    uint64_t population;
+    uint8_t level;
+    bool marked;
+};
+
+// Called with live cells (x + i, y) for every set bit i of `bits`
+typedef void (*HlWordFn)(void *ctx, int64_t x, int64_t y, uint64_t bits);
+
+typedef struct {
+    HlNode *root;  // centered on (0, 0)
+    uint64_t generation;
+    unsigned step_log;  // hl_step advances 2^step_log generations
+    LifeRule rule;
+
+    HlNode **table;
+    size_t bucket_count;
+    size_t node_count;  // live nodes, in the table
+    size_t max_nodes;   // from the memory cap
+    HlNode *free;
+    HlNode **blocks;
+    size_t block_count;
+    size_t gc_count;
+
+    HlNode *empty[HL_MAX_LEVEL + 2];  // created on demand
+    HlNode **keep;  // nodes a step in progress still needs
+    size_t keep_count;
+    size_t keep_capacity;
+} HlUniverse;
+
+// `max_bytes` caps node memory, 0 means no cap.
+// Returns false when memory couldn't be allocated.
+bool hl_init(HlUniverse *universe, size_t max_bytes);
+void hl_free(HlUniverse *universe);
+// Removes every cell and resets the generation
+void hl_clear(HlUniverse *universe);
+bool hl_get(HlUniverse *universe, int64_t x, int64_t y);
+void hl_set(HlUniverse *universe, int64_t x, int64_t y, bool alive);
+uint64_t hl_population(const HlUniverse *universe);
+// Changing the step drops the memoized results that depend on it, those of
+// nodes more than two levels above the smaller of the old and new step
+void hl_set_step_log(HlUniverse *universe, unsigned step_log);
+// Universes start with B3/S23, and changing the rule drops every memoized
+// result too. Rules with B0 aren't supported.
+void hl_set_rule(HlUniverse *universe, LifeRule rule);
+// Advances 2^step_log generations.
+// Returns false when the pattern grew past the coordinate range.
+bool hl_step(HlUniverse *universe);
+// Node memory in bytes, including the hash table
+size_t hl_memory(const HlUniverse *universe);
+// Ors the live cells of [x, x + width) x [y, y + height) into rows of bit
+// packed words, `stride` words apart, laid out like a LifeBoard
+void hl_read_rows(
+    HlUniverse *universe,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    uint64_t *rows,
+    size_t stride
+);
+// Reports every live cell once, a row of up to 64 of them at a time and in
+// no particular order. Only non empty nodes are visited, so it costs time
+// in proportion to the live cells rather than to their bounding box.
+void hl_read_words(const HlUniverse *universe, HlWordFn word, void *ctx);
+// Ors the bits of rows of bit packed words, `stride` words apart, into the
+// cells of [x, x + width) x [y, y + height)
+void hl_write_rows(
+    HlUniverse *universe,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+);
+// Smallest [x0, x1) x [y0, y1) holding every live cell.
+// Returns false when there are none.
+bool hl_bounds(
+    const HlUniverse *universe,
+    int64_t *x0,
+    int64_t *y0,
+    int64_t *x1,
+    int64_t *y1
+);
+
+#ifdef HASHLIFE_IMPLEMENTATION
+
+static void hl_fail(const char *what) {
+    fprintf(stderr, "HashLife: couldn't allocate memory for %s.\n", what);
+    exit(-1);
+}
+
+static size_t hl_bucket(const HlUniverse *universe, const HlNode *node) {
+    uint64_t h;
+    if (node->level == HL_LEAF_LEVEL) {
+        h = node->cells * 0x9E3779B97F4A7C15ull;
+    } else {
+        h = (uintptr_t)node->nw * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (uintptr_t)node->ne) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (uintptr_t)node->sw) * 0x94D049BB133111EBull;
+        h = (h ^ (uintptr_t)node->se) * 0x9E3779B97F4A7C15ull;
+    }
+    return (h ^ h >> 29) & (universe->bucket_count - 1);
+}
+
+static void hl_resize_table(HlUniverse *universe, size_t bucket_count) {
+    HlNode **old = universe->table;
+    size_t old_count = universe->bucket_count;
+    universe->table = calloc(bucket_count, sizeof(HlNode *));
+    if (universe->table == NULL) hl_fail("the node table");
+    universe->bucket_count = bucket_count;
+    for (size_t b = 0; b < old_count; b++) {
+        HlNode *node = old[b];
+        while (node != NULL) {
+            HlNode *next = node->hash_next;
+            size_t bucket = hl_bucket(universe, node);
+            node->hash_next = universe->table[bucket];
+            universe->table[bucket] = node;
+            node = next;
+        }
+    }
+    free(old);
+}
+
+static void hl_mark(HlNode *node, bool results) {
+    while (node != NULL && !node->marked) {
+        node->marked = true;
+        if (results) hl_mark(node->result, true);
+        if (node->level == HL_LEAF_LEVEL) return;
+        hl_mark(node->nw, results);
+        hl_mark(node->ne, results);
+        hl_mark(node->sw, results);
+        node = node->se;
+    }
+}
+
+// Drops the memoized results of the nodes above `level`
+static void hl_forget_results(HlUniverse *universe, unsigned level) {
+    for (size_t b = 0; b < universe->bucket_count; b++) {
+        for (HlNode *n = universe->table[b]; n != NULL; n = n->hash_next) {
+            if (n->level > level) n->result = NULL;
+        }
+    }
+}
+
+static void hl_collect(HlUniverse *universe, bool results) {
+    hl_mark(universe->root, results);
+    for (size_t k = 0; k < universe->keep_count; k++) {
+        hl_mark(universe->keep[k], results);
+    }
+    for (int level = 0; level <= HL_MAX_LEVEL + 1; level++) {
+        hl_mark(universe->empty[level], results);
+    }
+    for (size_t b = 0; b < universe->bucket_count; b++) {
+        HlNode **link = &universe->table[b];
+        while (*link != NULL) {
+            HlNode *node = *link;
+            if (node->marked) {
+                node->marked = false;
+                link = &node->hash_next;
+            } else {
+                *link = node->hash_next;
+                node->hash_next = universe->free;
+                universe->free = node;
+                universe->node_count--;
+            }
+        }
+    }
+}
+
+static void hl_gc(HlUniverse *universe) {
+    universe->gc_count++;
+    hl_collect(universe, true);
+    if (universe->node_count <= universe->max_nodes / 2) return;
+    // Results take too much room, keep only the nodes themselves
+    hl_forget_results(universe, 0);
+    hl_collect(universe, false);
+    if (universe->node_count <= universe->max_nodes / 2) return;
+    // With room to spare, or the next collection would come right away
+    universe->max_nodes = 4 * universe->node_count;
+    fprintf(
+        stderr,
+        "HashLife: %zu live nodes don't fit in the memory cap, raising it to "
+        "%zu MB.\n",
+        universe->node_count,
+        universe->max_nodes * sizeof(HlNode) >> 20
+    );
+}
+
+// Returns the node equal to `key`, creating it if there is none
+static HlNode *hl_intern(HlUniverse *universe, const HlNode *key) {
+    size_t bucket = hl_bucket(universe, key);
+    for (HlNode *n = universe->table[bucket]; n != NULL; n = n->hash_next) {
+        if (n->level != key->level) continue;
+        if (key->level == HL_LEAF_LEVEL ? n->cells == key->cells
+                                        : n->nw == key->nw &&
+                                              n->ne == key->ne &&
+                                              n->sw == key->sw &&
+                                              n->se == key->se) {
+            return n;
+        }
+    }
+
+    if (universe->node_count >= universe->max_nodes) hl_gc(universe);
+    if (universe->free == NULL) {
+        HlNode *block = malloc(HL_BLOCK_NODES * sizeof(HlNode));
+        HlNode **blocks = realloc(
+            universe->blocks, (universe->block_count + 1) * sizeof(HlNode *)
+        );
+        if (block == NULL || blocks == NULL) hl_fail("nodes");
+        universe->blocks = blocks;
+        universe->blocks[universe->block_count++] = block;
+        for (size_t k = 0; k < HL_BLOCK_NODES; k++) {
+            block[k].hash_next = universe->free;
+            universe->free = &block[k];
+        }
+    }
+    if (universe->node_count >= universe->bucket_count) {
+        hl_resize_table(universe, 2 * universe->bucket_count);
+    }
+
+    HlNode *node = universe->free;
+    universe->free = node->hash_next;
+    *node = *key;
+    bucket = hl_bucket(universe, node);
+    node->hash_next = universe->table[bucket];
+    universe->table[bucket] = node;
+    universe->node_count++;
+    return node;
+}
+
+static HlNode *hl_leaf(HlUniverse *universe, uint64_t cells) {
+    HlNode key = {
+        .cells = cells,
+        .population = __builtin_popcountll(cells),
+        .level = HL_LEAF_LEVEL,
+    };
+    return hl_intern(universe, &key);
+}
+
+// The children must be safe from collection, i.e. reachable from the root
+// or from `keep`
+static HlNode *hl_join(
+    HlUniverse *universe, HlNode *nw, HlNode *ne, HlNode *sw, HlNode *se
+) {
+    HlNode key = {
+        .nw = nw,
+        .ne = ne,
+        .sw = sw,
+        .se = se,
+        .population =
+            nw->population + ne->population + sw->population + se->population,
+        .level = nw->level + 1,
+    };
+    return hl_intern(universe, &key);
+}
+
+static HlNode *hl_keep(HlUniverse *universe, HlNode *node) {
+    if (universe->keep_count == universe->keep_capacity) {
+        size_t capacity = 2 * universe->keep_capacity + 64;
+        HlNode **keep = realloc(universe->keep, capacity * sizeof(HlNode *));
+        if (keep == NULL) hl_fail("the keep stack");
+        universe->keep = keep;
+        universe->keep_capacity = capacity;
+    }
+    universe->keep[universe->keep_count++] = node;
+    return node;
+}
+
+static HlNode *hl_empty(HlUniverse *universe, int level) {
+    if (universe->empty[level] == NULL) {
+        universe->empty[level] =
+            level == HL_LEAF_LEVEL
+                ? hl_leaf(universe, 0)
+                : hl_join(
+                      universe,
+                      hl_empty(universe, level - 1),
+                      hl_empty(universe, level - 1),
+                      hl_empty(universe, level - 1),
+                      hl_empty(universe, level - 1)
+                  );
+    }
+    return universe->empty[level];
+}
+
+bool hl_init(HlUniverse *universe, size_t max_bytes) {
+    memset(universe, 0, sizeof(*universe));
+    universe->max_nodes =
+        max_bytes > 0 ? max_bytes / (sizeof(HlNode) + sizeof(HlNode *))
+                      : SIZE_MAX;
+    if (universe->max_nodes < 1024) universe->max_nodes = 1024;
+    universe->rule = LIFE_CONWAY;
+    universe->bucket_count = 1 << 16;
+    universe->table = calloc(universe->bucket_count, sizeof(HlNode *));
+    if (universe->table == NULL) return false;
+    universe->root = hl_empty(universe, HL_LEAF_LEVEL + 1);
+    return true;
+}
+
+void hl_free(HlUniverse *universe) {
+    for (size_t k = 0; k < universe->block_count; k++) {
+        free(universe->blocks[k]);
+    }
+    free(universe->blocks);
+    free(universe->table);
+    free(universe->keep);
+    memset(universe, 0, sizeof(*universe));
+}
+
+void hl_clear(HlUniverse *universe) {
+    universe->root = hl_empty(universe, HL_LEAF_LEVEL + 1);
+    universe->generation = 0;
+}
+
+uint64_t hl_population(const HlUniverse *universe) {
+    return universe->root->population;
+}
+
+size_t hl_memory(const HlUniverse *universe) {
+    return universe->block_count * HL_BLOCK_NODES * sizeof(HlNode) +
+           universe->bucket_count * sizeof(HlNode *);
+}
+
+void hl_set_step_log(HlUniverse *universe, unsigned step_log) {
+    if (step_log > HL_MAX_LEVEL - 3) step_log = HL_MAX_LEVEL - 3;
+    if (step_log == universe->step_log) return;
+    // Nodes up to step_log + 2 levels advance at full speed, so their results
+    // hold for any step at least as large
+    unsigned kept =
+        step_log < universe->step_log ? step_log : universe->step_log;
+    universe->step_log = step_log;
+    hl_forget_results(universe, kept + 2);
+}
+
+void hl_set_rule(HlUniverse *universe, LifeRule rule) {
+    if (rule.birth == universe->rule.birth &&
+        rule.survive == universe->rule.survive) {
+        return;
+    }
+    universe->rule = rule;
+    hl_forget_results(universe, 0);
+}
+
+// Same size, centered in a node twice as wide
+static HlNode *hl_expand(HlUniverse *universe, HlNode *node) {
+    size_t keep = universe->keep_count;
+    HlNode *e = hl_empty(universe, node->level - 1);
+    hl_keep(universe, node);
+    HlNode *nw = hl_keep(universe, hl_join(universe, e, e, e, node->nw));
+    HlNode *ne = hl_keep(universe, hl_join(universe, e, e, node->ne, e));
+    HlNode *sw = hl_keep(universe, hl_join(universe, e, node->sw, e, e));
+    HlNode *se = hl_keep(universe, hl_join(universe, node->se, e, e, e));
+    HlNode *expanded = hl_join(universe, nw, ne, sw, se);
+    universe->keep_count = keep;
+    return expanded;
+}
+
+static int64_t hl_half(const HlNode *node) {
+    return (int64_t)1 << (node->level - 1);
+}
+
+bool hl_get(HlUniverse *universe, int64_t x, int64_t y) {
+    HlNode *node = universe->root;
+    int64_t half = hl_half(node);
+    if (x < -half || x >= half || y < -half || y >= half) return false;
+    // Top left corner of node
+    x += half;
+    y += half;
+    while (node->level > HL_LEAF_LEVEL) {
+        half = hl_half(node);
+        bool east = x >= half, south = y >= half;
+        node = south ? (east ? node->se : node->sw)
+                     : (east ? node->ne : node->nw);
+        if (east) x -= half;
+        if (south) y -= half;
+    }
+    return node->cells >> (8 * y + x) & 1;
+}
+
+// (x, y) relative to the node's top left corner
+static HlNode *hl_set_node(
+    HlUniverse *universe, HlNode *node, int64_t x, int64_t y, bool alive
+) {
+    if (node->level == HL_LEAF_LEVEL) {
+        uint64_t bit = 1ull << (8 * y + x);
+        return hl_leaf(
+            universe, alive ? node->cells | bit : node->cells & ~bit
+        );
+    }
+    int64_t half = hl_half(node);
+    bool east = x >= half, south = y >= half;
+    HlNode *nw = node->nw, *ne = node->ne, *sw = node->sw, *se = node->se;
+    HlNode **child = south ? (east ? &se : &sw) : (east ? &ne : &nw);
+    size_t keep = universe->keep_count;
+    hl_keep(universe, node);
+    *child = hl_keep(
+        universe,
+        hl_set_node(
+            universe, *child, east ? x - half : x, south ? y - half : y, alive
+        )
+    );
+    HlNode *result = hl_join(universe, nw, ne, sw, se);
+    universe->keep_count = keep;
+    return result;
+}
+
+void hl_set(HlUniverse *universe, int64_t x, int64_t y, bool alive) {
+    int64_t half = hl_half(universe->root);
+    while (x < -half || x >= half || y < -half || y >= half) {
+        if (!alive) return;
+        if (universe->root->level >= HL_MAX_LEVEL) return;
+        universe->root = hl_expand(universe, universe->root);
+        half = hl_half(universe->root);
+    }
+    universe->root =
+        hl_set_node(universe, universe->root, x + half, y + half, alive);
+}
+
+// Steps 16x16 cells in rows of 16 bits without wrapping. Cells on the
+// border go wrong, one more row and column of them every generation.
+static void hl_step_rows(LifeRule rule, uint32_t rows[16], int generations) {
+    LifeMasks masks = life_masks(rule);
+    for (int g = 0; g < generations; g++) {
+        uint64_t lo[18] = {0}, hi[18] = {0};
+        for (int y = 0; y < 16; y++) {
+            life_sum3(rows[y], 0, 0, &lo[y + 1], &hi[y + 1]);
+        }
+        uint32_t next[16];
+        for (int y = 0; y < 16; y++) {
+            next[y] = life_combine_masks(
+                          &masks,
+                          lo[y],
+                          hi[y],
+                          lo[y + 1],
+                          hi[y + 1],
+                          lo[y + 2],
+                          hi[y + 2],
+                          rows[y]
+                      ) &
+                      0xFFFF;
+        }
+        memcpy(rows, next, sizeof(next));
+    }
+}
+
+// Center 8x8 of a level 4 node, after `generations` of at most 4
+static HlNode *hl_leaf_result(
+    HlUniverse *universe, HlNode *node, int generations
+) {
+    uint32_t rows[16];
+    for (int y = 0; y < 8; y++) {
+        rows[y] = (node->nw->cells >> 8 * y & 0xFF) |
+                  (node->ne->cells >> 8 * y & 0xFF) << 8;
+        rows[y + 8] = (node->sw->cells >> 8 * y & 0xFF) |
+                      (node->se->cells >> 8 * y & 0xFF) << 8;
+    }
+    hl_step_rows(universe->rule, rows, generations);
+    uint64_t cells = 0;
+    for (int y = 0; y < 8; y++) {
+        cells |= (uint64_t)(rows[y + 4] >> 4 & 0xFF) << 8 * y;
+    }
+    return hl_leaf(universe, cells);
+}
+
+// Center half of a node, as it is now
+static HlNode *hl_center(HlUniverse *universe, HlNode *node) {
+    if (node->level > HL_LEAF_LEVEL + 1) {
+        return hl_join(
+            universe, node->nw->se, node->ne->sw, node->sw->ne, node->se->nw
+        );
+    }
+    return hl_leaf_result(universe, node, 0);
+}
+
+static HlNode *hl_result(HlUniverse *universe, HlNode *node) {
+    if (node->result != NULL) return node->result;
+    if (node->population == 0) {
+        return node->result = hl_empty(universe, node->level - 1);
+    }
+    unsigned level = node->level;
+    if (level == HL_LEAF_LEVEL + 1) {
+        unsigned step_log = universe->step_log < 2 ? universe->step_log : 2;
+        return node->result = hl_leaf_result(universe, node, 1 << step_log);
+    }
+
+    size_t keep = universe->keep_count;
+    hl_keep(universe, node);
+    HlNode *nw = node->nw, *ne = node->ne, *sw = node->sw, *se = node->se;
+    // Nine overlapping quarters, row by row
+    HlNode *n[9] = {nw, NULL, ne, NULL, NULL, NULL, sw, NULL, se};
+    n[1] = hl_join(universe, nw->ne, ne->nw, nw->se, ne->sw);
+    hl_keep(universe, n[1]);
+    n[3] = hl_join(universe, nw->sw, nw->se, sw->nw, sw->ne);
+    hl_keep(universe, n[3]);
+    n[4] = hl_join(universe, nw->se, ne->sw, sw->ne, se->nw);
+    hl_keep(universe, n[4]);
+    n[5] = hl_join(universe, ne->sw, ne->se, se->nw, se->ne);
+    hl_keep(universe, n[5]);
+    n[7] = hl_join(universe, sw->ne, se->nw, sw->se, se->sw);
+    hl_keep(universe, n[7]);
+    HlNode *r[9];
+    for (int k = 0; k < 9; k++) {
+        r[k] = hl_keep(universe, hl_result(universe, n[k]));
+    }
+
+    // Four quarters of the result, each made of four of the nine results
+    const int CORNERS[4] = {0, 1, 3, 4};
+    HlNode *quarters[4];
+    bool full_speed = universe->step_log >= level - 2;
+    for (int k = 0; k < 4; k++) {
+        int c = CORNERS[k];
+        HlNode *quarter = hl_keep(
+            universe, hl_join(universe, r[c], r[c + 1], r[c + 3], r[c + 4])
+        );
+        quarters[k] = hl_keep(
+            universe,
+            full_speed ? hl_result(universe, quarter)
+                       : hl_center(universe, quarter)
+        );
+    }
+    HlNode *result = hl_join(
+        universe, quarters[0], quarters[1], quarters[2], quarters[3]
+    );
+    universe->keep_count = keep;
+    return node->result = result;
+}
+
+// Whether all cells are in the center quarter of the node
+static bool hl_centered(const HlNode *node) {
+    return node->nw->se->se->population + node->ne->sw->sw->population +
+               node->sw->ne->ne->population + node->se->nw->nw->population ==
+           node->population;
+}
+
+bool hl_step(HlUniverse *universe) {
+    // Cells can spread 2^step_log cells, which the result leaves room for
+    // around the center quarter of a node of level step_log + 3
+    while (universe->root->level < universe->step_log + 3 ||
+           universe->root->level < HL_LEAF_LEVEL + 3 ||
+           !hl_centered(universe->root)) {
+        if (universe->root->level >= HL_MAX_LEVEL) return false;
+        universe->root = hl_expand(universe, universe->root);
+    }
+    universe->root = hl_result(universe, universe->root);
+    universe->generation += (uint64_t)1 << universe->step_log;
+    return true;
+}
+
+// (x, y) is the node's top left corner
+static void hl_read_node(
+    const HlNode *node,
+    int64_t x,
+    int64_t y,
+    int64_t x0,
+    int64_t y0,
+    size_t width,
+    size_t height,
+    uint64_t *rows,
+    size_t stride
+) {
+    int64_t size = (int64_t)1 << node->level;
+    if (node->population == 0 || x >= x0 + (int64_t)width ||
+        y >= y0 + (int64_t)height || x + size <= x0 || y + size <= y0) {
+        return;
+    }
+    if (node->level > HL_LEAF_LEVEL) {
+        int64_t half = size / 2;
+        hl_read_node(node->nw, x, y, x0, y0, width, height, rows, stride);
+        hl_read_node(
+            node->ne, x + half, y, x0, y0, width, height, rows, stride
+        );
+        hl_read_node(
+            node->sw, x, y + half, x0, y0, width, height, rows, stride
+        );
+        hl_read_node(
+            node->se, x + half, y + half, x0, y0, width, height, rows, stride
+        );
+        return;
+    }
+    for (uint64_t cells = node->cells; cells != 0; cells &= cells - 1) {
+        int bit = __builtin_ctzll(cells);
+        int64_t cx = x + bit % 8 - x0, cy = y + bit / 8 - y0;
+        if (cx < 0 || cy < 0 || cx >= (int64_t)width ||
+            cy >= (int64_t)height) {
+            continue;
+        }
+        rows[cy * stride + cx / 64] |= 1ull << (cx % 64);
+    }
+}
+
+void hl_read_rows(
+    HlUniverse *universe,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    uint64_t *rows,
+    size_t stride
+) {
+    int64_t half = hl_half(universe->root);
+    hl_read_node(
+        universe->root, -half, -half, x, y, width, height, rows, stride
+    );
+}
+
+// (x, y) is the node's top left corner
+static void hl_read_words_node(
+    const HlNode *node,
+    int64_t x,
+    int64_t y,
+    HlWordFn word,
+    void *ctx
+) {
+    if (node->population == 0) return;
+    if (node->level > HL_WORD_LEVEL) {
+        int64_t half = (int64_t)1 << (node->level - 1);
+        hl_read_words_node(node->nw, x, y, word, ctx);
+        hl_read_words_node(node->ne, x + half, y, word, ctx);
+        hl_read_words_node(node->sw, x, y + half, word, ctx);
+        hl_read_words_node(node->se, x + half, y + half, word, ctx);
+        return;
+    }
+    size_t size = (size_t)1 << node->level;
+    uint64_t rows[1 << HL_WORD_LEVEL] = {0};
+    hl_read_node(node, 0, 0, 0, 0, size, size, rows, 1);
+    for (size_t r = 0; r < size; r++) {
+        if (rows[r] != 0) word(ctx, x, y + r, rows[r]);
+    }
+}
+
+void hl_read_words(const HlUniverse *universe, HlWordFn word, void *ctx) {
+    int64_t half = hl_half(universe->root);
+    hl_read_words_node(universe->root, -half, -half, word, ctx);
+}
+
+// (x, y) is the node's top left corner
+static HlNode *hl_write_node(
+    HlUniverse *universe,
+    HlNode *node,
+    int64_t x,
+    int64_t y,
+    int64_t x0,
+    int64_t y0,
+    size_t width,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+) {
+    int64_t size = (int64_t)1 << node->level;
+    if (x >= x0 + (int64_t)width || y >= y0 + (int64_t)height ||
+        x + size <= x0 || y + size <= y0) {
+        return node;
+    }
+    if (node->level == HL_LEAF_LEVEL) {
+        uint64_t cells = node->cells;
+        for (int r = 0; r < 8; r++) {
+            int64_t row = y + r - y0;
+            if (row < 0 || row >= (int64_t)height) continue;
+            for (int c = 0; c < 8; c++) {
+                int64_t column = x + c - x0;
+                if (column < 0 || column >= (int64_t)width) continue;
+                uint64_t word = rows[row * stride + column / 64];
+                cells |= (word >> (column % 64) & 1) << (8 * r + c);
+            }
+        }
+        return cells == node->cells ? node : hl_leaf(universe, cells);
+    }
+    int64_t half = size / 2;
+    size_t keep = universe->keep_count;
+    hl_keep(universe, node);
+    HlNode *children[4] = {node->nw, node->ne, node->sw, node->se};
+    bool changed = false;
+    for (int k = 0; k < 4; k++) {
+        HlNode *child = hl_write_node(
+            universe,
+            children[k],
+            x + k % 2 * half,
+            y + k / 2 * half,
+            x0,
+            y0,
+            width,
+            height,
+            rows,
+            stride
+        );
+        changed |= child != children[k];
+        children[k] = hl_keep(universe, child);
+    }
+    HlNode *result = node;
+    if (changed) {
+        result = hl_join(
+            universe, children[0], children[1], children[2], children[3]
+        );
+    }
+    universe->keep_count = keep;
+    return result;
+}
+
+void hl_write_rows(
+    HlUniverse *universe,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+) {
+    if (width == 0 || height == 0) return;
+    int64_t half = hl_half(universe->root);
+    while ((x < -half || x + (int64_t)width > half || y < -half ||
+            y + (int64_t)height > half) &&
+           universe->root->level < HL_MAX_LEVEL) {
+        universe->root = hl_expand(universe, universe->root);
+        half = hl_half(universe->root);
+    }
+    universe->root = hl_write_node(
+        universe,
+        universe->root,
+        -half,
+        -half,
+        x,
+        y,
+        width,
+        height,
+        rows,
+        stride
+    );
+}
+
+// bounds[4] is x0, y0, x1, y1 of the cells found so far
+static void hl_bounds_node(
+    const HlNode *node,
+    int64_t x,
+    int64_t y,
+    int64_t bounds[4]
+) {
+    int64_t size = (int64_t)1 << node->level;
+    // Nothing to learn from nodes inside the bounds already
+    if (node->population == 0 ||
+        (x >= bounds[0] && y >= bounds[1] && x + size <= bounds[2] &&
+         y + size <= bounds[3])) {
+        return;
+    }
+    if (node->level > HL_LEAF_LEVEL) {
+        int64_t half = size / 2;
+        hl_bounds_node(node->nw, x, y, bounds);
+        hl_bounds_node(node->ne, x + half, y, bounds);
+        hl_bounds_node(node->sw, x, y + half, bounds);
+        hl_bounds_node(node->se, x + half, y + half, bounds);
+        return;
+    }
+    for (uint64_t cells = node->cells; cells != 0; cells &= cells - 1) {
+        int bit = __builtin_ctzll(cells);
+        int64_t cx = x + bit % 8, cy = y + bit / 8;
+        if (cx < bounds[0]) bounds[0] = cx;
+        if (cy < bounds[1]) bounds[1] = cy;
+        if (cx >= bounds[2]) bounds[2] = cx + 1;
+        if (cy >= bounds[3]) bounds[3] = cy + 1;
+    }
+}
+
+bool hl_bounds(
+    const HlUniverse *universe,
+    int64_t *x0,
+    int64_t *y0,
+    int64_t *x1,
+    int64_t *y1
+) {
+    if (universe->root->population == 0) return false;
+    int64_t bounds[4] = {INT64_MAX, INT64_MAX, INT64_MIN, INT64_MIN};
+    int64_t half = hl_half(universe->root);
+    hl_bounds_node(universe->root, -half, -half, bounds);
+    *x0 = bounds[0];
+    *y0 = bounds[1];
+    *x1 = bounds[2];
+    *y1 = bounds[3];
+    return true;
+}
+
+#endif  // end of HASHLIFE_IMPLEMENTATION
+#endif  // end of header guard
@@ -0,0 +1,639 @@
+/* Bit packed Game of Life on a torus.
+Cell x of a row is bit x % 64 of word x / 64, and bits past the width are
+kept at 0. A generation counts neighbors for 64 cells at once with bitwise
+adders: each row is summed horizontally into a 2 bit count of the cell and
+its west and east neighbors, then three such counts are added vertically.
+Rows wrap at the top and bottom, and the west and east carries of the first
+and last word of a row come from the other end. Interior words go through
+AVX2 when the CPU has it.
+Any Life-like rule can be used, given as birth and survival counts like
+B36/S23. B3/S23 has kernels of its own, other rules pick the next state
+out of per rule masks with a mux tree over the bits of the 4 bit count and
+the cell, which costs the same whatever the rule.
+Generations are double buffered: rows of the next one are written into
+`next`, which is swapped with `cells` once every row is done. That lets
+bands of rows be stepped by different threads with nothing but the join of
+wrk_run between generations.
+*/
+#ifndef LIFE_H
+#define LIFE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workers.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIFE_X86
+#include <immintrin.h>
+#endif
+
+// Words in a band of rows that is stepped as one task
+#define LIFE_BAND_WORDS 16384
+
+typedef struct {
+    uint16_t birth;    // bit n set when dead cells with n neighbors are born
+    uint16_t survive;  // bit n set when live cells with n neighbors survive
+} LifeRule;
+
+#define LIFE_CONWAY ((LifeRule){.birth = 1 << 3, .survive = 1 << 2 | 1 << 3})
+
+typedef struct {
+    size_t width;  // in cells
+    size_t height;
+    size_t words;     // per row
+    size_t last_bit;  // of the last cell in the last word of a row
+    uint64_t *cells;  // height * words
+    uint64_t *next;   // next generation, swapped with cells
+    LifeRule rule;
+} LifeBoard;
+
+// Reads rulestrings like B36/S23, b36s23 or the older 23/36 survival first
+// form. Returns false, leaving the rule as it was, on anything else.
+bool life_parse_rule(const char *text, LifeRule *rule);
+// Writes the B/S form, at most 22 characters with the terminator
+void life_rule_name(LifeRule rule, char name[22]);
+// Next state of each 3x3 neighborhood, where cell (x + dx, y + dy) is bit
+// 3 * (dy + 1) + (dx + 1) of the index
+void life_rule_table(LifeRule rule, uint8_t table[512]);
+// Returns false when memory couldn't be allocated. Boards start with B3/S23.
+bool life_init(LifeBoard *board, size_t width, size_t height);
+// Keeps the cells that are inside both sizes.
+// Returns false, leaving the board as it was, when memory couldn't be
+// allocated.
+bool life_resize(LifeBoard *board, size_t width, size_t height);
+void life_free(LifeBoard *board);
+void life_clear(LifeBoard *board);
+bool life_get(const LifeBoard *board, size_t x, size_t y);
+void life_set(LifeBoard *board, size_t x, size_t y, bool alive);
+uint64_t life_population(const LifeBoard *board);
+// Expands the cells into `bytes`, one per cell in rows of width bytes, 255
+// for live cells and 0 for dead ones, e.g. for a grayscale texture
+void life_to_bytes(const LifeBoard *board, uint8_t *bytes);
+// Live cells around (x, y), wrapping like a generation does
+int life_neighbors(const LifeBoard *board, size_t x, size_t y);
+// Writes rows [y0, y1) of the next generation into board->next
+void life_next_rows(LifeBoard *board, size_t y0, size_t y1);
+// Makes the next generation the current one
+void life_swap(LifeBoard *board);
+void life_step(LifeBoard *board);
+// Like life_step, with bands of rows spread over the pool. Boards of a
+// single band, or a NULL pool, are stepped on the calling thread.
+void life_step_pool(LifeBoard *board, WrkPool *pool);
+// Name of the instruction set life_next_rows dispatches to
+const char *life_simd_name(void);
+
+// Next state of 64 cells from the 2 bit horizontal counts (lo + 2 * hi) of
+// each cell and its west and east neighbors in the rows above, at and
+// below them. The 3x3 count including the cell is ones + 2 * (four weight 2
+// bits), and a cell lives with a count of 3, or of 4 when it's alive.
+static inline uint64_t life_combine(
+    uint64_t u_lo,
+    uint64_t u_hi,
+    uint64_t m_lo,
+    uint64_t m_hi,
+    uint64_t d_lo,
+    uint64_t d_hi,
+    uint64_t center
+) {
+    uint64_t ones = u_lo ^ m_lo ^ d_lo;
+    uint64_t carry = (u_lo & m_lo) | (d_lo & (u_lo ^ m_lo));
+    uint64_t p = u_hi ^ m_hi, q = d_hi ^ carry;
+    uint64_t odd = p ^ q;  // twos are 1 or 3
+    uint64_t two = (u_hi & m_hi) ^ (d_hi & carry) ^ (p & q);
+    return (ones & odd & ~two) | (~ones & ~odd & two & center);
+}
+
+// A rule as masks over the bits of the 3x3 count t, the cell included.
+// Cells with t = 2 * k + ones live where constant[k] ^ (center[k] & cell) ^
+// (one[k] & ones) ^ (both[k] & cell & ones) is set, and a mux tree on the
+// other bits of t picks k. B3/S23 has kernels of its own.
+typedef struct {
+    bool conway;
+    uint64_t constant[5];
+    uint64_t center[5];
+    uint64_t one[5];
+    uint64_t both[5];
+} LifeMasks;
+
+static inline LifeMasks life_masks(LifeRule rule) {
+    LifeMasks masks = {
+        .conway = rule.birth == LIFE_CONWAY.birth &&
+                  rule.survive == LIFE_CONWAY.survive,
+    };
+    for (int k = 0; k < 5; k++) {
+        // lives[ones][cell] for t = 2 * k + ones
+        uint64_t lives[2][2];
+        for (int ones = 0; ones < 2; ones++) {
+            int t = 2 * k + ones;
+            bool kept = t > 0 && rule.survive >> (t - 1) & 1;
+            lives[ones][0] = rule.birth >> t & 1 ? ~0ull : 0;
+            lives[ones][1] = kept ? ~0ull : 0;
+        }
+        masks.constant[k] = lives[0][0];
+        masks.center[k] = lives[0][0] ^ lives[0][1];
+        masks.one[k] = lives[0][0] ^ lives[1][0];
+        masks.both[k] = lives[0][0] ^ lives[0][1] ^ lives[1][0] ^ lives[1][1];
+    }
+    return masks;
+}
+
+// a where `select` is clear, b where it's set
+static inline uint64_t life_mux(uint64_t a, uint64_t b, uint64_t select) {
+    return a ^ ((a ^ b) & select);
+}
+
+static inline uint64_t life_pair(
+    const LifeMasks *masks,
+    int k,
+    uint64_t center,
+    uint64_t ones,
+    uint64_t both
+) {
+    return masks->constant[k] ^ (masks->center[k] & center) ^
+           (masks->one[k] & ones) ^ (masks->both[k] & both);
+}
+
+// Same as life_combine for any rule, with the same work for all of them.
+// The 3x3 count is t = ones + 2 * odd + 4 * two + 8 * eight.
+static inline uint64_t life_combine_masks(
+    const LifeMasks *masks,
+    uint64_t u_lo,
+    uint64_t u_hi,
+    uint64_t m_lo,
+    uint64_t m_hi,
+    uint64_t d_lo,
+    uint64_t d_hi,
+    uint64_t center
+) {
+    if (masks->conway) {
+        return life_combine(u_lo, u_hi, m_lo, m_hi, d_lo, d_hi, center);
+    }
+    uint64_t ones = u_lo ^ m_lo ^ d_lo;
+    uint64_t carry = (u_lo & m_lo) | (d_lo & (u_lo ^ m_lo));
+    uint64_t p = u_hi ^ m_hi, q = d_hi ^ carry;
+    uint64_t odd = p ^ q;
+    uint64_t two = (u_hi & m_hi) ^ (d_hi & carry) ^ (p & q);
+    uint64_t eight = u_hi & m_hi & d_hi & carry;  // odd and two are 0 then
+    uint64_t both = center & ones;
+    uint64_t low = life_mux(
+        life_pair(masks, 0, center, ones, both),
+        life_pair(masks, 1, center, ones, both),
+        odd
+    );
+    uint64_t high = life_mux(
+        life_pair(masks, 2, center, ones, both),
+        life_pair(masks, 3, center, ones, both),
+        odd
+    );
+    return life_mux(
+        life_mux(low, high, two),
+        life_pair(masks, 4, center, ones, both),
+        eight
+    );
+}
+
+// Cells west and east of the 64 in `c` summed with them into lo + 2 * hi,
+// with the cells carried in from the neighboring words
+static inline void life_sum3(
+    uint64_t c, uint64_t before, uint64_t after, uint64_t *lo, uint64_t *hi
+) {
+    uint64_t w = c << 1 | before >> 63;
+    uint64_t e = c >> 1 | after << 63;
+    *lo = w ^ c ^ e;
+    *hi = (w & c) | (e & (w ^ c));
+}
+
+#ifdef LIFE_IMPLEMENTATION
+
+bool life_parse_rule(const char *text, LifeRule *rule) {
+    LifeRule parsed = {0};
+    bool letters = strpbrk(text, "BbSs") != NULL;
+    // Counts go to survival first in the older form
+    uint16_t *counts = letters ? NULL : &parsed.survive;
+    int slashes = 0;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == 'B' || *c == 'b') {
+            counts = &parsed.birth;
+        } else if (*c == 'S' || *c == 's') {
+            counts = &parsed.survive;
+        } else if (*c >= '0' && *c <= '8' && counts != NULL) {
+            *counts |= 1 << (*c - '0');
+        } else if (*c == '/' && slashes++ == 0) {
+            if (!letters) counts = &parsed.birth;
+        } else {
+            return false;
+        }
+    }
+    if (!letters && slashes != 1) return false;
+    *rule = parsed;
+    return true;
+}
+
+void life_rule_name(LifeRule rule, char name[22]) {
+    char *c = name;
+    *c++ = 'B';
+    for (int n = 0; n <= 8; n++) {
+        if (rule.birth >> n & 1) *c++ = '0' + n;
+    }
+    *c++ = '/';
+    *c++ = 'S';
+    for (int n = 0; n <= 8; n++) {
+        if (rule.survive >> n & 1) *c++ = '0' + n;
+    }
+    *c = '\0';
+}
+
+void life_rule_table(LifeRule rule, uint8_t table[512]) {
+    for (int k = 0; k < 512; k++) {
+        int neighbors = __builtin_popcount(k & ~(1 << 4));
+        table[k] = k >> 4 & 1 ? rule.survive >> neighbors & 1
+                              : rule.birth >> neighbors & 1;
+    }
+}
+
+static bool life_alloc(LifeBoard *board, size_t width, size_t height) {
+    memset(board, 0, sizeof(*board));
+    if (width == 0 || height == 0) return false;
+    board->width = width;
+    board->height = height;
+    board->words = (width + 63) / 64;
+    board->last_bit = (width - 1) % 64;
+    board->rule = LIFE_CONWAY;
+    board->cells = calloc(board->words * height, sizeof(uint64_t));
+    board->next = calloc(board->words * height, sizeof(uint64_t));
+    if (board->cells == NULL || board->next == NULL) {
+        life_free(board);
+        return false;
+    }
+    return true;
+}
+
+bool life_init(LifeBoard *board, size_t width, size_t height) {
+    return life_alloc(board, width, height);
+}
+
+bool life_resize(LifeBoard *board, size_t width, size_t height) {
+    LifeBoard resized;
+    if (!life_alloc(&resized, width, height)) return false;
+    size_t rows = height < board->height ? height : board->height;
+    size_t columns = width < board->width ? width : board->width;
+    size_t words = (columns + 63) / 64;
+    for (size_t y = 0; y < rows; y++) {
+        uint64_t *row = resized.cells + y * resized.words;
+        memcpy(row, board->cells + y * board->words, words * sizeof(*row));
+        // Cut the cells past the new width
+        if (columns % 64 != 0) row[words - 1] &= ~0ull >> (64 - columns % 64);
+    }
+    resized.rule = board->rule;
+    life_free(board);
+    *board = resized;
+    return true;
+}
+
+void life_free(LifeBoard *board) {
+    free(board->cells);
+    free(board->next);
+    memset(board, 0, sizeof(*board));
+}
+
+void life_clear(LifeBoard *board) {
+    memset(board->cells, 0, board->words * board->height * sizeof(uint64_t));
+}
+
+bool life_get(const LifeBoard *board, size_t x, size_t y) {
+    return board->cells[y * board->words + x / 64] >> (x % 64) & 1;
+}
+
+void life_set(LifeBoard *board, size_t x, size_t y, bool alive) {
+    uint64_t *word = board->cells + y * board->words + x / 64;
+    uint64_t bit = 1ull << (x % 64);
+    *word = alive ? *word | bit : *word & ~bit;
+}
+
+uint64_t life_population(const LifeBoard *board) {
+    uint64_t population = 0;
+    for (size_t k = 0; k < board->words * board->height; k++) {
+        population += __builtin_popcountll(board->cells[k]);
+    }
+    return population;
+}
+
+void life_to_bytes(const LifeBoard *board, uint8_t *bytes) {
+    // Eight cells at a time, through their eight bytes on little endian
+    // machines
+    static uint64_t expand[256];
+    if (expand[255] == 0) {
+        for (int k = 0; k < 256; k++) {
+            uint64_t bytes = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (k >> bit & 1) bytes |= 0xFFull << 8 * bit;
+            }
+            expand[k] = bytes;
+        }
+    }
+    for (size_t y = 0; y < board->height; y++) {
+        const uint64_t *row = board->cells + y * board->words;
+        uint8_t *out = bytes + y * board->width;
+        size_t x = 0;
+        for (; x + 8 <= board->width; x += 8) {
+            uint64_t eight = expand[row[x / 64] >> (x % 64) & 0xFF];
+            memcpy(out + x, &eight, 8);
+        }
+        for (; x < board->width; x++) out[x] = life_get(board, x, y) ? 255 : 0;
+    }
+}
+
+int life_neighbors(const LifeBoard *board, size_t x, size_t y) {
+    int count = 0;
+    for (size_t dy = 0; dy < 3; dy++) {
+        for (size_t dx = 0; dx < 3; dx++) {
+            if (dx == 1 && dy == 1) continue;
+            count += life_get(
+                board,
+                (x + board->width + dx - 1) % board->width,
+                (y + board->height + dy - 1) % board->height
+            );
+        }
+    }
+    return count;
+}
+
+// Cell, west and east neighbors of word k as a 2 bit count
+static inline void life_row_sum(
+    const LifeBoard *board, const uint64_t *row, size_t k, uint64_t *lo,
+    uint64_t *hi
+) {
+    size_t last = board->words - 1;
+    uint64_t c = row[k];
+    uint64_t west_in =
+        k > 0 ? row[k - 1] >> 63 : row[last] >> board->last_bit & 1;
+    uint64_t east_in =
+        k < last ? row[k + 1] << 63 : (row[0] & 1) << board->last_bit;
+    uint64_t w = c << 1 | west_in;
+    uint64_t e = c >> 1 | east_in;
+    *lo = w ^ c ^ e;
+    *hi = (w & c) | (e & (w ^ c));
+}
+
+static inline uint64_t life_word(
+    const LifeBoard *board,
+    const LifeMasks *masks,
+    const uint64_t *up,
+    const uint64_t *mid,
+    const uint64_t *down,
+    size_t k
+) {
+    uint64_t u_lo, u_hi, m_lo, m_hi, d_lo, d_hi;
+    life_row_sum(board, up, k, &u_lo, &u_hi);
+    life_row_sum(board, mid, k, &m_lo, &m_hi);
+    life_row_sum(board, down, k, &d_lo, &d_hi);
+    return life_combine_masks(
+        masks, u_lo, u_hi, m_lo, m_hi, d_lo, d_hi, mid[k]
+    );
+}
+
+static void life_rows(
+    const LifeBoard *board,
+    size_t y,
+    const uint64_t **up,
+    const uint64_t **mid,
+    const uint64_t **down
+) {
+    size_t h = board->height;
+    *up = board->cells + (y + h - 1) % h * board->words;
+    *mid = board->cells + y * board->words;
+    *down = board->cells + (y + 1) % h * board->words;
+}
+
+static void life_next_rows_scalar(LifeBoard *board, size_t y0, size_t y1) {
+    LifeMasks masks = life_masks(board->rule);
+    size_t last = board->words - 1;
+    for (size_t y = y0; y < y1; y++) {
+        const uint64_t *up, *mid, *down;
+        life_rows(board, y, &up, &mid, &down);
+        uint64_t *out = board->next + y * board->words;
+        for (size_t k = 0; k <= last; k++) {
+            out[k] = life_word(board, &masks, up, mid, down, k);
+        }
+        out[last] &= ~0ull >> (63 - board->last_bit);
+    }
+}
+
+#ifdef LIFE_X86
+__attribute__((target("avx2"))) static inline void life_row_sum_avx2(
+    const uint64_t *row, size_t k, __m256i *lo, __m256i *hi
+) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(row + k));
+    __m256i before = _mm256_loadu_si256((const __m256i *)(row + k - 1));
+    __m256i after = _mm256_loadu_si256((const __m256i *)(row + k + 1));
+    __m256i w =
+        _mm256_or_si256(_mm256_slli_epi64(c, 1), _mm256_srli_epi64(before, 63));
+    __m256i e =
+        _mm256_or_si256(_mm256_srli_epi64(c, 1), _mm256_slli_epi64(after, 63));
+    __m256i wc = _mm256_xor_si256(w, c);
+    *lo = _mm256_xor_si256(wc, e);
+    *hi = _mm256_or_si256(_mm256_and_si256(w, c), _mm256_and_si256(e, wc));
+}
+
+// LifeMasks broadcast to four words
+typedef struct {
+    __m256i constant[5];
+    __m256i center[5];
+    __m256i one[5];
+    __m256i both[5];
+} LifeMasksAvx2;
+
+__attribute__((target("avx2"))) static inline __m256i life_mux_avx2(
+    __m256i a, __m256i b, __m256i select
+) {
+    return _mm256_xor_si256(
+        a, _mm256_and_si256(_mm256_xor_si256(a, b), select)
+    );
+}
+
+__attribute__((target("avx2"))) static inline __m256i life_pair_avx2(
+    const LifeMasksAvx2 *masks,
+    int k,
+    __m256i center,
+    __m256i ones,
+    __m256i both
+) {
+    return _mm256_xor_si256(
+        _mm256_xor_si256(
+            masks->constant[k], _mm256_and_si256(masks->center[k], center)
+        ),
+        _mm256_xor_si256(
+            _mm256_and_si256(masks->one[k], ones),
+            _mm256_and_si256(masks->both[k], both)
+        )
+    );
+}
+
+// life_combine_masks on four words
+__attribute__((target("avx2"))) static inline __m256i life_combine_avx2(
+    bool conway,
+    const LifeMasksAvx2 *masks,
+    __m256i u_lo,
+    __m256i u_hi,
+    __m256i m_lo,
+    __m256i m_hi,
+    __m256i d_lo,
+    __m256i d_hi,
+    __m256i center
+) {
+    __m256i um = _mm256_xor_si256(u_lo, m_lo);
+    __m256i ones = _mm256_xor_si256(um, d_lo);
+    __m256i carry = _mm256_or_si256(
+        _mm256_and_si256(u_lo, m_lo), _mm256_and_si256(d_lo, um)
+    );
+    __m256i p = _mm256_xor_si256(u_hi, m_hi);
+    __m256i q = _mm256_xor_si256(d_hi, carry);
+    __m256i odd = _mm256_xor_si256(p, q);
+    __m256i both_hi = _mm256_and_si256(u_hi, m_hi);
+    __m256i down_carry = _mm256_and_si256(d_hi, carry);
+    __m256i two = _mm256_xor_si256(
+        _mm256_xor_si256(both_hi, down_carry), _mm256_and_si256(p, q)
+    );
+    if (conway) {
+        __m256i three = _mm256_andnot_si256(two, _mm256_and_si256(ones, odd));
+        __m256i four = _mm256_andnot_si256(
+            _mm256_or_si256(ones, odd), _mm256_and_si256(two, center)
+        );
+        return _mm256_or_si256(three, four);
+    }
+    __m256i eight = _mm256_and_si256(both_hi, down_carry);
+    __m256i both = _mm256_and_si256(center, ones);
+    __m256i low = life_mux_avx2(
+        life_pair_avx2(masks, 0, center, ones, both),
+        life_pair_avx2(masks, 1, center, ones, both),
+        odd
+    );
+    __m256i high = life_mux_avx2(
+        life_pair_avx2(masks, 2, center, ones, both),
+        life_pair_avx2(masks, 3, center, ones, both),
+        odd
+    );
+    return life_mux_avx2(
+        life_mux_avx2(low, high, two),
+        life_pair_avx2(masks, 4, center, ones, both),
+        eight
+    );
+}
+
+// Words 1 to words - 2 four at a time, the ends wrap and go through
+// life_word
+__attribute__((target("avx2"))) static void life_next_rows_avx2(
+    LifeBoard *board, size_t y0, size_t y1
+) {
+    LifeMasks masks = life_masks(board->rule);
+    LifeMasksAvx2 wide;
+    for (int k = 0; k < 5; k++) {
+        wide.constant[k] = _mm256_set1_epi64x(masks.constant[k]);
+        wide.center[k] = _mm256_set1_epi64x(masks.center[k]);
+        wide.one[k] = _mm256_set1_epi64x(masks.one[k]);
+        wide.both[k] = _mm256_set1_epi64x(masks.both[k]);
+    }
+    size_t last = board->words - 1;
+    for (size_t y = y0; y < y1; y++) {
+        const uint64_t *up, *mid, *down;
+        life_rows(board, y, &up, &mid, &down);
+        uint64_t *out = board->next + y * board->words;
+        out[0] = life_word(board, &masks, up, mid, down, 0);
+        size_t k = 1;
+        for (; k + 4 <= last; k += 4) {
+            __m256i u_lo, u_hi, m_lo, m_hi, d_lo, d_hi;
+            life_row_sum_avx2(up, k, &u_lo, &u_hi);
+            life_row_sum_avx2(mid, k, &m_lo, &m_hi);
+            life_row_sum_avx2(down, k, &d_lo, &d_hi);
+            __m256i center = _mm256_loadu_si256((const __m256i *)(mid + k));
+            _mm256_storeu_si256(
+                (__m256i *)(out + k),
+                life_combine_avx2(
+                    masks.conway,
+                    &wide,
+                    u_lo,
+                    u_hi,
+                    m_lo,
+                    m_hi,
+                    d_lo,
+                    d_hi,
+                    center
+                )
+            );
+        }
+        for (; k <= last; k++) {
+            out[k] = life_word(board, &masks, up, mid, down, k);
+        }
+        out[last] &= ~0ull >> (63 - board->last_bit);
+    }
+}
+#endif
+
+typedef void (*LifeRowKernel)(LifeBoard *, size_t, size_t);
+
+static LifeRowKernel life_kernel(void) {
+    static LifeRowKernel kernel = NULL;
+    if (kernel != NULL) return kernel;
+    kernel = life_next_rows_scalar;
+#ifdef LIFE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) kernel = life_next_rows_avx2;
+#endif
+    return kernel;
+}
+
+const char *life_simd_name(void) {
+#ifdef LIFE_X86
+    if (life_kernel() == life_next_rows_avx2) return "avx2";
+#endif
+    return "scalar";
+}
+
+void life_next_rows(LifeBoard *board, size_t y0, size_t y1) {
+    life_kernel()(board, y0, y1);
+}
+
+void life_swap(LifeBoard *board) {
+    uint64_t *cells = board->cells;
+    board->cells = board->next;
+    board->next = cells;
+}
+
+void life_step(LifeBoard *board) {
+    life_next_rows(board, 0, board->height);
+    life_swap(board);
+}
+
+static size_t life_band_rows(const LifeBoard *board) {
+    size_t rows = LIFE_BAND_WORDS / board->words;
+    return rows > 0 ? rows : 1;
+}
+
+static void life_band_task(void *ctx, size_t task, size_t worker) {
+    LifeBoard *board = ctx;
+    size_t rows = life_band_rows(board);
+    size_t y0 = task * rows, y1 = y0 + rows;
+    (void)worker;
+    if (y1 > board->height) y1 = board->height;
+    life_next_rows(board, y0, y1);
+}
+
+void life_step_pool(LifeBoard *board, WrkPool *pool) {
+    size_t rows = life_band_rows(board);
+    size_t bands = (board->height + rows - 1) / rows;
+    if (pool == NULL || pool->thread_count <= 1 || bands <= 1) {
+        life_step(board);
+        return;
+    }
+    // Picks the kernel here so workers don't race to initialize it
+    life_kernel();
+    wrk_run(pool, life_band_task, board, bands);
+    life_swap(board);
+}
+
+#endif  // end of LIFE_IMPLEMENTATION
+#endif  // end of header guard
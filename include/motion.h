@@ -15,6 +15,21 @@ typedef struct {
     float mass;
 } Particle;
 
+// Double precision counterparts, for states whose magnitudes or step sizes
+// don't fit in float, e.g. a solar system in meters and seconds
+typedef struct {
+    double x;
+    double y;
+} DVector2;
+
+typedef struct {
+    bool is_static;
+    DVector2 r;
+    DVector2 v;
+    DVector2 a;
+    double mass;
+} DParticle;
+
 void mot_integrate_backward_euler(Vector2 *r, Vector2 *v, Vector2 a, float dt);
 void mot_integrate_symplectic_euler(
     Vector2 *r, Vector2 *v, Vector2 prev_a, float dt
@@ -39,6 +54,14 @@ void mot_integrate_rk4(
 void mot_adaptive_rk4(
     Vector2 *r, Vector2 *v, Vector2 a, Vector2 prev_a, float dt
 );
+
+DVector2 mot_dvec_add(DVector2 a, DVector2 b);
+DVector2 mot_dvec_scale(DVector2 v, double scale);
+// Velocity Verlet split around the force evaluation, so a step needs only
+// one: begin kicks with the acceleration at r for half a step and drifts,
+// end kicks with the acceleration at the new r for the other half.
+void mot_verlet_begin_d(DVector2 *r, DVector2 *v, DVector2 a, double dt);
+void mot_verlet_end_d(DVector2 *v, DVector2 a, double dt);
 #ifdef MOTION_IMPLEMENTATION
 
 inline void mot_integrate_backward_euler(
@@ -191,5 +214,22 @@ void mot_adaptive_rk4(
     }
 }
 
+DVector2 mot_dvec_add(DVector2 a, DVector2 b) {
+    return (DVector2){a.x + b.x, a.y + b.y};
+}
+
+DVector2 mot_dvec_scale(DVector2 v, double scale) {
+    return (DVector2){v.x * scale, v.y * scale};
+}
+
+void mot_verlet_begin_d(DVector2 *r, DVector2 *v, DVector2 a, double dt) {
+    *v = mot_dvec_add(*v, mot_dvec_scale(a, dt / 2));
+    *r = mot_dvec_add(*r, mot_dvec_scale(*v, dt));
+}
+
+void mot_verlet_end_d(DVector2 *v, DVector2 a, double dt) {
+    *v = mot_dvec_add(*v, mot_dvec_scale(a, dt / 2));
+}
+
 #endif  // end of MOTION_IMPLEMENTATION
 #endif  // end of header guard
\ No newline at end of file
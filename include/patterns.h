@@ -0,0 +1,524 @@
+/* Game of Life patterns in RLE and plaintext (.cells) files.
+Files are memory mapped where mmap is available and parsed in place, in two
+steps: pat_open reads the header, or measures plaintext files, and
+pat_read streams every run of live cells to a callback, so patterns of any
+size go straight into whatever stores the cells. Cells are relative to the
+pattern's top left corner, and the multi state RLE states A to X count as
+alive. pat_read_rows gathers the runs into bands of bit packed rows instead,
+for stores that take many cells at once like hl_write_rows and
+chk_write_rows.
+pat_write_rle writes a region of cells that are reported as words of 64
+cells in any order, like hl_read_words and chk_read_words do. It sorts the
+non empty words, so it costs time and memory in proportion to the live
+cells rather than to the region, which may span billions of rows on the
+plane.
+*/
+#ifndef PATTERNS_H
+#define PATTERNS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PAT_LINE_WIDTH 70  // of RLE bodies
+#define PAT_BAND_ROWS 64   // rows in a band, when reading
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t body;  // offset of the first cell
+    bool rle;
+    int64_t width;  // from the RLE header, or measured
+    int64_t height;
+    char rule[64];  // from the RLE header, empty if there is none
+    char error[128];
+    void *mapping;  // to unmap, NULL when data isn't ours
+    size_t mapping_size;
+} PatFile;
+
+// Called with runs of `count` live cells from (x, y) to (x + count - 1, y)
+typedef void (*PatRunFn)(void *ctx, int64_t x, int64_t y, int64_t count);
+// Takes the cells of rows [y, y + height) of the pattern in bit packed
+// words, `stride` words apart, with the bits past its width cleared
+typedef void (*PatRowsFn)(
+    void *ctx,
+    int64_t y,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+);
+// Called with live cells (x + i, y) for every set bit i of `bits`
+typedef void (*PatWordFn)(void *ctx, int64_t x, int64_t y, uint64_t bits);
+// Reports every live cell once through `word`, in any order
+typedef void (*PatCellsFn)(void *ctx, PatWordFn word, void *word_ctx);
+
+// RLE when the name ends in .rle, plaintext otherwise.
+// Returns false with a message in file->error on failure.
+bool pat_open(PatFile *file, const char *path);
+// Same, on `size` bytes that must outlive the file
+bool pat_open_memory(PatFile *file, const char *data, size_t size, bool rle);
+// Returns false with a message in file->error on a malformed body
+bool pat_read(PatFile *file, PatRunFn run, void *ctx);
+// Same, in bands of rows holding cells, cut to the pattern's width
+bool pat_read_rows(PatFile *file, PatRowsFn write, void *ctx);
+void pat_close(PatFile *file);
+// Writes [x, x + width) x [y, y + height) as RLE, with an optional comment.
+// Cells outside of it are left out.
+// Returns false when the file couldn't be written or memory allocated.
+bool pat_write_rle(
+    FILE *out,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const char *rule,
+    const char *comment,
+    PatCellsFn cells,
+    void *ctx
+);
+
+#ifdef PATTERNS_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define PAT_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool pat_fail(PatFile *file, size_t at, const char *message) {
+    int line = 1;
+    for (size_t i = 0; i < at && i < file->size; i++) {
+        line += file->data[i] == '\n';
+    }
+    snprintf(file->error, sizeof(file->error), "line %d: %s", line, message);
+    return false;
+}
+
+static size_t pat_next_line(const PatFile *file, size_t i) {
+    const char *newline = memchr(file->data + i, '\n', file->size - i);
+    return newline != NULL ? (size_t)(newline - file->data) + 1 : file->size;
+}
+
+// Reads "x = 3, y = 3, rule = B3/S23", with any spacing
+static bool pat_rle_header(PatFile *file, size_t i, size_t end) {
+    while (i < end) {
+        while (i < end && strchr(" \t\r\n,", file->data[i]) != NULL) i++;
+        if (i == end) break;
+        size_t key = i;
+        while (i < end && strchr(" \t\r\n=", file->data[i]) == NULL) i++;
+        size_t key_length = i - key;
+        while (i < end && strchr(" \t\r\n=", file->data[i]) != NULL) i++;
+        size_t value = i;
+        while (i < end && strchr(" \t\r\n,", file->data[i]) == NULL) i++;
+        size_t value_length = i - value;
+        if (key_length == 0 || value_length == 0) {
+            return pat_fail(file, key, "malformed header");
+        }
+        if (key_length == 1 && file->data[key] == 'x') {
+            file->width = strtoll(file->data + value, NULL, 10);
+        } else if (key_length == 1 && file->data[key] == 'y') {
+            file->height = strtoll(file->data + value, NULL, 10);
+        } else if (key_length == 4 &&
+                   memcmp(file->data + key, "rule", 4) == 0) {
+            if (value_length >= sizeof(file->rule)) {
+                value_length = sizeof(file->rule) - 1;
+            }
+            memcpy(file->rule, file->data + value, value_length);
+            file->rule[value_length] = '\0';
+        }
+    }
+    if (file->width < 0 || file->height < 0) {
+        return pat_fail(file, end, "negative size");
+    }
+    return true;
+}
+
+static void pat_measure(void *ctx, int64_t x, int64_t y, int64_t count) {
+    PatFile *file = ctx;
+    if (x + count > file->width) file->width = x + count;
+    if (y + 1 > file->height) file->height = y + 1;
+}
+
+bool pat_open_memory(PatFile *file, const char *data, size_t size, bool rle) {
+    memset(file, 0, sizeof(*file));
+    file->data = data;
+    file->size = size;
+    file->rle = rle;
+    // Comments are lines starting with # in RLE and ! in plaintext
+    size_t i = 0;
+    while (i < size && data[i] == (rle ? '#' : '!')) {
+        i = pat_next_line(file, i);
+    }
+    file->body = i;
+    if (rle) {
+        size_t j = i;
+        while (j < size && strchr(" \t\r\n", data[j]) != NULL) j++;
+        if (j < size && data[j] == 'x') {
+            size_t end = pat_next_line(file, j);
+            if (!pat_rle_header(file, j, end)) return false;
+            file->body = end;
+            return true;
+        }
+    }
+    // No header to tell the size
+    return pat_read(file, pat_measure, file);
+}
+
+bool pat_open(PatFile *file, const char *path) {
+    size_t length = strlen(path);
+    bool rle = length >= 4 && strcmp(path + length - 4, ".rle") == 0;
+    const char *data = "";
+    size_t size = 0;
+    void *mapping = NULL;
+#ifdef PAT_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        memset(file, 0, sizeof(*file));
+        snprintf(file->error, sizeof(file->error), "couldn't open the file");
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) mapping = NULL;
+        if (mapping != NULL) madvise(mapping, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (size > 0 && mapping == NULL) {
+        memset(file, 0, sizeof(*file));
+        snprintf(file->error, sizeof(file->error), "couldn't map the file");
+        return false;
+    }
+#else
+    // Read in one piece where there's no mmap
+    FILE *in = fopen(path, "rb");
+    if (in != NULL && fseek(in, 0, SEEK_END) == 0) {
+        long end = ftell(in);
+        size = end > 0 ? end : 0;
+        mapping = malloc(size + 1);
+        rewind(in);
+        if (mapping != NULL && fread(mapping, 1, size, in) != size) {
+            free(mapping);
+            mapping = NULL;
+        }
+    }
+    if (in != NULL) fclose(in);
+    if (mapping == NULL) {
+        memset(file, 0, sizeof(*file));
+        snprintf(file->error, sizeof(file->error), "couldn't read the file");
+        return false;
+    }
+#endif
+    if (mapping != NULL) data = mapping;
+    bool opened = pat_open_memory(file, data, size, rle);
+    file->mapping = mapping;
+    file->mapping_size = size;
+    if (!opened) {
+        char error[sizeof(file->error)];
+        memcpy(error, file->error, sizeof(error));
+        pat_close(file);
+        memcpy(file->error, error, sizeof(error));
+    }
+    return opened;
+}
+
+void pat_close(PatFile *file) {
+    if (file->mapping != NULL) {
+#ifdef PAT_MMAP
+        munmap(file->mapping, file->mapping_size);
+#else
+        free(file->mapping);
+#endif
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+static bool pat_read_rle(PatFile *file, PatRunFn run, void *ctx) {
+    const char *data = file->data;
+    int64_t x = 0, y = 0, count = 0;
+    for (size_t i = file->body; i < file->size; i++) {
+        char c = data[i];
+        if (c >= '0' && c <= '9') {
+            count = 10 * count + (c - '0');
+            if (count > INT64_MAX / 20) {
+                return pat_fail(file, i, "run too long");
+            }
+            continue;
+        }
+        int64_t n = count > 0 ? count : 1;
+        count = 0;
+        if (c == 'b' || c == '.') {
+            x += n;
+        } else if (c == 'o' || (c >= 'A' && c <= 'X')) {
+            run(ctx, x, y, n);
+            x += n;
+        } else if (c == '$') {
+            x = 0;
+            y += n;
+        } else if (c == '!') {
+            return true;
+        } else if (c == '#') {
+            // Comments after the header are allowed by some writers
+            i = pat_next_line(file, i) - 1;
+        } else if (strchr(" \t\r\n", c) == NULL) {
+            return pat_fail(file, i, "unexpected character");
+        }
+    }
+    return true;
+}
+
+static bool pat_read_cells(PatFile *file, PatRunFn run, void *ctx) {
+    int64_t y = 0;
+    size_t i = file->body;
+    while (i < file->size) {
+        size_t end = pat_next_line(file, i);
+        if (file->data[i] != '!') {
+            int64_t x = 0, start = -1;
+            for (size_t k = i; k <= end; k++) {
+                char c = k < end ? file->data[k] : '\n';
+                bool alive = c == 'O' || c == '*';
+                if (alive && start < 0) start = x;
+                if (!alive && start >= 0) {
+                    run(ctx, start, y, x - start);
+                    start = -1;
+                }
+                if (c == '\n' || c == '\r') break;
+                if (!alive && c != '.') {
+                    return pat_fail(file, k, "unexpected character");
+                }
+                x++;
+            }
+            y++;
+        }
+        i = end;
+    }
+    return true;
+}
+
+bool pat_read(PatFile *file, PatRunFn run, void *ctx) {
+    return file->rle ? pat_read_rle(file, run, ctx)
+                     : pat_read_cells(file, run, ctx);
+}
+
+typedef struct {
+    PatRowsFn write;
+    void *ctx;
+    int64_t width;
+    size_t stride;
+    uint64_t *rows;
+    int64_t y;  // of the band's first row
+    bool empty;
+} PatBand;
+
+static void pat_flush(PatBand *band) {
+    if (!band->empty) {
+        band->write(
+            band->ctx, band->y, PAT_BAND_ROWS, band->rows, band->stride
+        );
+        memset(band->rows, 0, PAT_BAND_ROWS * band->stride * sizeof(uint64_t));
+    }
+    band->empty = true;
+}
+
+// Runs come in order of rows
+static void pat_band_run(void *ctx, int64_t x, int64_t y, int64_t count) {
+    PatBand *band = ctx;
+    if (y >= band->y + PAT_BAND_ROWS) {
+        pat_flush(band);
+        band->y = y - y % PAT_BAND_ROWS;
+    }
+    int64_t end = x + count < band->width ? x + count : band->width;
+    if (x >= end) return;
+    uint64_t *row = band->rows + (y - band->y) * band->stride;
+    for (int64_t word = x / 64; word <= (end - 1) / 64; word++) {
+        uint64_t bits = ~0ull;
+        if (word == x / 64) bits &= ~0ull << (x % 64);
+        if (word == (end - 1) / 64 && end % 64 != 0) {
+            bits &= ~0ull >> (64 - end % 64);
+        }
+        row[word] |= bits;
+    }
+    band->empty = false;
+}
+
+bool pat_read_rows(PatFile *file, PatRowsFn write, void *ctx) {
+    PatBand band = {
+        .write = write,
+        .ctx = ctx,
+        .width = file->width,
+        .stride = (file->width + 63) / 64,
+        .empty = true,
+    };
+    band.rows = calloc(PAT_BAND_ROWS * (band.stride + 1), sizeof(uint64_t));
+    if (band.rows == NULL) {
+        snprintf(file->error, sizeof(file->error), "out of memory");
+        return false;
+    }
+    bool read = pat_read(file, pat_band_run, &band);
+    if (read) pat_flush(&band);
+    free(band.rows);
+    return read;
+}
+
+typedef struct {
+    int64_t y;
+    int64_t x;
+    uint64_t bits;
+} PatWord;
+
+typedef struct {
+    PatWord *items;
+    size_t count;
+    size_t capacity;
+    int64_t x0, y0, x1, y1;  // region that's written
+    bool failed;
+} PatWords;
+
+// Keeps the cells of a word that are inside the region
+static void pat_collect(void *ctx, int64_t x, int64_t y, uint64_t bits) {
+    PatWords *words = ctx;
+    if (y < words->y0 || y >= words->y1 || x >= words->x1 ||
+        x + 64 <= words->x0) {
+        return;
+    }
+    if (x < words->x0) {
+        bits >>= words->x0 - x;
+        x = words->x0;
+    }
+    if (words->x1 - x < 64) bits &= ~0ull >> (64 - (words->x1 - x));
+    if (bits == 0 || words->failed) return;
+    if (words->count == words->capacity) {
+        size_t capacity = words->capacity < 256 ? 256 : words->capacity * 2;
+        PatWord *items = realloc(words->items, capacity * sizeof(*items));
+        if (items == NULL) {
+            words->failed = true;
+            return;
+        }
+        words->items = items;
+        words->capacity = capacity;
+    }
+    words->items[words->count++] = (PatWord){.y = y, .x = x, .bits = bits};
+}
+
+static int pat_compare_words(const void *a, const void *b) {
+    const PatWord *u = a, *v = b;
+    if (u->y != v->y) return u->y < v->y ? -1 : 1;
+    if (u->x != v->x) return u->x < v->x ? -1 : 1;
+    return 0;
+}
+
+typedef struct {
+    FILE *out;
+    int column;
+    int64_t x0;         // left edge of the region
+    int64_t y;          // row being written
+    int64_t x;          // first cell of the row that isn't written yet
+    int64_t run_start;  // live run that may still grow
+    int64_t run_end;    //
+} PatWriter;
+
+// Writes `count` then `tag`, the count left out when it is 1
+static void pat_put(PatWriter *writer, int64_t count, char tag) {
+    char item[24];
+    char *start = item + sizeof(item) - 1;
+    *start = tag;
+    if (count > 1) {
+        for (; count > 0; count /= 10) *--start = '0' + count % 10;
+    }
+    int length = item + sizeof(item) - start;
+    if (writer->column + length > PAT_LINE_WIDTH) {
+        fputc('\n', writer->out);
+        writer->column = 0;
+    }
+    fwrite(start, 1, length, writer->out);
+    writer->column += length;
+}
+
+static void pat_put_run(PatWriter *writer) {
+    if (writer->run_start == writer->run_end) return;
+    if (writer->run_start > writer->x) {
+        pat_put(writer, writer->run_start - writer->x, 'b');
+    }
+    pat_put(writer, writer->run_end - writer->run_start, 'o');
+    writer->x = writer->run_start = writer->run_end;
+}
+
+// Live cells [x0, x1) of row y, which come in order. Runs alternate
+// between dead and live, blank rows and trailing dead cells are left to
+// the ends of rows.
+static void pat_add_run(PatWriter *writer, int64_t y, int64_t x0, int64_t x1) {
+    if (y == writer->y && x0 == writer->run_end) {
+        writer->run_end = x1;
+        return;
+    }
+    pat_put_run(writer);
+    if (y != writer->y) {
+        pat_put(writer, y - writer->y, '$');
+        writer->y = y;
+        writer->x = writer->x0;
+    }
+    writer->run_start = x0;
+    writer->run_end = x1;
+}
+
+bool pat_write_rle(
+    FILE *out,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    const char *rule,
+    const char *comment,
+    PatCellsFn cells,
+    void *ctx
+) {
+    if (comment != NULL) fprintf(out, "#C %s\n", comment);
+    fprintf(
+        out,
+        "x = %zu, y = %zu, rule = %s\n",
+        width,
+        height,
+        rule != NULL ? rule : "B3/S23"
+    );
+
+    PatWords words = {
+        .x0 = x,
+        .y0 = y,
+        .x1 = x + (int64_t)width,
+        .y1 = y + (int64_t)height,
+    };
+    cells(ctx, pat_collect, &words);
+    if (words.failed) {
+        free(words.items);
+        return false;
+    }
+    qsort(words.items, words.count, sizeof(PatWord), pat_compare_words);
+
+    PatWriter writer = {.out = out, .y = y, .x = x, .x0 = x};
+    for (size_t i = 0; i < words.count; i++) {
+        const PatWord *word = words.items + i;
+        uint64_t bits = word->bits;
+        while (bits != 0) {
+            int start = __builtin_ctzll(bits);
+            uint64_t rest = ~(bits >> start);
+            int end = rest == 0 ? 64 : start + __builtin_ctzll(rest);
+            pat_add_run(&writer, word->y, word->x + start, word->x + end);
+            bits = end == 64 ? 0 : bits & ~0ull << end;
+        }
+    }
+    pat_put_run(&writer);
+    free(words.items);
+    pat_put(&writer, 1, '!');
+    fputc('\n', out);
+    return !ferror(out);
+}
+
+#endif  // end of PATTERNS_IMPLEMENTATION
+#endif  // end of header guard
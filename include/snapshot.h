@@ -0,0 +1,518 @@
+/* Binary snapshot stream of particle state.
+A file starts with a SnapFileHeader and is followed by self-describing
+frames, so a reader can find every frame by walking their sizes and a
+truncated last frame, e.g. from a crash, is simply ignored. Each frame is
+a SnapFrameHeader followed by structure of arrays blocks, every block
+padded to 8 bytes:
+    x, y, vx, vy, ax, ay  float32 or float16, as given by the frame's format
+    m                     float32
+    flags                 uint8, SNAP_FLAG_*
+Accelerations are kept so integrators that use the previous one can
+restart exactly.
+Values are stored in the machine's byte order, which is little endian on
+every platform this is built for.
+
+Frames are written by a background thread. snap_frame_begin hands out a
+buffer to fill, snap_frame_submit queues it and returns right away.
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SNAP_MAGIC "NBODYSNP"
+#define SNAP_FRAME_MAGIC "FRME"
+#define SNAP_VERSION 1
+// Frames that can be in flight before snap_frame_begin has to wait
+#define SNAP_MAX_BUFFERS 8
+#define SNAP_FILE_BUFFER (1 << 20)
+
+#define SNAP_FLAG_STATIC 1
+
+typedef enum {
+    SNAP_FLOAT32,
+    SNAP_FLOAT16,
+    SnapFormatCount,
+} SnapFormat;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} SnapFileHeader;
+
+typedef struct {
+    char magic[4];
+    uint32_t format;  // SnapFormat of every block but m and flags
+    uint64_t size;    // whole frame in bytes, header included
+    uint64_t step;
+    double time;
+    uint64_t count;
+    uint64_t reserved;
+} SnapFrameHeader;
+
+typedef enum {
+    SNAP_X,
+    SNAP_Y,
+    SNAP_VX,
+    SNAP_VY,
+    SNAP_AX,
+    SNAP_AY,
+    SNAP_M,
+    SnapBlockCount,
+} SnapBlock;
+
+// A frame being filled in, always in float32
+typedef struct {
+    uint64_t step;
+    double time;
+    size_t count;
+    float *blocks[SnapBlockCount];
+    uint8_t *flags;
+    size_t capacity;
+} SnapFrame;
+
+typedef struct {
+    FILE *file;
+    SnapFormat format;
+    bool failed;  // a write failed and later frames are dropped
+    size_t frames_written;
+    uint64_t bytes_written;
+
+    pthread_t thread;
+    bool threaded;  // false when the thread couldn't be created
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t written;
+    bool quit;
+    SnapFrame *buffers[SNAP_MAX_BUFFERS];
+    size_t buffer_count;
+    SnapFrame *idle[SNAP_MAX_BUFFERS];
+    size_t idle_count;
+    SnapFrame *queue[SNAP_MAX_BUFFERS];
+    size_t queue_start;
+    size_t queue_count;
+    uint16_t *half;  // float16 conversion buffer of the writer thread
+    size_t half_capacity;
+} SnapWriter;
+
+// A frame inside of a mapped file
+typedef struct {
+    const SnapFrameHeader *header;
+    const void *blocks[SnapBlockCount];
+    const uint8_t *flags;
+} SnapFrameView;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    bool mapped;  // data is a mapping rather than a heap copy
+    size_t *offsets;
+    size_t frame_count;
+} SnapReader;
+
+uint16_t snap_f32_to_f16(float value);
+float snap_f16_to_f32(uint16_t value);
+
+// Returns false when the file couldn't be created
+bool snap_writer_open(SnapWriter *writer, const char *path, SnapFormat format);
+// Waits until every queued frame is written, then closes the file.
+// Returns false if any write failed.
+bool snap_writer_close(SnapWriter *writer);
+// Buffer for a frame of `count` particles. Returns NULL when memory
+// couldn't be allocated.
+SnapFrame *snap_frame_begin(SnapWriter *writer, size_t count);
+void snap_frame_submit(SnapWriter *writer, SnapFrame *frame);
+
+// Maps the file and indexes its frames. Returns false when the file can't
+// be read or isn't a snapshot stream of a known version.
+bool snap_reader_open(SnapReader *reader, const char *path);
+void snap_reader_close(SnapReader *reader);
+bool snap_reader_frame(
+    const SnapReader *reader, size_t index, SnapFrameView *view
+);
+// Converts one block of a frame to float32, `out` holds header->count values
+void snap_decode(const SnapFrameView *view, SnapBlock block, float *out);
+
+#ifdef SNAPSHOT_IMPLEMENTATION
+
+uint16_t snap_f32_to_f16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (((bits >> 23) & 0xFF) == 0xFF) {
+        // Infinity stays infinity and NaN stays a quiet NaN
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 31) return sign | 0x7C00;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        // Subnormal, shift the implicit bit in and round to nearest even
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    // Carrying into the exponent rounds up to the next power of two or inf
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+float snap_f16_to_f32(uint16_t value) {
+    uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal, normalize it
+        exponent = 127 - 15 + 1;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static size_t snap_padded(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static size_t snap_value_size(SnapFormat format, SnapBlock block) {
+    if (block == SNAP_M || format == SNAP_FLOAT32) return sizeof(float);
+    return sizeof(uint16_t);
+}
+
+static size_t snap_frame_size(SnapFormat format, size_t count) {
+    size_t size = sizeof(SnapFrameHeader);
+    for (int block = 0; block < SnapBlockCount; block++) {
+        size += snap_padded(count * snap_value_size(format, block));
+    }
+    return size + snap_padded(count);
+}
+
+static bool snap_write_padded(
+    SnapWriter *writer, const void *data, size_t size
+) {
+    static const uint8_t ZEROS[8] = {0};
+    size_t padding = snap_padded(size) - size;
+    if (fwrite(data, 1, size, writer->file) != size) return false;
+    if (fwrite(ZEROS, 1, padding, writer->file) != padding) return false;
+    writer->bytes_written += size + padding;
+    return true;
+}
+
+static bool snap_write_frame(SnapWriter *writer, const SnapFrame *frame) {
+    size_t count = frame->count;
+    SnapFrameHeader header = {
+        .format = writer->format,
+        .size = snap_frame_size(writer->format, count),
+        .step = frame->step,
+        .time = frame->time,
+        .count = count,
+    };
+    memcpy(header.magic, SNAP_FRAME_MAGIC, sizeof(header.magic));
+    if (!snap_write_padded(writer, &header, sizeof(header))) return false;
+
+    if (writer->format == SNAP_FLOAT16 && count > writer->half_capacity) {
+        uint16_t *half = realloc(writer->half, count * sizeof(*half));
+        if (half == NULL) return false;
+        writer->half = half;
+        writer->half_capacity = count;
+    }
+    for (int block = 0; block < SnapBlockCount; block++) {
+        const void *data = frame->blocks[block];
+        if (snap_value_size(writer->format, block) == sizeof(uint16_t)) {
+            for (size_t i = 0; i < count; i++) {
+                writer->half[i] = snap_f32_to_f16(frame->blocks[block][i]);
+            }
+            data = writer->half;
+        }
+        size_t size = count * snap_value_size(writer->format, block);
+        if (!snap_write_padded(writer, data, size)) return false;
+    }
+    if (!snap_write_padded(writer, frame->flags, count)) return false;
+    writer->frames_written++;
+    return true;
+}
+
+static void snap_write_queued(SnapWriter *writer, SnapFrame *frame) {
+    if (!writer->failed && !snap_write_frame(writer, frame)) {
+        writer->failed = true;
+    }
+}
+
+static void *snap_writer_main(void *arg) {
+    SnapWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queue_count == 0 && !writer->quit) {
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        }
+        if (writer->queue_count == 0) break;
+        SnapFrame *frame = writer->queue[writer->queue_start];
+        pthread_mutex_unlock(&writer->lock);
+
+        snap_write_queued(writer, frame);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->queue_start = (writer->queue_start + 1) % SNAP_MAX_BUFFERS;
+        writer->queue_count--;
+        writer->idle[writer->idle_count++] = frame;
+        pthread_cond_signal(&writer->written);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+bool snap_writer_open(SnapWriter *writer, const char *path, SnapFormat format) {
+    memset(writer, 0, sizeof(*writer));
+    writer->format = format;
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) return false;
+    setvbuf(writer->file, NULL, _IOFBF, SNAP_FILE_BUFFER);
+
+    SnapFileHeader header = {.version = SNAP_VERSION};
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    if (!snap_write_padded(writer, &header, sizeof(header))) {
+        fclose(writer->file);
+        writer->file = NULL;
+        return false;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->written, NULL);
+    writer->threaded =
+        pthread_create(&writer->thread, NULL, snap_writer_main, writer) == 0;
+    return true;
+}
+
+bool snap_writer_close(SnapWriter *writer) {
+    if (writer->file == NULL) return false;
+    if (writer->threaded) {
+        pthread_mutex_lock(&writer->lock);
+        writer->quit = true;
+        pthread_cond_signal(&writer->queued);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    if (fclose(writer->file) != 0) writer->failed = true;
+    writer->file = NULL;
+
+    for (size_t i = 0; i < writer->buffer_count; i++) {
+        SnapFrame *frame = writer->buffers[i];
+        for (int block = 0; block < SnapBlockCount; block++) {
+            free(frame->blocks[block]);
+        }
+        free(frame->flags);
+        free(frame);
+    }
+    free(writer->half);
+    pthread_cond_destroy(&writer->written);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+    return !writer->failed;
+}
+
+static bool snap_frame_reserve(SnapFrame *frame, size_t count) {
+    if (count <= frame->capacity) return true;
+    for (int block = 0; block < SnapBlockCount; block++) {
+        float *values = realloc(frame->blocks[block], count * sizeof(float));
+        if (values == NULL) return false;
+        frame->blocks[block] = values;
+    }
+    uint8_t *flags = realloc(frame->flags, count);
+    if (flags == NULL) return false;
+    frame->flags = flags;
+    frame->capacity = count;
+    return true;
+}
+
+SnapFrame *snap_frame_begin(SnapWriter *writer, size_t count) {
+    SnapFrame *frame = NULL;
+    pthread_mutex_lock(&writer->lock);
+    // Only waits when the disk can't keep up with SNAP_MAX_BUFFERS frames
+    while (writer->idle_count == 0 &&
+           writer->buffer_count == SNAP_MAX_BUFFERS) {
+        pthread_cond_wait(&writer->written, &writer->lock);
+    }
+    if (writer->idle_count > 0) {
+        frame = writer->idle[--writer->idle_count];
+    } else {
+        frame = calloc(1, sizeof(*frame));
+        if (frame != NULL) writer->buffers[writer->buffer_count++] = frame;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (frame == NULL) return NULL;
+    if (!snap_frame_reserve(frame, count)) {
+        pthread_mutex_lock(&writer->lock);
+        writer->idle[writer->idle_count++] = frame;
+        pthread_mutex_unlock(&writer->lock);
+        return NULL;
+    }
+    frame->count = count;
+    return frame;
+}
+
+void snap_frame_submit(SnapWriter *writer, SnapFrame *frame) {
+    if (!writer->threaded) {
+        snap_write_queued(writer, frame);
+        writer->idle[writer->idle_count++] = frame;
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    size_t end = (writer->queue_start + writer->queue_count) % SNAP_MAX_BUFFERS;
+    writer->queue[end] = frame;
+    writer->queue_count++;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static bool snap_map(SnapReader *reader, const char *path) {
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    reader->data = data;
+    reader->size = info.st_size;
+    reader->mapped = true;
+    return true;
+#else
+    // No mmap here, read the whole file instead
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    reader->data = data;
+    reader->size = size;
+    reader->mapped = false;
+    return true;
+#endif
+}
+
+bool snap_reader_open(SnapReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    if (!snap_map(reader, path)) return false;
+
+    SnapFileHeader header;
+    if (reader->size < sizeof(header)) {
+        snap_reader_close(reader);
+        return false;
+    }
+    memcpy(&header, reader->data, sizeof(header));
+    if (memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAP_VERSION) {
+        snap_reader_close(reader);
+        return false;
+    }
+
+    size_t capacity = 0;
+    size_t offset = snap_padded(sizeof(header));
+    while (offset + sizeof(SnapFrameHeader) <= reader->size) {
+        SnapFrameHeader frame;
+        memcpy(&frame, reader->data + offset, sizeof(frame));
+        if (memcmp(frame.magic, SNAP_FRAME_MAGIC, sizeof(frame.magic)) != 0 ||
+            frame.format >= SnapFormatCount ||
+            frame.size != snap_frame_size(frame.format, frame.count) ||
+            frame.size > reader->size - offset) {
+            break;
+        }
+        if (reader->frame_count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            size_t *offsets =
+                realloc(reader->offsets, capacity * sizeof(*offsets));
+            if (offsets == NULL) {
+                snap_reader_close(reader);
+                return false;
+            }
+            reader->offsets = offsets;
+        }
+        reader->offsets[reader->frame_count++] = offset;
+        offset += frame.size;
+    }
+    return true;
+}
+
+void snap_reader_close(SnapReader *reader) {
+#ifndef _WIN32
+    if (reader->mapped) munmap((void *)reader->data, reader->size);
+#endif
+    if (!reader->mapped) free((void *)reader->data);
+    free(reader->offsets);
+    memset(reader, 0, sizeof(*reader));
+}
+
+bool snap_reader_frame(
+    const SnapReader *reader, size_t index, SnapFrameView *view
+) {
+    if (index >= reader->frame_count) return false;
+    const uint8_t *data = reader->data + reader->offsets[index];
+    // Frames start at multiples of 8 bytes, so the header can be used as is
+    view->header = (const SnapFrameHeader *)data;
+    size_t count = view->header->count;
+    SnapFormat format = view->header->format;
+    data += sizeof(SnapFrameHeader);
+    for (int block = 0; block < SnapBlockCount; block++) {
+        view->blocks[block] = data;
+        data += snap_padded(count * snap_value_size(format, block));
+    }
+    view->flags = data;
+    return true;
+}
+
+void snap_decode(const SnapFrameView *view, SnapBlock block, float *out) {
+    size_t count = view->header->count;
+    if (snap_value_size(view->header->format, block) == sizeof(float)) {
+        memcpy(out, view->blocks[block], count * sizeof(float));
+        return;
+    }
+    const uint16_t *half = view->blocks[block];
+    for (size_t i = 0; i < count; i++) out[i] = snap_f16_to_f32(half[i]);
+}
+
+#endif  // end of SNAPSHOT_IMPLEMENTATION
+#endif  // end of header guard
@@ -0,0 +1,367 @@
+/* Uniform grid over 2D points, rebuilt from scratch with a counting sort.
+Points are read through a byte stride so arrays of structs like Particle
+can be indexed directly, e.g.
+    sgrid_build(&grid, &items[0].r, count, sizeof(*items), cell_size);
+Once built, it answers nearest point queries by only looking at the cells
+around the query point. It also provides a Z-order (Morton) sort, used to
+keep points that are close in space close in memory.
+*/
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Upper bound of cells per point, so far away outliers can't blow up memory
+#define SGRID_MAX_CELLS_PER_POINT 4
+
+typedef struct {
+    float origin_x;
+    float origin_y;
+    float cell;
+    size_t width;   // in cells
+    size_t height;  //
+    uint32_t *cell_start;  // entries of cell c are [cell_start[c], [c + 1])
+    uint32_t *entries;     // point indices sorted by cell
+    uint32_t *point_cell;  // cell of each point
+    size_t cells_capacity;
+    size_t points_capacity;
+} SpatialGrid;
+
+typedef void (*SgridPairFn)(void *ctx, size_t a, size_t b);
+
+typedef struct {
+    uint32_t *order;  // order[k] is the point that goes to position k
+    uint32_t *keys;   // Morton codes, sorted along with order
+    uint32_t *scratch;
+    size_t capacity;
+} SgridMorton;
+
+// Returns false when memory couldn't be allocated
+bool sgrid_build(
+    SpatialGrid *grid,
+    const void *points,
+    size_t count,
+    size_t stride,
+    float cell
+);
+// Calls `fn` once for each pair of points in the same or adjacent cells
+void sgrid_visit_pairs(const SpatialGrid *grid, SgridPairFn fn, void *ctx);
+// Finds the point closest to (x, y) that's at most `radius` away and stores
+// its index in `nearest`. Returns false when there's no such point.
+// `points` and `stride` must be the ones the grid was built from.
+bool sgrid_nearest(
+    const SpatialGrid *grid,
+    const void *points,
+    size_t stride,
+    float x,
+    float y,
+    float radius,
+    size_t *nearest
+);
+void sgrid_free(SpatialGrid *grid);
+// Sorts points along a Z-order curve over their bounding box and leaves
+// the permutation in morton->order. Returns false when memory couldn't be
+// allocated.
+bool sgrid_morton_sort(
+    SgridMorton *morton,
+    const void *points,
+    size_t count,
+    size_t stride
+);
+void sgrid_morton_free(SgridMorton *morton);
+
+#ifdef SPATIAL_GRID_IMPLEMENTATION
+
+static const float *sgrid_point(const void *points, size_t stride, size_t i) {
+    return (const float *)((const char *)points + i * stride);
+}
+
+static bool sgrid_reserve(uint32_t **items, size_t *capacity, size_t count) {
+    if (count <= *capacity) return true;
+    uint32_t *new_items = realloc(*items, count * sizeof(uint32_t));
+    if (new_items == NULL) return false;
+    *items = new_items;
+    *capacity = count;
+    return true;
+}
+
+bool sgrid_build(
+    SpatialGrid *grid,
+    const void *points,
+    size_t count,
+    size_t stride,
+    float cell
+) {
+    float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+    for (size_t i = 0; i < count; i++) {
+        const float *p = sgrid_point(points, stride, i);
+        if (i == 0 || p[0] < min_x) min_x = p[0];
+        if (i == 0 || p[1] < min_y) min_y = p[1];
+        if (i == 0 || p[0] > max_x) max_x = p[0];
+        if (i == 0 || p[1] > max_y) max_y = p[1];
+    }
+
+    if (!(cell > 0)) cell = 1;
+    // Grow cells until the grid fits in its budget
+    size_t max_cells = SGRID_MAX_CELLS_PER_POINT * count + 1;
+    for (;;) {
+        grid->width = (size_t)((max_x - min_x) / cell) + 1;
+        grid->height = (size_t)((max_y - min_y) / cell) + 1;
+        if ((double)grid->width * grid->height <= max_cells) break;
+        cell *= 2;
+    }
+    grid->origin_x = min_x;
+    grid->origin_y = min_y;
+    grid->cell = cell;
+
+    size_t cells = grid->width * grid->height;
+    if (!sgrid_reserve(&grid->cell_start, &grid->cells_capacity, cells + 1)) {
+        return false;
+    }
+    if (count > grid->points_capacity) {
+        size_t capacity = grid->points_capacity;
+        if (!sgrid_reserve(&grid->entries, &capacity, count)) return false;
+        capacity = grid->points_capacity;
+        if (!sgrid_reserve(&grid->point_cell, &capacity, count)) return false;
+        grid->points_capacity = count;
+    }
+
+    // Counting sort of points by cell
+    memset(grid->cell_start, 0, (cells + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        const float *p = sgrid_point(points, stride, i);
+        size_t cx = (size_t)((p[0] - min_x) / cell);
+        size_t cy = (size_t)((p[1] - min_y) / cell);
+        if (cx >= grid->width) cx = grid->width - 1;
+        if (cy >= grid->height) cy = grid->height - 1;
+        grid->point_cell[i] = cy * grid->width + cx;
+        grid->cell_start[grid->point_cell[i] + 1]++;
+    }
+    for (size_t c = 0; c < cells; c++) {
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    }
+    for (size_t i = 0; i < count; i++) {
+        grid->entries[grid->cell_start[grid->point_cell[i]]++] = i;
+    }
+    // Scattering shifted every start to the next cell's, shift them back
+    for (size_t c = cells; c > 0; c--) {
+        grid->cell_start[c] = grid->cell_start[c - 1];
+    }
+    grid->cell_start[0] = 0;
+    return true;
+}
+
+void sgrid_visit_pairs(const SpatialGrid *grid, SgridPairFn fn, void *ctx) {
+    // Half of the neighborhood, so every pair of cells is seen once
+    const int OFFSETS[4][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+    for (size_t cy = 0; cy < grid->height; cy++) {
+        for (size_t cx = 0; cx < grid->width; cx++) {
+            size_t c = cy * grid->width + cx;
+            uint32_t start = grid->cell_start[c];
+            uint32_t end = grid->cell_start[c + 1];
+            for (uint32_t a = start; a < end; a++) {
+                for (uint32_t b = a + 1; b < end; b++) {
+                    fn(ctx, grid->entries[a], grid->entries[b]);
+                }
+            }
+            if (start == end) continue;
+
+            for (int k = 0; k < 4; k++) {
+                size_t nx = cx + OFFSETS[k][0];
+                size_t ny = cy + OFFSETS[k][1];
+                // Unsigned wrap makes -1 fail this check too
+                if (nx >= grid->width || ny >= grid->height) continue;
+                size_t n = ny * grid->width + nx;
+                for (uint32_t a = start; a < end; a++) {
+                    for (uint32_t b = grid->cell_start[n];
+                         b < grid->cell_start[n + 1];
+                         b++) {
+                        fn(ctx, grid->entries[a], grid->entries[b]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Range of cells covering [low, high] on one axis, false if it's empty
+static bool sgrid_cell_range(
+    float low,
+    float high,
+    float origin,
+    float cell,
+    size_t cells,
+    size_t *first,
+    size_t *last
+) {
+    float first_cell = floorf((low - origin) / cell);
+    float last_cell = floorf((high - origin) / cell);
+    // Also rejects NaN
+    if (!(last_cell >= 0 && first_cell < (float)cells)) return false;
+    *first = first_cell > 0 ? (size_t)first_cell : 0;
+    *last = last_cell < (float)(cells - 1) ? (size_t)last_cell : cells - 1;
+    return true;
+}
+
+bool sgrid_nearest(
+    const SpatialGrid *grid,
+    const void *points,
+    size_t stride,
+    float x,
+    float y,
+    float radius,
+    size_t *nearest
+) {
+    size_t cx0, cx1, cy0, cy1;
+    if (grid->width == 0 || grid->height == 0 ||
+        !sgrid_cell_range(
+            x - radius,
+            x + radius,
+            grid->origin_x,
+            grid->cell,
+            grid->width,
+            &cx0,
+            &cx1
+        ) ||
+        !sgrid_cell_range(
+            y - radius,
+            y + radius,
+            grid->origin_y,
+            grid->cell,
+            grid->height,
+            &cy0,
+            &cy1
+        )) {
+        return false;
+    }
+
+    bool found = false;
+    float least_distance = radius * radius;
+    for (size_t cy = cy0; cy <= cy1; cy++) {
+        for (size_t cx = cx0; cx <= cx1; cx++) {
+            size_t c = cy * grid->width + cx;
+            for (uint32_t k = grid->cell_start[c];
+                 k < grid->cell_start[c + 1];
+                 k++) {
+                const float *p = sgrid_point(points, stride, grid->entries[k]);
+                float dx = p[0] - x;
+                float dy = p[1] - y;
+                float distance = dx * dx + dy * dy;
+                if (distance <= least_distance) {
+                    least_distance = distance;
+                    *nearest = grid->entries[k];
+                    found = true;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+void sgrid_free(SpatialGrid *grid) {
+    free(grid->cell_start);
+    free(grid->entries);
+    free(grid->point_cell);
+    memset(grid, 0, sizeof(*grid));
+}
+
+// Interleaves the lower 16 bits of x and y, x taking the even bits
+static uint32_t sgrid_morton_code(uint32_t x, uint32_t y) {
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    y = (y | (y << 8)) & 0x00FF00FF;
+    y = (y | (y << 4)) & 0x0F0F0F0F;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+    return x | (y << 1);
+}
+
+bool sgrid_morton_sort(
+    SgridMorton *morton,
+    const void *points,
+    size_t count,
+    size_t stride
+) {
+    if (count > morton->capacity) {
+        size_t capacity = morton->capacity;
+        if (!sgrid_reserve(&morton->order, &capacity, count)) return false;
+        capacity = morton->capacity;
+        if (!sgrid_reserve(&morton->keys, &capacity, count)) return false;
+        // Holds both the keys and the order of the other radix buffer
+        capacity = 2 * morton->capacity;
+        if (!sgrid_reserve(&morton->scratch, &capacity, 2 * count)) {
+            return false;
+        }
+        morton->capacity = count;
+    }
+    if (count == 0) return true;
+
+    float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+    for (size_t i = 0; i < count; i++) {
+        const float *p = sgrid_point(points, stride, i);
+        if (i == 0 || p[0] < min_x) min_x = p[0];
+        if (i == 0 || p[1] < min_y) min_y = p[1];
+        if (i == 0 || p[0] > max_x) max_x = p[0];
+        if (i == 0 || p[1] > max_y) max_y = p[1];
+    }
+    // Same scale on both axes, so the curve's cells stay square
+    float size = fmaxf(max_x - min_x, max_y - min_y);
+    float scale = size > 0 ? 65535 / size : 0;
+    for (size_t i = 0; i < count; i++) {
+        const float *p = sgrid_point(points, stride, i);
+        float qx = (p[0] - min_x) * scale;
+        float qy = (p[1] - min_y) * scale;
+        // NaN and out of range values end up in a corner
+        uint32_t x = qx > 0 ? (qx < 65535 ? qx : 65535) : 0;
+        uint32_t y = qy > 0 ? (qy < 65535 ? qy : 65535) : 0;
+        morton->keys[i] = sgrid_morton_code(x, y);
+        morton->order[i] = i;
+    }
+
+    // LSD radix sort over 8 bit digits, stable so equal codes keep order
+    uint32_t *keys = morton->keys, *order = morton->order;
+    uint32_t *other_keys = morton->scratch;
+    uint32_t *other_order = morton->scratch + count;
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            offsets[(keys[i] >> shift) & 0xFF]++;
+        }
+        size_t sum = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t digits = offsets[d];
+            offsets[d] = sum;
+            sum += digits;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t k = offsets[(keys[i] >> shift) & 0xFF]++;
+            other_keys[k] = keys[i];
+            other_order[k] = order[i];
+        }
+        uint32_t *swap = keys;
+        keys = other_keys;
+        other_keys = swap;
+        swap = order;
+        order = other_order;
+        other_order = swap;
+    }
+    // An even number of passes leaves the result in the original buffers
+    return true;
+}
+
+void sgrid_morton_free(SgridMorton *morton) {
+    free(morton->order);
+    free(morton->keys);
+    free(morton->scratch);
+    memset(morton, 0, sizeof(*morton));
+}
+
+#endif  // end of SPATIAL_GRID_IMPLEMENTATION
+#endif  // end of header guard
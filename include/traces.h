@@ -0,0 +1,265 @@
+/* Compact ring buffers of recent positions, one per body.
+Points are quantized to 16 bits inside a fixed rectangle and laid out as
+structure of arrays: the x coordinates of all traces in one array and the
+y coordinates in another, each trace owning `length` consecutive slots.
+A point is only recorded every `decimation` steps, or sooner when the body
+moved more than `min_distance` away from the last recorded point.
+*/
+#ifndef TRACES_H
+#define TRACES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRC_QUANTA 65535.0f
+
+typedef struct {
+    size_t length;      // points kept per trace
+    size_t decimation;  // steps between recorded points
+    float min_distance;
+    float origin_x;  // quantization rectangle
+    float origin_y;  //
+    float scale_x;   // world units per quantum
+    float scale_y;   //
+
+    uint16_t *x;  // trace i owns [i * length, (i + 1) * length)
+    uint16_t *y;
+    uint32_t *head;   // slot of the newest point
+    uint32_t *count;  // recorded points, up to length
+    uint32_t *age;    // steps since the newest point was recorded
+    size_t traces;
+    size_t capacity;
+
+    // Spare arrays that trc_permute gathers into and then swaps with the
+    // ones above, so reordering doesn't allocate once they have grown
+    uint16_t *spare_x;
+    uint16_t *spare_y;
+    uint32_t *spare_head;
+    uint32_t *spare_count;
+    uint32_t *spare_age;
+    size_t spare_capacity;
+} TraceStore;
+
+// Points outside of the rectangle are clamped to its edges
+void trc_init(
+    TraceStore *store,
+    size_t length,
+    size_t decimation,
+    float min_distance,
+    float x,
+    float y,
+    float width,
+    float height
+);
+// Grows or shrinks the store to `traces` traces, new ones start empty.
+// Returns false when memory couldn't be allocated.
+bool trc_resize(TraceStore *store, size_t traces);
+void trc_clear(TraceStore *store, size_t i);
+// Called once per step, records the position if it's due
+void trc_record(TraceStore *store, size_t i, float x, float y);
+// k-th newest point of trace i, k must be below store->count[i]
+void trc_point(const TraceStore *store, size_t i, size_t k, float *x, float *y);
+// Removes trace i and moves the last trace in its place
+void trc_swap_remove(TraceStore *store, size_t i);
+// Moves trace order[k] to position k for every trace, all at once.
+// Returns false when memory for the spare arrays couldn't be allocated.
+bool trc_permute(TraceStore *store, const uint32_t *order);
+size_t trc_memory(const TraceStore *store);
+void trc_free(TraceStore *store);
+
+#ifdef TRACES_IMPLEMENTATION
+
+static uint16_t trc_quantize(float value, float origin, float scale) {
+    float q = (value - origin) / scale + 0.5f;
+    if (!(q > 0)) return 0;  // NaN lands here as well
+    if (q > TRC_QUANTA) return (uint16_t)TRC_QUANTA;
+    return (uint16_t)q;
+}
+
+void trc_init(
+    TraceStore *store,
+    size_t length,
+    size_t decimation,
+    float min_distance,
+    float x,
+    float y,
+    float width,
+    float height
+) {
+    memset(store, 0, sizeof(*store));
+    store->length = length < 2 ? 2 : length;
+    store->decimation = decimation < 1 ? 1 : decimation;
+    store->min_distance = min_distance;
+    store->origin_x = x;
+    store->origin_y = y;
+    store->scale_x = width / TRC_QUANTA;
+    store->scale_y = height / TRC_QUANTA;
+}
+
+static bool trc_realloc(void **items, size_t size) {
+    void *new_items = realloc(*items, size);
+    if (new_items == NULL) return false;
+    *items = new_items;
+    return true;
+}
+
+bool trc_resize(TraceStore *store, size_t traces) {
+    if (traces > store->capacity) {
+        size_t capacity = store->capacity * 2;
+        if (capacity < traces) capacity = traces;
+        size_t points = capacity * store->length * sizeof(uint16_t);
+        size_t fields = capacity * sizeof(uint32_t);
+        if (!trc_realloc((void **)&store->x, points) ||
+            !trc_realloc((void **)&store->y, points) ||
+            !trc_realloc((void **)&store->head, fields) ||
+            !trc_realloc((void **)&store->count, fields) ||
+            !trc_realloc((void **)&store->age, fields)) {
+            return false;
+        }
+        store->capacity = capacity;
+    }
+    for (size_t i = store->traces; i < traces; i++) trc_clear(store, i);
+    store->traces = traces;
+    return true;
+}
+
+void trc_clear(TraceStore *store, size_t i) {
+    store->head[i] = 0;
+    store->count[i] = 0;
+    store->age[i] = 0;
+}
+
+void trc_record(TraceStore *store, size_t i, float x, float y) {
+    uint32_t count = store->count[i];
+    if (count > 0) {
+        store->age[i]++;
+        if (store->age[i] < store->decimation) {
+            float last_x, last_y;
+            trc_point(store, i, 0, &last_x, &last_y);
+            float dx = x - last_x;
+            float dy = y - last_y;
+            float d = store->min_distance;
+            if (dx * dx + dy * dy <= d * d) return;
+        }
+    }
+
+    // Newest points go backwards through the ring
+    uint32_t head = store->head[i];
+    head = head == 0 ? store->length - 1 : head - 1;
+    size_t slot = i * store->length + head;
+    store->x[slot] = trc_quantize(x, store->origin_x, store->scale_x);
+    store->y[slot] = trc_quantize(y, store->origin_y, store->scale_y);
+    store->head[i] = head;
+    store->age[i] = 0;
+    if (count < store->length) store->count[i] = count + 1;
+}
+
+void trc_point(
+    const TraceStore *store,
+    size_t i,
+    size_t k,
+    float *x,
+    float *y
+) {
+    size_t slot = store->head[i] + k;
+    if (slot >= store->length) slot -= store->length;
+    slot += i * store->length;
+    *x = store->origin_x + store->x[slot] * store->scale_x;
+    *y = store->origin_y + store->y[slot] * store->scale_y;
+}
+
+void trc_swap_remove(TraceStore *store, size_t i) {
+    size_t last = --store->traces;
+    if (i == last) return;
+    size_t length = store->length;
+    memcpy(
+        store->x + i * length,
+        store->x + last * length,
+        length * sizeof(*store->x)
+    );
+    memcpy(
+        store->y + i * length,
+        store->y + last * length,
+        length * sizeof(*store->y)
+    );
+    store->head[i] = store->head[last];
+    store->count[i] = store->count[last];
+    store->age[i] = store->age[last];
+}
+
+static void trc_swap(void **a, void **b) {
+    void *t = *a;
+    *a = *b;
+    *b = t;
+}
+
+bool trc_permute(TraceStore *store, const uint32_t *order) {
+    if (store->capacity == 0) return true;
+    // The arrays get swapped, so the spare ones follow the capacity
+    if (store->spare_capacity != store->capacity) {
+        size_t points = store->capacity * store->length * sizeof(uint16_t);
+        size_t fields = store->capacity * sizeof(uint32_t);
+        if (!trc_realloc((void **)&store->spare_x, points) ||
+            !trc_realloc((void **)&store->spare_y, points) ||
+            !trc_realloc((void **)&store->spare_head, fields) ||
+            !trc_realloc((void **)&store->spare_count, fields) ||
+            !trc_realloc((void **)&store->spare_age, fields)) {
+            return false;
+        }
+        store->spare_capacity = store->capacity;
+    }
+
+    size_t length = store->length;
+    for (size_t k = 0; k < store->traces; k++) {
+        size_t i = order[k];
+        memcpy(
+            store->spare_x + k * length,
+            store->x + i * length,
+            length * sizeof(*store->x)
+        );
+        memcpy(
+            store->spare_y + k * length,
+            store->y + i * length,
+            length * sizeof(*store->y)
+        );
+        store->spare_head[k] = store->head[i];
+        store->spare_count[k] = store->count[i];
+        store->spare_age[k] = store->age[i];
+    }
+
+    trc_swap((void **)&store->x, (void **)&store->spare_x);
+    trc_swap((void **)&store->y, (void **)&store->spare_y);
+    trc_swap((void **)&store->head, (void **)&store->spare_head);
+    trc_swap((void **)&store->count, (void **)&store->spare_count);
+    trc_swap((void **)&store->age, (void **)&store->spare_age);
+    return true;
+}
+
+size_t trc_memory(const TraceStore *store) {
+    size_t trace = 2 * store->length * sizeof(uint16_t) + 3 * sizeof(uint32_t);
+    return (store->capacity + store->spare_capacity) * trace;
+}
+
+void trc_free(TraceStore *store) {
+    free(store->x);
+    free(store->y);
+    free(store->head);
+    free(store->count);
+    free(store->age);
+    free(store->spare_x);
+    free(store->spare_y);
+    free(store->spare_head);
+    free(store->spare_count);
+    free(store->spare_age);
+    store->x = store->y = NULL;
+    store->head = store->count = store->age = NULL;
+    store->spare_x = store->spare_y = NULL;
+    store->spare_head = store->spare_count = store->spare_age = NULL;
+    store->traces = store->capacity = store->spare_capacity = 0;
+}
+
+#endif  // end of TRACES_IMPLEMENTATION
+#endif  // end of header guard
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // Setting allocation functions
 #define UTL_FREE free
@@ -93,6 +94,8 @@ struct {
 /******* Other utilities *******/
 #define utl_array_size(a) (sizeof(a) / sizeof((a)[0]))
 int utl_safe_wrap(int value, int max);
+// Wall clock time in seconds, used for timing benchmarks and headless runs
+double utl_time(void);
 
 inline float util_wrap_angle( float angle );
 
@@ -137,6 +140,12 @@ void utl_log(utl_log_level level, const char *format, ...) {
 
 int utl_safe_wrap(int value, int max) { return ((value % max) + max) % max; }
 
+double utl_time(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 inline float util_wrap_angle( float angle )
 {
     double twoPi = 2.0 * PI;
@@ -0,0 +1,179 @@
+/* Small fork-join thread pool.
+wrk_run hands out task indices to all workers (the calling thread included)
+and returns once every task is done. When threads can't be created, e.g. on
+the web build, everything runs on the calling thread.
+*/
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#define WRK_MAX_THREADS 256
+
+// `worker` is in [0, thread_count) and is unique among running tasks
+typedef void (*WrkTask)(void *ctx, size_t task, size_t worker);
+
+typedef struct WrkPool WrkPool;
+
+typedef struct {
+    WrkPool *pool;
+    size_t index;
+} WrkWorker;
+
+struct WrkPool {
+    size_t thread_count;  // including the calling thread
+    pthread_t threads[WRK_MAX_THREADS];
+    WrkWorker workers[WRK_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    size_t running;
+    bool quit;
+
+    WrkTask task;
+    void *ctx;
+    size_t task_count;
+    atomic_size_t next_task;
+
+    // Per worker memory that tasks can use as private accumulators
+    void *scratch[WRK_MAX_THREADS];
+    size_t scratch_size[WRK_MAX_THREADS];
+};
+
+// Number of hardware threads available to the process
+size_t wrk_hardware_threads(void);
+// thread_count of 0 uses wrk_hardware_threads().
+// The pool must not be moved after initialization.
+void wrk_pool_init(WrkPool *pool, size_t thread_count);
+void wrk_pool_free(WrkPool *pool);
+void wrk_run(WrkPool *pool, WrkTask task, void *ctx, size_t task_count);
+// Makes sure every worker has at least `size` bytes of scratch memory.
+// Returns false if memory couldn't be allocated.
+bool wrk_reserve_scratch(WrkPool *pool, size_t size);
+
+#ifdef WORKERS_IMPLEMENTATION
+
+size_t wrk_hardware_threads(void) {
+    long count = 1;
+#if defined(_WIN32)
+    count = pthread_num_processors_np();
+#elif defined(_SC_NPROCESSORS_ONLN)
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1) count = 1;
+    if (count > WRK_MAX_THREADS) count = WRK_MAX_THREADS;
+    return count;
+}
+
+static void wrk_drain(WrkPool *pool, size_t worker) {
+    for (;;) {
+        size_t task = atomic_fetch_add(&pool->next_task, 1);
+        if (task >= pool->task_count) break;
+        pool->task(pool->ctx, task, worker);
+    }
+}
+
+static void *wrk_main(void *arg) {
+    WrkWorker *worker = arg;
+    WrkPool *pool = worker->pool;
+    size_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        wrk_drain(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void wrk_pool_init(WrkPool *pool, size_t thread_count) {
+    memset(pool, 0, sizeof(*pool));
+    if (thread_count == 0) thread_count = wrk_hardware_threads();
+    if (thread_count > WRK_MAX_THREADS) thread_count = WRK_MAX_THREADS;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->next_task, 0);
+
+    pool->thread_count = 1;
+    for (size_t i = 1; i < thread_count; i++) {
+        pool->workers[i] = (WrkWorker){.pool = pool, .index = i};
+        if (pthread_create(
+                pool->threads + i, NULL, wrk_main, pool->workers + i
+            ) != 0) {
+            break;
+        }
+        pool->thread_count++;
+    }
+}
+
+void wrk_pool_free(WrkPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (size_t i = 0; i < WRK_MAX_THREADS; i++) free(pool->scratch[i]);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pool->thread_count = 0;
+}
+
+void wrk_run(WrkPool *pool, WrkTask task, void *ctx, size_t task_count) {
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->task_count = task_count;
+    atomic_store(&pool->next_task, 0);
+    if (pool->thread_count <= 1 || task_count <= 1) {
+        wrk_drain(pool, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = pool->thread_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    wrk_drain(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool wrk_reserve_scratch(WrkPool *pool, size_t size) {
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        if (pool->scratch_size[i] >= size) continue;
+        void *memory = realloc(pool->scratch[i], size);
+        if (memory == NULL) return false;
+        pool->scratch[i] = memory;
+        pool->scratch_size[i] = size;
+    }
+    return true;
+}
+
+#endif  // end of WORKERS_IMPLEMENTATION
+#endif  // end of header guard
@@ -8,6 +8,8 @@
 #include "raymath.h"
 #define MOTION_IMPLEMENTATION
 #include "motion.h"
+#define SPATIAL_GRID_IMPLEMENTATION
+#include "spatial_grid.h"
 #define UTL_IMPLEMENTATION
 #include "rayutl.h"
 #include "utl.h"
@@ -24,6 +26,7 @@
 #define INIT_G 98.1
 #define DRAG 0.01
 #define SPEED 5.0
+#define PICK_RADIUS (DISTANCE / 2)
 
 typedef struct {
     Vector2 *items;
@@ -55,6 +58,8 @@ typedef struct {
 Points points;
 Links links;
 Vector2Buffer buffer;
+SpatialGrid pick_grid;
+bool pick_grid_stale = true;  // points moved since it was built
 
 bool paused = false;
 bool dragging = false;
@@ -124,22 +129,39 @@ void update_physics(float dt) {
         if (!p1->is_static) p1->r = Vector2Add(p1->r, displacement);
         if (!p2->is_static) p2->r = Vector2Subtract(p2->r, displacement);
     }
+    pick_grid_stale = true;
 }
 
-// Does a linear search though all points.
-// Only is performant for not too large numbers of points
+// Looks around pos in a grid that's rebuilt when the points moved since the
+// last pick, so it's only called when a button goes down.
 // Returns null if there's no particle in a radius of distance/2
 Particle *nearest_particle(Points points, Vector2 pos) {
-    float least_distance = DISTANCE / 2;
-    Particle *result = NULL;
-    for (size_t i = 0; i < points.count; i++) {
-        float distance = Vector2Length(Vector2Subtract(points.items[i].r, pos));
-        if (distance <= least_distance) {
-            least_distance = distance;
-            result = points.items + i;
+    if (pick_grid_stale) {
+        if (!sgrid_build(
+                &pick_grid,
+                &points.items[0].r,
+                points.count,
+                sizeof(*points.items),
+                PICK_RADIUS
+            )) {
+            utl_log(UTL_ERROR, "Couldn't allocate picking grid.");
+            exit(-1);
         }
+        pick_grid_stale = false;
+    }
+    size_t nearest;
+    if (!sgrid_nearest(
+            &pick_grid,
+            &points.items[0].r,
+            sizeof(*points.items),
+            pos.x,
+            pos.y,
+            PICK_RADIUS,
+            &nearest
+        )) {
+        return NULL;
     }
-    return result;
+    return points.items + nearest;
 }
 
 void update_draw_frame(void) {
@@ -154,9 +176,9 @@ void update_draw_frame(void) {
     wind.x += GetMouseWheelMove() * 40.0;
     Vector2 mouse_pos = GetMousePosition();
     if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-        // Set clicked_particle before dragging starts
+        // Set clicked_particle when the button goes down
         // so it doesn't change with mouse pos
-        if (!dragging) {
+        if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
             clicked_node = nearest_particle(points, mouse_pos);
         }
         // Initiate dragging if mouse position delta is big enough
@@ -170,6 +192,7 @@ void update_draw_frame(void) {
             mot_integrate_verlet(
                 &clicked_node->r, drag_acc, clicked_node->r, 0.1, 0
             );
+            pick_grid_stale = true;
         }
     }
     if (IsMouseButtonReleased(MOUSE_LEFT_BUTTON)) {
@@ -302,6 +325,7 @@ int main(void) {
     utl_da_free(links);
     utl_da_free(buffer);
     utl_da_free(points);
+    sgrid_free(&pick_grid);
 
     return 0;
 }
\ No newline at end of file
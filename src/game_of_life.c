@@ -1,18 +1,27 @@
 // Conway's Game Of Life
-// Ideas for future:
-// - Implement patterns
 
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
 #include "raylib.h"
 #define UTL_IMPLEMENTATION
+#define WORKERS_IMPLEMENTATION
+#define LIFE_IMPLEMENTATION
+#define HASHLIFE_IMPLEMENTATION
+#define CHUNKS_IMPLEMENTATION
+#define PATTERNS_IMPLEMENTATION
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include "chunks.h"
+#include "hashlife.h"
+#include "life.h"
+#include "patterns.h"
 #include "rayutl.h"
 #include "utl.h"
+#include "workers.h"
 
 #define PANEL_H 70
 #define FPS 60
@@ -25,6 +34,19 @@ typedef enum {
     InputBoxCount,
 } InputBox;
 
+typedef enum {
+    ENGINE_PACKED,
+    ENGINE_HASHLIFE,
+    ENGINE_SPARSE,
+    EngineCount,
+} Engine;
+
+const char *ENGINE_NAMES[] = {
+    [ENGINE_PACKED] = "packed",
+    [ENGINE_HASHLIFE] = "hashlife",
+    [ENGINE_SPARSE] = "sparse",
+};
+
 typedef struct {
     char *items;
     size_t capacity;
@@ -39,11 +61,34 @@ int grid_h = 120;
 float cell_width;
 float cell_height;
 
+// The torus of the packed engine, or the part of the unbounded plane of the
+// other engines under the grid, which starts at (0, 0)
+LifeBoard board;
+WrkPool pool;
+size_t thread_count = 0;  // 0 uses every hardware thread
+Engine engine = ENGINE_PACKED;
+HlUniverse universe;
+ChkWorld world;
+size_t hashlife_memory = 512;  // in MB
+int step_log = -1;  // -1 steps one generation in the GUI, any in headless
+uint64_t generation = 0;  // of the packed engine
+LifeRule rule;  // B3/S23 unless given
+uint8_t rule_table[512];  // of the reference grid
+bool rule_given = false;  // by --rule, which wins over patterns' rules
+Texture2D grid_texture = {0};
+uint8_t *grid_pixels = NULL;
+const char *pattern_path = NULL;  // RLE or .cells to start from
+const char *export_path = "game_of_life.rle";
+// Char per cell reference of the bit packed board, used by --check and
+// --bench
 Grid grid;
 Grid buffer;
 
 int new_grid_w;
 int new_grid_h;
+// Size of the loaded pattern, which the board may grow past the screen to fit
+int pattern_w = 0;
+int pattern_h = 0;
 int grid_update_pos = 0;
 int update_delay_rate = 10;
 int brush_size = 1;
@@ -69,32 +114,61 @@ void recalculate_cell_size(int containerWidth, int containerHeight) {
     );
 }
 
-int neighbors_count(int x, int y) {
-    int count = 0;
-    for (int py = y - 1; py <= y + 1; py++) {
-        for (int px = x - 1; px <= x + 1; px++) {
+// 3x3 neighborhood of (x, y) as an index of rule_table
+int neighborhood(int x, int y) {
+    int index = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
             // wrap around grid considering negative values
-            count += *index2d(
+            int cell = *index2d(
                 buffer.items,
-                utl_safe_wrap(px, grid_w),
-                utl_safe_wrap(py, grid_h)
+                utl_safe_wrap(x + dx, grid_w),
+                utl_safe_wrap(y + dy, grid_h)
             );
+            index |= cell << (3 * (dy + 1) + dx + 1);
         }
     }
-    return count - *index2d(grid.items, x, y);
+    return index;
 }
 
-void paint_cell(int x, int y) {
-    DrawRectangle(
-        (int)(x * cell_width),
-        (int)(y * cell_height) + PANEL_H,
-        // using  ceilf for consistency when grid_w % cell_width != 0
-        (int)ceilf(cell_width),
-        (int)ceilf(cell_height),
-        *index2d(grid.items, x, y) ? WHITE : BLACK
+// Draws the board as one grayscale texture of a texel per cell, scaled up
+// with point filtering, instead of a rectangle per cell
+void draw_cells(void) {
+    if (grid_texture.width != grid_w || grid_texture.height != grid_h) {
+        UnloadTexture(grid_texture);
+        grid_pixels = realloc(grid_pixels, (size_t)grid_w * grid_h);
+        if (grid_pixels == NULL) {
+            utl_log(UTL_ERROR, "Could'nt allocate memory for grid texture!");
+            exit(-1);
+        }
+        Image image = {
+            .data = grid_pixels,
+            .width = grid_w,
+            .height = grid_h,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+        };
+        grid_texture = LoadTextureFromImage(image);
+        SetTextureFilter(grid_texture, TEXTURE_FILTER_POINT);
+    }
+    life_to_bytes(&board, grid_pixels);
+    UpdateTexture(grid_texture, grid_pixels);
+    DrawTexturePro(
+        grid_texture,
+        (Rectangle){0, 0, grid_w, grid_h},
+        (Rectangle){0, PANEL_H, grid_w * cell_width, grid_h * cell_height},
+        (Vector2){0, 0},
+        0,
+        WHITE
     );
 }
 
+// Sets a cell of the plane, the packed engine only has the board
+void set_plane_cell(int64_t x, int64_t y, bool alive) {
+    if (engine == ENGINE_HASHLIFE) hl_set(&universe, x, y, alive);
+    if (engine == ENGINE_SPARSE) chk_set(&world, x, y, alive);
+}
+
 void paint(int x, int y, int brush_size, bool use_eraser) {
     brush_size = brush_size - 1;
     if (x < 0 || x >= grid_w || y < 0 || y >= grid_h) return;
@@ -108,7 +182,6 @@ void paint(int x, int y, int brush_size, bool use_eraser) {
                 int py = wrap(y_offset + y, gridH);
                 int px = wrap(x_offset + x, grid_w);
                 *index2d(grid, px, py) = !use_eraser;
-                paintCell(px, py);
             }
         }
     }
@@ -120,8 +193,8 @@ void paint(int x, int y, int brush_size, bool use_eraser) {
         for (int x = start_x; x <= start_x + brush_size; x++) {
             int py = utl_safe_wrap(y, grid_h);
             int px = utl_safe_wrap(x, grid_w);
-            *index2d(grid.items, px, py) = !use_eraser;
-            paint_cell(px, py);
+            life_set(&board, px, py, !use_eraser);
+            set_plane_cell(px, py, !use_eraser);
         }
     }
 #endif
@@ -131,36 +204,125 @@ void iterate_board() {
     memcpy(buffer.items, grid.items, grid.count * sizeof(grid.items[0]));
     for (int y = 0; y < grid_h; y++) {
         for (int x = 0; x < grid_w; x++) {
-            int neighbors = neighbors_count(x, y);
+            *index2d(grid.items, x, y) = rule_table[neighborhood(x, y)];
+        }
+    }
+}
 
-            if (*index2d(grid.items, x, y)) {
-                if (neighbors < 2 || neighbors > 3) {
-                    *index2d(grid.items, x, y) = false;
-                }
-            } else if (neighbors == 3) {
-                *index2d(grid.items, x, y) = true;
-            }
+// Makes `new_rule` the rule of the reference, the board and the plane.
+// Returns non zero value when the engine can't run it.
+int set_rule(LifeRule new_rule) {
+    if (engine != ENGINE_PACKED && (new_rule.birth & 1)) {
+        char name[22];
+        life_rule_name(new_rule, name);
+        utl_log(
+            UTL_ERROR,
+            "%s fills empty space, which only the packed engine can hold.",
+            name
+        );
+        return -1;
+    }
+    rule = new_rule;
+    life_rule_table(rule, rule_table);
+    board.rule = rule;
+    if (engine == ENGINE_HASHLIFE) hl_set_rule(&universe, rule);
+    if (engine == ENGINE_SPARSE) chk_set_rule(&world, rule);
+    return 0;
+}
+
+// Copies the cells under the grid from the plane into the board, which
+// the packed engine steps itself
+void show_plane(void) {
+    if (engine == ENGINE_PACKED) return;
+    life_clear(&board);
+    if (engine == ENGINE_HASHLIFE) {
+        hl_read_rows(
+            &universe, 0, 0, grid_w, grid_h, board.cells, board.words
+        );
+    } else if (engine == ENGINE_SPARSE) {
+        chk_read_rows(&world, 0, 0, grid_w, grid_h, board.cells, board.words);
+    }
+}
+
+// Replaces the plane with the cells of the board
+void load_plane(void) {
+    if (engine == ENGINE_HASHLIFE) hl_clear(&universe);
+    if (engine == ENGINE_SPARSE) chk_clear(&world);
+    for (int y = 0; y < grid_h; y++) {
+        for (int x = 0; x < grid_w; x++) {
+            if (life_get(&board, x, y)) set_plane_cell(x, y, true);
         }
     }
 }
 
-void init_grid() {
-    srand(time(0));
-    for (size_t i = 0; i < grid.capacity; i++) {
-        // not using rand()%2 as the lower order bits are much
-        // less random than the upper order bits in a LCG.
-        grid.items[i] = rand() > (RAND_MAX / 2);
+void step_board(void) {
+    switch (engine) {
+        case ENGINE_HASHLIFE:
+            if (!hl_step(&universe)) {
+                utl_log(UTL_ERROR, "The pattern grew too large for HashLife.");
+                exit(-1);
+            }
+            show_plane();
+            break;
+        case ENGINE_SPARSE:
+            chk_step(&world, &pool);
+            show_plane();
+            break;
+        default:
+            life_step_pool(&board, &pool);
+            generation++;
     }
-    grid.count = grid.capacity;
-    buffer.count = grid.count;
 }
 
-void clear_grid() {
+uint64_t current_generation(void) {
+    switch (engine) {
+        case ENGINE_HASHLIFE:
+            return universe.generation;
+        case ENGINE_SPARSE:
+            return world.generation;
+        default:
+            return generation;
+    }
+}
+
+uint64_t current_population(void) {
+    switch (engine) {
+        case ENGINE_HASHLIFE:
+            return hl_population(&universe);
+        case ENGINE_SPARSE:
+            return chk_population(&world);
+        default:
+            return life_population(&board);
+    }
+}
+
+void init_grid() {
+    srand(time(0));
     for (int y = 0; y < grid_h; y++) {
         for (int x = 0; x < grid_w; x++) {
-            *index2d(grid.items, x, y) = 0;
+            // not using rand()%2 as the lower order bits are much
+            // less random than the upper order bits in a LCG.
+            life_set(&board, x, y, rand() > (RAND_MAX / 2));
         }
     }
+    generation = 0;
+    load_plane();
+}
+
+void clear_grid() {
+    life_clear(&board);
+    generation = 0;
+    if (engine == ENGINE_HASHLIFE) hl_clear(&universe);
+    if (engine == ENGINE_SPARSE) chk_clear(&world);
+}
+
+// Largest board that fits on the screen or holds the loaded pattern
+int max_grid_w() {
+    return screen_width > pattern_w ? screen_width : pattern_w;
+}
+
+int max_grid_h() {
+    return screen_height > pattern_h ? screen_height : pattern_h;
 }
 
 // Returns non zero value on error
@@ -170,21 +332,172 @@ int resize_grid(int new_grid_w, int new_grid_h) {
     // making sure new grid sizes aren't out of boundary
     if (grid_w < 1) grid_w = 1;
     if (grid_h < 1) grid_h = 1;
-    if (grid_w > screen_width) grid_w = screen_width;
-    if (grid_h > screen_height) grid_h = screen_height;
+    if (grid_w > max_grid_w()) grid_w = max_grid_w();
+    if (grid_h > max_grid_h()) grid_h = max_grid_h();
 
-    utl_da_resize(grid, grid_w * grid_h);
-    utl_da_resize(buffer, grid.capacity);
-    if (grid.items == NULL || buffer.items == NULL) {
-        utl_log(UTL_ERROR, "Could'nt reallocate memory for grid or buffer!");
+    if (!life_resize(&board, grid_w, grid_h)) {
+        utl_log(UTL_ERROR, "Could'nt reallocate memory for board!");
         exit(-1);
     };
-    grid.count = grid.capacity;
-    buffer.count = grid.count;
+    show_plane();
     recalculate_cell_size(screen_width, screen_height - PANEL_H);
     return 0;
 }
 
+// ctx holds where the pattern's top left corner goes and its width
+void load_rows(
+    void *ctx,
+    int64_t y,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+) {
+    const int64_t *placement = ctx;
+    int64_t x = placement[0], width = placement[2];
+    y += placement[1];
+    switch (engine) {
+        case ENGINE_HASHLIFE:
+            hl_write_rows(&universe, x, y, width, height, rows, stride);
+            break;
+        case ENGINE_SPARSE:
+            chk_write_rows(&world, x, y, width, height, rows, stride);
+            break;
+        default:
+            for (size_t r = 0; r < height && y + (int64_t)r < grid_h; r++) {
+                for (size_t k = 0; k < stride; k++) {
+                    uint64_t cells = rows[r * stride + k];
+                    for (; cells != 0; cells &= cells - 1) {
+                        int64_t cx = x + 64 * k + __builtin_ctzll(cells);
+                        life_set(&board, cx, y + r, true);
+                    }
+                }
+            }
+    }
+}
+
+// Replaces the cells with a pattern file, centered on the grid. The packed
+// engine's board grows to fit it. Returns non zero value on error.
+int load_pattern(const char *path) {
+    PatFile file;
+    if (!pat_open(&file, path)) {
+        utl_log(UTL_ERROR, "Couldn't load \"%s\": %s.", path, file.error);
+        return -1;
+    }
+    LifeRule file_rule = rule;
+    char name[22];
+    life_rule_name(rule, name);
+    if (file.rule[0] != '\0' && !life_parse_rule(file.rule, &file_rule)) {
+        utl_log(
+            UTL_WARNING,
+            "Unknown rule %s in \"%s\", running it as %s.",
+            file.rule,
+            path,
+            name
+        );
+    } else if (rule_given && (file_rule.birth != rule.birth ||
+                              file_rule.survive != rule.survive)) {
+        utl_log(
+            UTL_WARNING, "Running \"%s\" as %s, not %s.", path, name, file.rule
+        );
+    } else if (set_rule(file_rule) != 0) {
+        pat_close(&file);
+        return -1;
+    }
+    if (engine == ENGINE_PACKED &&
+        (file.width > grid_w || file.height > grid_h)) {
+        if (file.width > 1 << 20 || file.height > 1 << 20) {
+            utl_log(UTL_ERROR, "\"%s\" is too large for the board.", path);
+            pat_close(&file);
+            return -1;
+        }
+        if (file.width > grid_w) grid_w = file.width;
+        if (file.height > grid_h) grid_h = file.height;
+        if (!life_resize(&board, grid_w, grid_h)) {
+            utl_log(UTL_ERROR, "Could'nt reallocate memory for board!");
+            exit(-1);
+        }
+    }
+    pattern_w = file.width;
+    pattern_h = file.height;
+    clear_grid();
+    int64_t placement[3] = {
+        (grid_w - file.width) / 2,
+        (grid_h - file.height) / 2,
+        file.width,
+    };
+    bool read = pat_read_rows(&file, load_rows, placement);
+    if (!read) {
+        utl_log(UTL_ERROR, "Couldn't load \"%s\": %s.", path, file.error);
+    }
+    pat_close(&file);
+    show_plane();
+    return read ? 0 : -1;
+}
+
+void read_cells(void *ctx, PatWordFn word, void *word_ctx) {
+    (void)ctx;
+    switch (engine) {
+        case ENGINE_HASHLIFE:
+            hl_read_words(&universe, word, word_ctx);
+            break;
+        case ENGINE_SPARSE:
+            chk_read_words(&world, word, word_ctx);
+            break;
+        default:
+            // Bits past the width are always clear
+            for (size_t y = 0; y < board.height; y++) {
+                for (size_t k = 0; k < board.words; k++) {
+                    uint64_t bits = board.cells[y * board.words + k];
+                    if (bits != 0) word(word_ctx, k * 64, y, bits);
+                }
+            }
+    }
+}
+
+// Writes the board, or the bounding box of the plane's cells, as RLE.
+// Returns non zero value on error.
+int export_pattern(const char *path) {
+    int64_t x0 = 0, y0 = 0, x1 = grid_w, y1 = grid_h;
+    if (engine == ENGINE_HASHLIFE &&
+        !hl_bounds(&universe, &x0, &y0, &x1, &y1)) {
+        x0 = y0 = x1 = y1 = 0;
+    }
+    if (engine == ENGINE_SPARSE && !chk_bounds(&world, &x0, &y0, &x1, &y1)) {
+        x0 = y0 = x1 = y1 = 0;
+    }
+    char name[22];
+    life_rule_name(rule, name);
+    char comment[64];
+    snprintf(
+        comment,
+        sizeof(comment),
+        "Generation %llu",
+        (unsigned long long)current_generation()
+    );
+    FILE *out = fopen(path, "w");
+    bool written = out != NULL;
+    if (written) {
+        written = pat_write_rle(
+            out,
+            x0,
+            y0,
+            x1 - x0,
+            y1 - y0,
+            name,
+            comment,
+            read_cells,
+            NULL
+        );
+        written = fclose(out) == 0 && written;
+    }
+    if (!written) {
+        utl_log(UTL_ERROR, "Couldn't write \"%s\".", path);
+        return -1;
+    }
+    utl_log(UTL_INFO, "Wrote \"%s\".", path);
+    return 0;
+}
+
 void update_draw_frame(void) {
     screen_width = GetScreenWidth();
     screen_height = GetScreenHeight();
@@ -193,9 +506,10 @@ void update_draw_frame(void) {
     // Handling input
     if (IsKeyPressed(KEY_E) || eraser_btn) use_eraser = !use_eraser;
     if (IsKeyPressed(KEY_R) || randomize_btn) init_grid();
-    if (IsKeyPressed(KEY_N) || next_step_btn) iterate_board();
+    if (IsKeyPressed(KEY_N) || next_step_btn) step_board();
     if (IsKeyPressed(KEY_SPACE) || pause_btn) paused = !paused;
     if (IsKeyPressed(KEY_C) || clear_btn) clear_grid();
+    if (IsKeyPressed(KEY_S)) export_pattern(export_path);
     if (grid_w_box && grid_h_box)
         active_input_box = (active_input_box + 1) % InputBoxCount;
     if (IsKeyPressed(KEY_UP))
@@ -211,18 +525,17 @@ void update_draw_frame(void) {
     if (IsKeyPressed(KEY_ENTER) || IsWindowResized()) {
         resize_grid(new_grid_w, new_grid_h);
     }
-    if (!paused && !grid_update_pos) iterate_board();
+    if (!paused && !grid_update_pos) step_board();
 
     BeginDrawing();
     {
         ClearBackground(BLACK);
-        // Draw cells
+        draw_cells();
+#ifdef DEBUG
         for (int y = 0; y < grid_h; y++) {
             for (int x = 0; x < grid_w; x++) {
-                paint_cell(x, y);
-#ifdef DEBUG
                 char text[10];
-                sprintf(text, "%d", neighbors_count(x, y));
+                sprintf(text, "%d", life_neighbors(&board, x, y));
                 DrawText(
                     text,
                     (int)(x * cell_width) + 5,
@@ -230,9 +543,28 @@ void update_draw_frame(void) {
                     cell_width / 3,
                     RED
                 );
-#endif
             }
         }
+#endif
+
+        char status[128], name[22];
+        life_rule_name(rule, name);
+        snprintf(
+            status,
+            sizeof(status),
+            "%s, generation %llu, population %llu",
+            name,
+            (unsigned long long)current_generation(),
+            (unsigned long long)current_population()
+        );
+        DrawRectangle(
+            0,
+            screen_height - 24,
+            MeasureText(status, 16) + 12,
+            24,
+            Fade(DARKGRAY, 0.8f)
+        );
+        DrawText(status, 6, screen_height - 20, 16, RAYWHITE);
 
         // Draw Gui Panel Background
         DrawRectangle(0, 0, screen_width, PANEL_H, BEIGE);
@@ -293,7 +625,7 @@ void update_draw_frame(void) {
             "Grid Width: ",
             &new_grid_w,
             1,
-            screen_width,
+            max_grid_w(),
             active_input_box == GridWBox
         );
         grid_h_box = GuiValueBox(
@@ -301,24 +633,859 @@ void update_draw_frame(void) {
             "Grid Height: ",
             &new_grid_h,
             1,
-            screen_width,
+            max_grid_h(),
             active_input_box == GridHBox
         );
     }
     EndDrawing();
 }
 
-int main(void) {
-    new_grid_w = grid_w;
-    new_grid_h = grid_h;
-    utl_da_init(grid, grid_h * grid_w);
-    utl_da_init(buffer, grid.capacity);
-    if (grid.items == NULL || buffer.items == NULL) {
-        utl_log(UTL_ERROR, "Could'nt allocate memory for grid or buffer!");
+// Sizes the reference grids to grid_w x grid_h and the board to match,
+// with random cells at the given chance of being alive
+void random_boards(double alive) {
+    utl_da_resize(grid, grid_w * grid_h);
+    utl_da_resize(buffer, grid.capacity);
+    grid.count = buffer.count = grid.capacity;
+    life_free(&board);
+    if (!life_init(&board, grid_w, grid_h)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for board.");
+        exit(-1);
+    }
+    board.rule = rule;
+    for (int y = 0; y < grid_h; y++) {
+        for (int x = 0; x < grid_w; x++) {
+            bool cell = rand() < alive * RAND_MAX;
+            *index2d(grid.items, x, y) = cell;
+            life_set(&board, x, y, cell);
+        }
+    }
+}
+
+// Steps a board too big for the reference in bands on a few threads, even
+// on a single core, and compares it with a single threaded copy
+int check_bands(void) {
+    const int GENERATIONS = 50;
+    WrkPool band_pool;
+    LifeBoard single;
+    wrk_pool_init(&band_pool, pool.thread_count > 4 ? pool.thread_count : 4);
+    grid_w = 3000;
+    grid_h = 2000;
+    random_boards(0.35);
+    if (!life_init(&single, grid_w, grid_h)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for board.");
+        exit(-1);
+    }
+    size_t size = board.words * board.height * sizeof(uint64_t);
+    memcpy(single.cells, board.cells, size);
+
+    int generation = 0;
+    while (generation < GENERATIONS &&
+           memcmp(single.cells, board.cells, size) == 0) {
+        life_step(&single);
+        life_step_pool(&board, &band_pool);
+        generation++;
+    }
+    bool matched = memcmp(single.cells, board.cells, size) == 0;
+    printf(
+        "%dx%d in bands on %zu threads %s at generation %d\n",
+        grid_w,
+        grid_h,
+        band_pool.thread_count,
+        matched ? "matched" : "differs",
+        generation
+    );
+    life_free(&single);
+    wrk_pool_free(&band_pool);
+    return matched ? 0 : -1;
+}
+
+// Runs soups around (0, 0) with HashLife, which jumps 2^k generations at a
+// time for the larger k, and in the middle of a torus large enough that
+// nothing wraps with the packed engine. The small memory cap makes HashLife
+// collect garbage in the middle of steps.
+int check_hashlife(void) {
+    const int SIZE = 512;
+    const int SOUPS[] = {8, 64};
+    const size_t MEMORY_CAPS[] = {0, 1 << 20};
+    const unsigned STEP_LOGS[] = {0, 0, 0, 1, 2, 3, 5, 6, 4, 0};
+    int failures = 0;
+    HlUniverse chosen_universe = universe;
+    LifeBoard view;
+    if (!life_init(&view, SIZE, SIZE)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for board.");
+        exit(-1);
+    }
+    grid_w = grid_h = SIZE;
+
+    uint64_t generations = 0;
+    for (size_t run = 0; run < 4; run++) {
+        int soup = SOUPS[run / 2];
+        random_boards(0);
+        if (!hl_init(&universe, MEMORY_CAPS[run % 2])) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for HashLife.");
+            exit(-1);
+        }
+        hl_set_rule(&universe, rule);
+        for (int y = -soup / 2; y < soup / 2; y++) {
+            for (int x = -soup / 2; x < soup / 2; x++) {
+                bool cell = rand() > RAND_MAX / 2;
+                life_set(&board, SIZE / 2 + x, SIZE / 2 + y, cell);
+                hl_set(&universe, x, y, cell);
+            }
+        }
+
+        generations = 0;
+        bool matched = true;
+        for (size_t k = 0; k < utl_array_size(STEP_LOGS) && matched; k++) {
+            hl_set_step_log(&universe, STEP_LOGS[k]);
+            hl_step(&universe);
+            for (int g = 0; g < 1 << STEP_LOGS[k]; g++) life_step(&board);
+            generations += 1 << STEP_LOGS[k];
+
+            life_clear(&view);
+            hl_read_rows(
+                &universe,
+                -SIZE / 2,
+                -SIZE / 2,
+                SIZE,
+                SIZE,
+                view.cells,
+                view.words
+            );
+            size_t size = board.words * board.height * sizeof(uint64_t);
+            matched = memcmp(view.cells, board.cells, size) == 0 &&
+                      universe.generation == generations &&
+                      hl_population(&universe) == life_population(&board);
+        }
+        if (!matched) {
+            printf(
+                "HashLife differs from the packed board on a %dx%d soup "
+                "at generation %llu\n",
+                soup,
+                soup,
+                (unsigned long long)generations
+            );
+            failures++;
+        }
+        hl_free(&universe);
+    }
+    printf(
+        "HashLife matched the packed board on %d of 4 runs of %llu "
+        "generations\n",
+        4 - failures,
+        (unsigned long long)generations
+    );
+    life_free(&view);
+    universe = chosen_universe;
+    return failures == 0 ? 0 : -1;
+}
+
+// Runs soups around (0, 0) in sparse chunks, stepped on a few threads,
+// and in the middle of a torus large enough that nothing wraps
+int check_sparse(void) {
+    const int SIZE = 1024, GENERATIONS = 200;
+    const int SOUPS[] = {8, 64, 150};
+    int failures = 0;
+    WrkPool check_pool;
+    ChkWorld chunks;
+    LifeBoard view;
+    wrk_pool_init(&check_pool, 4);
+    if (!chk_init(&chunks) || !life_init(&view, SIZE, SIZE)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for chunks.");
+        exit(-1);
+    }
+    chk_set_rule(&chunks, rule);
+    grid_w = grid_h = SIZE;
+
+    for (size_t s = 0; s < utl_array_size(SOUPS); s++) {
+        int soup = SOUPS[s];
+        random_boards(0);
+        chk_clear(&chunks);
+        for (int y = -soup / 2; y < soup / 2; y++) {
+            for (int x = -soup / 2; x < soup / 2; x++) {
+                bool cell = rand() > RAND_MAX / 2;
+                life_set(&board, SIZE / 2 + x, SIZE / 2 + y, cell);
+                chk_set(&chunks, x, y, cell);
+            }
+        }
+        int g = 0;
+        for (; g < GENERATIONS; g++) {
+            chk_step(&chunks, &check_pool);
+            life_step(&board);
+            life_clear(&view);
+            chk_read_rows(
+                &chunks,
+                -SIZE / 2,
+                -SIZE / 2,
+                SIZE,
+                SIZE,
+                view.cells,
+                view.words
+            );
+            size_t size = board.words * board.height * sizeof(uint64_t);
+            if (memcmp(view.cells, board.cells, size) != 0 ||
+                chk_population(&chunks) != life_population(&board)) {
+                break;
+            }
+        }
+        if (g < GENERATIONS) {
+            printf(
+                "Sparse chunks differ from the packed board on a %dx%d soup "
+                "at generation %d\n",
+                soup,
+                soup,
+                g + 1
+            );
+            failures++;
+        }
+    }
+    printf(
+        "Sparse chunks matched the packed board on %d of %zu runs of %d "
+        "generations\n",
+        (int)utl_array_size(SOUPS) - failures,
+        utl_array_size(SOUPS),
+        GENERATIONS
+    );
+    life_free(&view);
+    chk_free(&chunks);
+    wrk_pool_free(&check_pool);
+    return failures == 0 ? 0 : -1;
+}
+
+void set_board_run(void *ctx, int64_t x, int64_t y, int64_t count) {
+    for (int64_t i = 0; i < count; i++) life_set(ctx, x + i, y, true);
+}
+
+void set_board_rows(
+    void *ctx,
+    int64_t y,
+    size_t height,
+    const uint64_t *rows,
+    size_t stride
+) {
+    LifeBoard *target = ctx;
+    for (size_t r = 0; r < height && y + r < target->height; r++) {
+        for (size_t k = 0; k < stride; k++) {
+            target->cells[(y + r) * target->words + k] |= rows[r * stride + k];
+        }
+    }
+}
+
+// A cell at a time, in reverse, as a reference for the engines' words
+void read_board(void *ctx, PatWordFn word, void *word_ctx) {
+    const LifeBoard *source = ctx;
+    for (size_t y = source->height; y-- > 0;) {
+        for (size_t x = source->width; x-- > 0;) {
+            if (life_get(source, x, y)) word(word_ctx, x, y, 1);
+        }
+    }
+}
+
+void read_plane(void *ctx, PatWordFn word, void *word_ctx) {
+    hl_read_words(ctx, word, word_ctx);
+}
+
+void read_chunks(void *ctx, PatWordFn word, void *word_ctx) {
+    chk_read_words(ctx, word, word_ctx);
+}
+
+// RLE of [x, x + width) x [y, y + height) as a string, NULL on failure
+char *write_text(
+    PatCellsFn cells,
+    void *ctx,
+    int64_t x,
+    int64_t y,
+    size_t width,
+    size_t height,
+    long *size
+) {
+    FILE *temp = tmpfile();
+    char *text = NULL;
+    if (temp != NULL &&
+        pat_write_rle(temp, x, y, width, height, "B3/S23", NULL, cells, ctx)) {
+        *size = ftell(temp);
+        text = malloc(*size + 1);
+        rewind(temp);
+        if (text != NULL && fread(text, 1, *size, temp) != (size_t)*size) {
+            free(text);
+            text = NULL;
+        }
+    }
+    if (temp != NULL) fclose(temp);
+    return text;
+}
+
+// Parses a glider written in both formats, with comments, spacing and
+// CRLF, then writes a soup as RLE, reads it back and writes it into
+// HashLife and sparse chunks away from (0, 0), which must report the same
+// cells and bounds and write the same RLE, also when it's cut to a part
+int check_patterns(void) {
+    const char *GLIDERS[] = {
+        "#N Glider\r\n#C comment\r\nx = 3, y = 3, rule = B3/S23\r\n"
+        "b o$2b\r\no $3o!\r\n",
+        "x=3,y=3\nbo$2bo$3o!",
+        "bo$2bo$3o!",
+        "!Name: Glider\n!\n.O.\n..O\nOOO\n",
+    };
+    const int SIZE = 300, ROWS = 150, X = -1000, Y = 37;
+    int failures = 0;
+    LifeBoard expected, loaded;
+    if (!life_init(&expected, 3, 3) || !life_init(&loaded, 3, 3)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for board.");
+        exit(-1);
+    }
+    life_set(&expected, 1, 0, true);
+    life_set(&expected, 2, 1, true);
+    for (int x = 0; x < 3; x++) life_set(&expected, x, 2, true);
+    for (size_t g = 0; g < utl_array_size(GLIDERS); g++) {
+        PatFile file;
+        bool rle = g < 3;
+        life_clear(&loaded);
+        bool parsed =
+            pat_open_memory(&file, GLIDERS[g], strlen(GLIDERS[g]), rle) &&
+            file.width == 3 && file.height == 3 &&
+            pat_read(&file, set_board_run, &loaded) &&
+            memcmp(loaded.cells, expected.cells, 3 * sizeof(uint64_t)) == 0;
+        if (!parsed) {
+            printf("Glider %zu was misread: %s\n", g, file.error);
+            failures++;
+        }
+    }
+    life_free(&expected);
+    life_free(&loaded);
+
+    grid_w = SIZE;
+    grid_h = ROWS;
+    random_boards(0.35);
+    long size = 0;
+    char *text = write_text(read_board, &board, 0, 0, SIZE, ROWS, &size);
+    PatFile file;
+    HlUniverse plane;
+    ChkWorld chunks;
+    if (!life_init(&loaded, SIZE, ROWS) || !hl_init(&plane, 0) ||
+        !chk_init(&chunks)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for patterns.");
+        exit(-1);
+    }
+    size_t bytes = loaded.words * loaded.height * sizeof(uint64_t);
+    bool round_trip = text != NULL && size > 0 &&
+                      pat_open_memory(&file, text, size, true) &&
+                      pat_read_rows(&file, set_board_rows, &loaded) &&
+                      memcmp(loaded.cells, board.cells, bytes) == 0;
+    printf(
+        "%s %dx%d RLE of %ld bytes\n",
+        round_trip ? "Read back" : "Misread",
+        SIZE,
+        ROWS,
+        size
+    );
+    if (!round_trip) failures++;
+
+    int64_t bounds[4] = {SIZE, ROWS, 0, 0};
+    for (int y = 0; y < ROWS; y++) {
+        for (int x = 0; x < SIZE; x++) {
+            if (!life_get(&board, x, y)) continue;
+            if (x < bounds[0]) bounds[0] = x;
+            if (y < bounds[1]) bounds[1] = y;
+            if (x >= bounds[2]) bounds[2] = x + 1;
+            if (y >= bounds[3]) bounds[3] = y + 1;
+        }
+    }
+    hl_write_rows(&plane, X, Y, SIZE, ROWS, board.cells, board.words);
+    chk_write_rows(&chunks, X, Y, SIZE, ROWS, board.cells, board.words);
+    for (int store = 0; store < 2; store++) {
+        int64_t x0, y0, x1, y1;
+        life_clear(&loaded);
+        if (store == 0) {
+            hl_read_rows(&plane, X, Y, SIZE, ROWS, loaded.cells, loaded.words);
+            hl_bounds(&plane, &x0, &y0, &x1, &y1);
+        } else {
+            chk_read_rows(
+                &chunks, X, Y, SIZE, ROWS, loaded.cells, loaded.words
+            );
+            chk_bounds(&chunks, &x0, &y0, &x1, &y1);
+        }
+        if (memcmp(loaded.cells, board.cells, bytes) != 0 ||
+            x0 != X + bounds[0] || y0 != Y + bounds[1] ||
+            x1 != X + bounds[2] || y1 != Y + bounds[3]) {
+            printf(
+                "%s misplaced the written cells\n",
+                store == 0 ? "HashLife" : "Sparse chunks"
+            );
+            failures++;
+        }
+
+        // Whole, then without the edges, which cuts words and runs
+        for (int cut = 0; cut < 2; cut++) {
+            long part_size = 0, store_size = 0;
+            char *part = text;
+            part_size = size;
+            if (cut) {
+                part = write_text(
+                    read_board, &board, 1, 1, SIZE - 2, ROWS - 2, &part_size
+                );
+            }
+            char *written = write_text(
+                store == 0 ? read_plane : read_chunks,
+                store == 0 ? (void *)&plane : (void *)&chunks,
+                X + cut,
+                Y + cut,
+                SIZE - 2 * cut,
+                ROWS - 2 * cut,
+                &store_size
+            );
+            if (part == NULL || written == NULL || store_size != part_size ||
+                memcmp(written, part, part_size) != 0) {
+                printf(
+                    "%s wrote different RLE%s\n",
+                    store == 0 ? "HashLife" : "Sparse chunks",
+                    cut ? " for a part" : ""
+                );
+                failures++;
+            }
+            if (cut) free(part);
+            free(written);
+        }
+    }
+    free(text);
+    printf(
+        "Patterns: %d failures in %zu checks\n",
+        failures,
+        utl_array_size(GLIDERS) + 7
+    );
+    hl_free(&plane);
+    chk_free(&chunks);
+    life_free(&loaded);
+    return failures == 0 ? 0 : -1;
+}
+
+// Steps the reference and the bit packed board side by side under the
+// current rule, on sizes around word boundaries, including one cell wide
+// and tall tori
+int check_reference(void) {
+    const int SIZES[][2] = {
+        {1, 1},   {1, 9},   {7, 1},    {3, 3},    {63, 17},  {64, 64},
+        {65, 9},  {127, 2}, {128, 31}, {180, 120}, {200, 7}, {257, 40},
+        {320, 96}, {1000, 50},
+    };
+    const double DENSITIES[] = {0.1, 0.35, 0.5, 0.8};
+    const int GENERATIONS = 100;
+    int failures = 0;
+    char name[22];
+    life_rule_name(rule, name);
+
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        for (size_t d = 0; d < utl_array_size(DENSITIES); d++) {
+            grid_w = SIZES[s][0];
+            grid_h = SIZES[s][1];
+            random_boards(DENSITIES[d]);
+            int mismatch = -1;
+            for (int g = 0; g <= GENERATIONS && mismatch < 0; g++) {
+                for (int i = 0; i < grid_w * grid_h; i++) {
+                    bool cell = life_get(&board, i % grid_w, i / grid_w);
+                    if (grid.items[i] != cell) {
+                        mismatch = i;
+                        printf(
+                            "%s, %dx%d at %.2f alive: cell (%d, %d) differs "
+                            "at generation %d\n",
+                            name,
+                            grid_w,
+                            grid_h,
+                            DENSITIES[d],
+                            i % grid_w,
+                            i / grid_w,
+                            g
+                        );
+                        break;
+                    }
+                }
+                iterate_board();
+                life_step_pool(&board, &pool);
+            }
+            if (mismatch >= 0) failures++;
+        }
+    }
+    size_t runs = utl_array_size(SIZES) * utl_array_size(DENSITIES);
+    printf(
+        "%s: %zu of %zu runs of %d generations matched\n",
+        name,
+        runs - failures,
+        runs,
+        GENERATIONS
+    );
+    return failures == 0 ? 0 : -1;
+}
+
+// Checks the board against the reference under a few rules, and the
+// unbounded engines against the board under those without B0, which fill
+// empty space
+int check_board(void) {
+    const char *RULES[] = {
+        "B3/S23",       // Life
+        "B36/S23",      // HighLife
+        "B3678/S34678", // Day & Night
+        "B2/S",         // Seeds
+        "B1357/S1357",  // Replicator
+        "B0123478/S01234678",  // Life with dead and live cells swapped
+    };
+    LifeRule chosen = rule;
+    int failures = 0;
+    srand(42);
+
+    printf("Checking the %s board against the char grid\n", life_simd_name());
+    for (size_t r = 0; r < utl_array_size(RULES); r++) {
+        life_parse_rule(RULES[r], &rule);
+        life_rule_table(rule, rule_table);
+        if (check_reference() != 0) failures++;
+        if (rule.birth & 1) continue;
+        if (check_hashlife() != 0) failures++;
+        if (check_sparse() != 0) failures++;
+    }
+    rule = LIFE_CONWAY;
+    if (check_bands() != 0) failures++;
+    if (check_patterns() != 0) failures++;
+    rule = chosen;
+    life_rule_table(rule, rule_table);
+    return failures == 0 ? 0 : -1;
+}
+
+// Strong scaling of banded generations on a board of 16384x16384
+void bench_scaling(void) {
+    const int SIZE = 16384;
+    const int GENERATIONS = 10;
+    double base = 0;
+    grid_w = grid_h = SIZE;
+    random_boards(0.35);
+
+    printf("Strong scaling, %dx%d\n", SIZE, SIZE);
+    printf("%8s %11s %12s %10s\n", "threads", "ms", "Gcells/s", "eff");
+    for (size_t threads = 1; threads <= pool.thread_count; threads *= 2) {
+        WrkPool scaling_pool;
+        wrk_pool_init(&scaling_pool, threads);
+        double start = utl_time();
+        for (int g = 0; g < GENERATIONS; g++) {
+            life_step_pool(&board, &scaling_pool);
+        }
+        double time = (utl_time() - start) / GENERATIONS;
+        if (threads == 1) base = time;
+        // efficiency = T(1) / (p * T(p))
+        printf(
+            "%8zu %11.3f %12.2f %9.1f%%\n",
+            scaling_pool.thread_count,
+            time * 1e3,
+            (double)SIZE * SIZE / time * 1e-9,
+            100 * base / (threads * time)
+        );
+        wrk_pool_free(&scaling_pool);
+    }
+}
+
+// Generations per second of the reference and the bit packed board, each
+// timed for about a quarter of a second
+void bench_board(void) {
+    const int SIZES[] = {256, 1024, 4096, 16384};
+    const int REFERENCE_MAX = 1024;  // too slow to bother with above this
+
+    // Any other rule goes through the same generic kernel
+    const char *OTHER_RULE = "B36/S23";
+    LifeRule other;
+    life_parse_rule(OTHER_RULE, &other);
+    srand(42);
+
+    char other_label[32];
+    snprintf(other_label, sizeof(other_label), "%s ms", OTHER_RULE);
+
+    printf("Game of Life benchmark (%s, 1 thread)\n", life_simd_name());
+    printf(
+        "%11s %14s %14s %12s %9s %14s\n",
+        "size",
+        "reference ms",
+        "packed ms",
+        "Gcells/s",
+        "speedup",
+        other_label
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        grid_w = grid_h = SIZES[s];
+        random_boards(0.35);
+        double cells = (double)grid_w * grid_h;
+
+        double reference_time = 0;
+        if (SIZES[s] <= REFERENCE_MAX) {
+            int generations = 0;
+            double start = utl_time();
+            do {
+                iterate_board();
+                generations++;
+            } while (utl_time() - start < 0.25);
+            reference_time = (utl_time() - start) / generations;
+        }
+
+        int generations = 0;
+        double start = utl_time();
+        do {
+            life_step(&board);
+            generations++;
+        } while (utl_time() - start < 0.25);
+        double packed_time = (utl_time() - start) / generations;
+
+        LifeRule saved_rule = board.rule;
+        board.rule = other;
+        generations = 0;
+        start = utl_time();
+        do {
+            life_step(&board);
+            generations++;
+        } while (utl_time() - start < 0.25);
+        double other_time = (utl_time() - start) / generations;
+        board.rule = saved_rule;
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", grid_w, grid_h);
+        if (reference_time > 0) {
+            printf(
+                "%11s %14.3f %14.4f %12.2f %8.0fx %14.4f\n",
+                size,
+                reference_time * 1e3,
+                packed_time * 1e3,
+                cells / packed_time * 1e-9,
+                reference_time / packed_time,
+                other_time * 1e3
+            );
+        } else {
+            printf(
+                "%11s %14s %14.4f %12.2f %9s %14.4f\n",
+                size,
+                "-",
+                packed_time * 1e3,
+                cells / packed_time * 1e-9,
+                "-",
+                other_time * 1e3
+            );
+        }
+    }
+    bench_scaling();
+}
+
+// Runs the pattern file, or a random soup of grid_w x grid_h at the seed
+// already given to srand, for `generations` and prints the population.
+// HashLife jumps the largest power of two left each step, up to
+// 2^step_log.
+void run_headless(uint64_t generations) {
+    if (pattern_path != NULL) {
+        life_free(&board);
+        if (!life_init(&board, grid_w, grid_h)) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for board.");
+            exit(-1);
+        }
+        board.rule = rule;
+        if (load_pattern(pattern_path) != 0) exit(-1);
+        printf(
+            "Engine %s, %s, %llu generations\n",
+            ENGINE_NAMES[engine],
+            pattern_path,
+            (unsigned long long)generations
+        );
+    } else {
+        printf(
+            "Engine %s, %dx%d soup, %llu generations\n",
+            ENGINE_NAMES[engine],
+            grid_w,
+            grid_h,
+            (unsigned long long)generations
+        );
+        random_boards(0.5);
+        load_plane();
+    }
+
+    double start = utl_time();
+    while (current_generation() < generations) {
+        if (engine == ENGINE_HASHLIFE) {
+            uint64_t left = generations - current_generation();
+            unsigned jump = 63 - __builtin_clzll(left);
+            if (step_log >= 0 && jump > (unsigned)step_log) jump = step_log;
+            hl_set_step_log(&universe, jump);
+        }
+        step_board();
+    }
+    double time = utl_time() - start;
+
+    printf(
+        "generation: %llu\npopulation: %llu\n",
+        (unsigned long long)current_generation(),
+        (unsigned long long)current_population()
+    );
+    printf(
+        "time: %.3f s, %.4g generations/s\n",
+        time,
+        generations / time
+    );
+    if (engine == ENGINE_HASHLIFE) {
+        printf(
+            "nodes: %zu in %.1f MB, %zu collections\n",
+            universe.node_count,
+            hl_memory(&universe) / 1048576.0,
+            universe.gc_count
+        );
+    } else if (engine == ENGINE_SPARSE) {
+        printf(
+            "chunks: %zu, %.1f MB\n",
+            world.chunk_count,
+            world.chunk_count * sizeof(ChkChunk) / 1048576.0
+        );
+    }
+}
+
+void print_usage(const char *program) {
+    printf(
+        "Usage: %s [options]\n"
+        "  --check                     compare the bit packed board with the\n"
+        "                              char grid reference, then exit\n"
+        "  --bench                     time generations of both and the\n"
+        "                              scaling of threads, then exit\n"
+        "  --threads COUNT             worker threads (default: all cores)\n"
+        "  --engine packed|hashlife|sparse\n"
+        "                              bit packed torus, or HashLife or\n"
+        "                              sparse chunks on an unbounded plane\n"
+        "                              (default: packed)\n"
+        "  --step-log K                HashLife steps 2^K generations at a\n"
+        "                              time (default: 0, any in headless)\n"
+        "  --hashlife-memory MB        node memory before HashLife collects\n"
+        "                              garbage (default: %zu)\n"
+        "  --rule B/S                  Life-like rule, e.g. B36/S23 for\n"
+        "                              HighLife (default: B3/S23, or the\n"
+        "                              pattern's)\n"
+        "  --size WxH                  grid size (default: %dx%d)\n"
+        "  --seed VALUE                random seed of headless soups\n"
+        "                              (default: 1)\n"
+        "  --headless GENERATIONS      run a random soup without a window,\n"
+        "                              then print its population\n"
+        "  --pattern FILE              start from an RLE (.rle) or plaintext\n"
+        "                              (.cells) pattern instead\n"
+        "  --export FILE               write the cells as RLE after\n"
+        "                              headless runs, and on S in the\n"
+        "                              window (default: %s)\n"
+        "  --help                      show this message\n",
+        program,
+        hashlife_memory,
+        grid_w,
+        grid_h,
+        export_path
+    );
+}
+
+int main(int argc, char **argv) {
+    bool check = false;
+    bool bench = false;
+    uint64_t headless = 0;
+    bool export = false;
+    unsigned seed = 1;
+    rule = LIFE_CONWAY;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--check") == 0) {
+            check = true;
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(arg, "--threads") == 0 && value != NULL) {
+            thread_count = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--engine") == 0 && value != NULL) {
+            engine = 0;
+            while (engine < EngineCount &&
+                   strcmp(value, ENGINE_NAMES[engine]) != 0) {
+                engine++;
+            }
+            if (engine == EngineCount) {
+                utl_log(UTL_ERROR, "Unknown engine \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--step-log") == 0 && value != NULL) {
+            step_log = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--hashlife-memory") == 0 && value != NULL) {
+            hashlife_memory = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--size") == 0 && value != NULL) {
+            if (sscanf(value, "%dx%d", &grid_w, &grid_h) != 2 || grid_w < 1 ||
+                grid_h < 1) {
+                utl_log(UTL_ERROR, "Invalid size \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--rule") == 0 && value != NULL) {
+            if (!life_parse_rule(value, &rule)) {
+                utl_log(UTL_ERROR, "Invalid rule \"%s\".", value);
+                return -1;
+            }
+            rule_given = true;
+            i++;
+        } else if (strcmp(arg, "--seed") == 0 && value != NULL) {
+            seed = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--headless") == 0 && value != NULL) {
+            headless = strtoull(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "--pattern") == 0 && value != NULL) {
+            pattern_path = value;
+            i++;
+        } else if (strcmp(arg, "--export") == 0 && value != NULL) {
+            export_path = value;
+            export = true;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : -1;
+        }
+    }
+
+    wrk_pool_init(&pool, thread_count);
+    if (engine == ENGINE_HASHLIFE &&
+        !hl_init(&universe, hashlife_memory << 20)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for HashLife.");
+        return -1;
+    }
+    if (engine == ENGINE_HASHLIFE && step_log > 0) {
+        hl_set_step_log(&universe, step_log);
+    }
+    if (engine == ENGINE_SPARSE && !chk_init(&world)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for chunks.");
+        return -1;
+    }
+    if (set_rule(rule) != 0) return -1;
+    if (check || bench || headless > 0) {
+        int result = check ? check_board() : 0;
+        if (bench) bench_board();
+        if (headless > 0) {
+            srand(seed);
+            run_headless(headless);
+            if (export && export_pattern(export_path) != 0) result = -1;
+        }
+        hl_free(&universe);
+        chk_free(&world);
+        life_free(&board);
+        utl_da_free(buffer);
+        utl_da_free(grid);
+        wrk_pool_free(&pool);
+        return result;
+    }
+
+    if (!life_init(&board, grid_w, grid_h)) {
+        utl_log(UTL_ERROR, "Could'nt allocate memory for board!");
         return -1;
     };
+    board.rule = rule;
 
-    init_grid();
+    if (pattern_path == NULL) {
+        init_grid();
+    } else if (load_pattern(pattern_path) != 0) {
+        return -1;
+    }
+    // After the pattern, which may have grown the board
+    new_grid_w = grid_w;
+    new_grid_h = grid_h;
     recalculate_cell_size(screen_width, screen_height - PANEL_H);
 
     SetTraceLogLevel(LOG_WARNING);
@@ -327,8 +1494,12 @@ int main(void) {
 
     rayutl_mainloop(update_draw_frame, 0);
 
-    utl_da_free(buffer);
-    utl_da_free(grid);
+    UnloadTexture(grid_texture);
+    free(grid_pixels);
+    hl_free(&universe);
+    chk_free(&world);
+    life_free(&board);
+    wrk_pool_free(&pool);
     CloseWindow();
 
     return 0;
@@ -2,20 +2,59 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #define MOTION_IMPLEMENTATION
 #include "motion.h"
 #define UTL_IMPLEMENTATION
 #include "rayutl.h"
 #include "utl.h"
+#define WORKERS_IMPLEMENTATION
+#include "workers.h"
+#define GRAVITY_IMPLEMENTATION
+#include "gravity.h"
+#define SPATIAL_GRID_IMPLEMENTATION
+#include "spatial_grid.h"
+#define TRACES_IMPLEMENTATION
+#include "traces.h"
+#define SNAPSHOT_IMPLEMENTATION
+#include "snapshot.h"
+#define HANDLES_IMPLEMENTATION
+#include "handles.h"
+#define DENSITY_IMPLEMENTATION
+#include "density.h"
 
 #define FPS 100
 #define WIN_W 1400
 #define WIN_H 900
 #define SPEED 0.9
 #define G 1e5  // it doesn't have to be realistic
-#define TRACE_SIZE 222
+#define G_SI 6.674e-11
+#define AU 1.496e11  // meters
+#define SOLAR_SYSTEM_STEP 3600.0  // world seconds per step
+#define PICK_RADIUS (WIN_W / 500)
+#define SPAWN_MASS 20.0
+#define TRACE_LENGTH 64
+#define TRACE_DECIMATION 3
+#define TRACE_DISTANCE 6.0
+#define TRACE_FADE 0.987  // per step
+#define SPLAT_THRESHOLD 50000  // bodies above which density is drawn
+#define SOFTENING 1.0
+#define THETA 0.5
+#define MESH_CELL 8.0
+#define REORDER_INTERVAL 64
+#define BLOCK_ETA 0.2
+#define BLOCK_MAX_LEVEL 8
+// Below this many targets, gathering from every body is cheaper than
+// rebuilding the Barnes-Hut tree
+#define BLOCK_GATHER_TARGETS 128
+#define SCENARIO_MASS 400.0  // total mass of generated scenarios
+#define SCENARIO_RADIUS 100.0
+#define SCENARIO_COUNT 10000
+#define DIAGNOSTICS_INTERVAL 10
+#define SNAPSHOT_INTERVAL 10
 
 typedef struct {
     Vector2 *items;
@@ -23,33 +62,170 @@ typedef struct {
     size_t count;
 } Vector2Buffer;
 
+// Quantities that should be conserved, besides what walls and static
+// particles take away
+typedef struct {
+    size_t step;
+    double kinetic;
+    double potential;
+    double momentum_x;
+    double momentum_y;
+    double angular_momentum;  // around the origin
+} Diagnostics;
+
 typedef struct {
     Particle *items;
     size_t capacity;
     size_t count;
 } Particles;
 
-// An array with rotating index
-typedef struct {
-    Vector2 points[TRACE_SIZE];
-    size_t index;
-} Trace;
+typedef enum {
+    SOLVER_DIRECT,
+    SOLVER_BARNES_HUT,
+    SOLVER_PARTICLE_MESH,
+    SolverCount,
+} Solver;
 
-typedef struct {
-    Trace *items;
-    size_t capacity;
-    size_t count;
-} Traces;
+const char *SOLVER_NAMES[SolverCount] = {
+    "direct",
+    "barnes-hut",
+    "particle-mesh",
+};
+
+typedef enum {
+    STEPPER_SHARED,
+    STEPPER_BLOCK,
+    StepperCount,
+} Stepper;
+
+const char *STEPPER_NAMES[StepperCount] = {
+    "shared",
+    "block",
+};
+
+typedef enum {
+    COLLISION_BOUNCE,
+    COLLISION_MERGE,
+    CollisionModeCount,
+} CollisionMode;
+
+const char *COLLISION_MODE_NAMES[CollisionModeCount] = {
+    "bounce",
+    "merge",
+};
+
+typedef enum {
+    SCENARIO_THREE_BODY,
+    SCENARIO_PLUMMER,
+    SCENARIO_DISK,
+    SCENARIO_GALAXIES,
+    SCENARIO_SOLAR_SYSTEM,
+    ScenarioCount,
+} Scenario;
+
+const char *SCENARIO_NAMES[ScenarioCount] = {
+    "three-body",
+    "plummer",
+    "disk",
+    "galaxies",
+    "solar-system",
+};
+
+// Double and mixed precision integrate a DParticle state in world units,
+// which particles mirror in pixels for drawing. Mixed precision hands that
+// state to the float solvers, rescaled to units that float holds well.
+typedef enum {
+    PRECISION_FLOAT,
+    PRECISION_DOUBLE,
+    PRECISION_MIXED,
+    PrecisionCount,
+} Precision;
+
+const char *PRECISION_NAMES[PrecisionCount] = {
+    "float",
+    "double",
+    "mixed",
+};
 
 /* Declarations */
 Particles particles;
 Vector2Buffer a_buffer;
-Traces traces;
+Particles sorted_particles;  // spare arrays that reordering gathers into
+Vector2Buffer sorted_a;      //
+TraceStore traces;
+HandleTable handles;  // stable references to particles, which move around
+
+Precision precision = PrecisionCount;  // until the scenario picks one
+DParticle *world;   // state in world units unless precision is float
+double *world_phi;  // potential at each world particle
+size_t world_capacity = 0;
+double world_g = G;
+double world_scale = 1;  // world units per pixel
+double time_scale = 1;   // world seconds per simulated second
+
+Solver solver = SOLVER_DIRECT;
+// Softening starts negative until the scenario picks a default
+GravParams grav_params = {.g = G, .softening = -1, .theta = THETA};
+GravBodies bodies;
+GravTree tree;
+GravMesh mesh;
+float mesh_cell = MESH_CELL;
+SpatialGrid collision_grid;
+CollisionMode collision_mode = COLLISION_BOUNCE;
+uint32_t *merge_roots;     // union-find over touching particles
+HdlHandle *merge_handles;  // particles absorbed by the current merge
+size_t merge_capacity = 0;
+size_t merge_count = 0;  // particles absorbed since the start
+SpatialGrid pick_grid;
+bool pick_grid_stale = true;  // particles moved since it was built
+SgridMorton morton;
+size_t reorder_interval = REORDER_INTERVAL;  // 0 keeps insertion order
 
-int traced_frames = 0;
+Stepper stepper = STEPPER_SHARED;
+int max_level = BLOCK_MAX_LEVEL;
+uint8_t *levels;  // body i steps with dt / 2^levels[i]
+uint32_t *active;
+size_t block_capacity = 0;
+bool forces_ready = false;  // particles' a matches their positions
+size_t block_evaluations = 0;  // forces computed during the last update
+int block_top_level = 0;
+size_t force_evaluations = 0;  // bodies that had their forces computed
+
+size_t diagnostics_interval = DIAGNOSTICS_INTERVAL;  // 0 disables them
+bool potential_due = false;  // next full force pass also fills bodies.phi
+Diagnostics diagnostics;          // latest measurement
+Diagnostics first_diagnostics;    //
+size_t diagnostics_count = 0;     // measurements so far
+const char *diagnostics_path = NULL;
+FILE *diagnostics_file;
+const char *checksums_path = NULL;
+FILE *checksums_file;  // checksum of the state after every step
+
+Scenario scenario = SCENARIO_THREE_BODY;
+size_t scenario_count = SCENARIO_COUNT;
+unsigned int seed = 1;
+size_t headless_steps = 0;  // 0 opens a window
+size_t step_count = 0;
+
+SnapWriter snapshots;
+const char *snapshot_path = NULL;
+size_t snapshot_interval = SNAPSHOT_INTERVAL;
+SnapFormat snapshot_format = SNAP_FLOAT32;
+const char *restart_path = NULL;
+long restart_frame = -1;  // negative counts from the last frame
+WrkPool pool;
+size_t thread_count = 0;  // 0 uses every hardware thread
+
+size_t trace_length = TRACE_LENGTH;
+size_t trace_decimation = TRACE_DECIMATION;
+float trace_distance = TRACE_DISTANCE;
+Color *trace_colors;  // from newest to oldest segment
 bool paused = false;
 bool dragging = false;
-Particle *clicked_node = NULL;
+HdlHandle clicked = HDL_NONE;
+size_t splat_threshold = SPLAT_THRESHOLD;
+DensityImage density;
+Texture2D density_texture;
 
 const int HELP_X = WIN_W - 50;
 const int HELP_Y = 36;
@@ -61,8 +237,8 @@ bool show_help = false;
 const char *help_text =
     "You can use your cursor to drag particles. \n\n\n\n"
     "Also by clicking on particles you can lock/unlock them. \n\n\n\n"
-    // TODO : implement:
-    //"If you press right click on a point it will be deleted.\n\n\n\n"
+    "If you press right click on a point it will be deleted.\n\n\n\n"
+    "Middle click: spawn a particle \n\n\n\n"
     "Mouse wheen / left and right arrow: adjust wind speed \n\n\n\n"
     "Plus / Minus: adjust gravity \n\n\n\n"
     "Space: pause the simulation \n\n\n\n"
@@ -72,29 +248,42 @@ const char *help_text =
 
 /* End of declarations */
 
-// Does a linear search though all particles.
-// Only is performant for not too large numbers of particles
-// Returns null if there's no particle in a radius of distance/2
+// Looks around pos in a grid that's rebuilt when the particles moved since
+// the last pick, so it's only called when a button goes down.
+// Returns null if there's no particle in a radius of PICK_RADIUS
 Particle *nearest_particle(Particles particles, Vector2 pos) {
-    float least_distance = WIN_W / 500;
-    Particle *result = NULL;
-    for (size_t i = 0; i < particles.count; i++) {
-        float distance =
-            Vector2Length(Vector2Subtract(particles.items[i].r, pos));
-        if (distance <= least_distance) {
-            least_distance = distance;
-            result = particles.items + i;
+    if (pick_grid_stale) {
+        if (!sgrid_build(
+                &pick_grid,
+                &particles.items[0].r,
+                particles.count,
+                sizeof(*particles.items),
+                PICK_RADIUS
+            )) {
+            utl_log(UTL_ERROR, "Couldn't allocate picking grid.");
+            exit(-1);
         }
+        pick_grid_stale = false;
+    }
+    size_t nearest;
+    if (!sgrid_nearest(
+            &pick_grid,
+            &particles.items[0].r,
+            sizeof(*particles.items),
+            pos.x,
+            pos.y,
+            PICK_RADIUS,
+            &nearest
+        )) {
+        return NULL;
     }
-    return result;
+    return particles.items + nearest;
 }
 
 float particle_radius(float mass) { return mass / 5; }
 
-void update_particle(Particle *p, Vector2 prev_a, float dt) {
-    mot_adaptive_verlet(&p->r, &p->v, p->a, prev_a, dt);
-
-    // Bounce particle if it's going out of screen
+// Bounce particle if it's going out of screen
+void bounce_off_walls(Particle *p) {
     if (p->r.x < 0) {
         p->v.x = fabs(p->v.x);
     } else if (p->r.x > WIN_W) {
@@ -108,51 +297,903 @@ void update_particle(Particle *p, Vector2 prev_a, float dt) {
     }
 }
 
-void update_physics(float dt) {
-    // Accumulate forces for each particle and check collisions
+void update_particle(Particle *p, Vector2 prev_a, float dt) {
+    mot_adaptive_verlet(&p->r, &p->v, p->a, prev_a, dt);
+    bounce_off_walls(p);
+}
+
+// Elastic collision response along the line between the two particles
+void bounce_particles(Particle *p1, Particle *p2, Vector2 unit_displacement) {
+    float p = 2 *
+              (Vector2DotProduct(p1->v, unit_displacement) -
+               Vector2DotProduct(p2->v, unit_displacement)) /
+              (p1->mass + p2->mass);
+    // Each particle's change is weighted by the other one's mass
+    p1->v =
+        Vector2Subtract(p1->v, Vector2Scale(unit_displacement, p * p2->mass));
+    p2->v = Vector2Add(p2->v, Vector2Scale(unit_displacement, p * p1->mass));
+}
+
+typedef struct {
+    float max_radius;  // bigger particles aren't handled by the grid
+    size_t contacts;
+    uint32_t *roots;  // set in merge mode, touching particles are joined
+} Collisions;
+
+size_t merge_find(uint32_t *roots, size_t i) {
+    while (roots[i] != i) {
+        roots[i] = roots[roots[i]];
+        i = roots[i];
+    }
+    return i;
+}
+
+void collide_particles(Collisions *collisions, Particle *p1, Particle *p2) {
+    float ideal_distance =
+        particle_radius(p1->mass) + particle_radius(p2->mass);
+    if (Vector2DistanceSqr(p1->r, p2->r) > ideal_distance * ideal_distance) {
+        return;
+    }
+    collisions->contacts++;
+    if (collisions->roots == NULL) {
+        bounce_particles(
+            p1, p2, Vector2Normalize(Vector2Subtract(p2->r, p1->r))
+        );
+        return;
+    }
+    // The group's root is its first particle, merge_particles relies on it
+    size_t a = merge_find(collisions->roots, p1 - particles.items);
+    size_t b = merge_find(collisions->roots, p2 - particles.items);
+    if (a < b) collisions->roots[b] = a;
+    if (b < a) collisions->roots[a] = b;
+}
+
+void collide_pair(void *ctx, size_t i, size_t j) {
+    Collisions *collisions = ctx;
+    Particle *p1 = particles.items + i;
+    Particle *p2 = particles.items + j;
+    if (particle_radius(p1->mass) > collisions->max_radius ||
+        particle_radius(p2->mass) > collisions->max_radius) {
+        return;
+    }
+    collide_particles(collisions, p1, p2);
+}
+
+// Uses a uniform grid as broadphase. Cells fit particles up to twice the
+// mean radius, so only particles in neighbouring cells can touch. The few
+// bigger ones, like galaxy cores, are checked against every particle.
+// Returns the number of colliding pairs.
+size_t resolve_collisions(void) {
+    float mean_radius = 0;
     for (size_t i = 0; i < particles.count; i++) {
-        for (size_t j = i + 1; j < particles.count; j++) {
-            Particle *p1 = particles.items + i;
-            Particle *p2 = particles.items + j;
-            float p1_radius = particle_radius(p1->mass);
-            float p2_radius = particle_radius(p2->mass);
-            float ideal_distance = p1_radius + p2_radius;
-
-            float distance = Vector2Distance(p1->r, p2->r);
-            float distance_sq = powf(distance, 2.0);
-
-            Vector2 unit_displacement =
-                Vector2Normalize(Vector2Subtract(p2->r, p1->r));
-
-            p1->a = Vector2Scale(unit_displacement, G * p2->mass / distance_sq);
-            p2->a =
-                Vector2Scale(unit_displacement, -G * p1->mass / distance_sq);
-
-            // Check particles for collisions and set responses
-            if (distance <= ideal_distance) {
-                float p = 2 *
-                          (Vector2DotProduct(p1->v, unit_displacement) -
-                           Vector2DotProduct(p2->v, unit_displacement)) /
-                          (p1->mass + p2->mass);
-                p1->v = Vector2Subtract(
-                    p1->v, Vector2Scale(unit_displacement, p * p1->mass)
-                );
-                p2->v = Vector2Add(
-                    p2->v, Vector2Scale(unit_displacement, p * p2->mass)
-                );
+        mean_radius += particle_radius(particles.items[i].mass);
+    }
+    if (particles.count > 0) mean_radius /= particles.count;
+    Collisions collisions = {.max_radius = 2 * mean_radius};
+    if (collision_mode == COLLISION_MERGE) {
+        if (particles.count > merge_capacity) {
+            uint32_t *new_roots =
+                realloc(merge_roots, particles.capacity * sizeof(*new_roots));
+            HdlHandle *new_handles = realloc(
+                merge_handles, particles.capacity * sizeof(*new_handles)
+            );
+            if (new_roots != NULL) merge_roots = new_roots;
+            if (new_handles != NULL) merge_handles = new_handles;
+            if (new_roots == NULL || new_handles == NULL) {
+                utl_log(UTL_ERROR, "Couldn't allocate memory for merging.");
+                exit(-1);
+            }
+            merge_capacity = particles.capacity;
+        }
+        for (size_t i = 0; i < particles.count; i++) merge_roots[i] = i;
+        collisions.roots = merge_roots;
+    }
+    if (!sgrid_build(
+            &collision_grid,
+            &particles.items[0].r,
+            particles.count,
+            sizeof(*particles.items),
+            2 * collisions.max_radius
+        )) {
+        utl_log(UTL_ERROR, "Couldn't allocate collision grid.");
+        exit(-1);
+    }
+    sgrid_visit_pairs(&collision_grid, collide_pair, &collisions);
+
+    for (size_t i = 0; i < particles.count; i++) {
+        Particle *big = particles.items + i;
+        if (particle_radius(big->mass) <= collisions.max_radius) continue;
+        for (size_t j = 0; j < particles.count; j++) {
+            Particle *p = particles.items + j;
+            bool also_big = particle_radius(p->mass) > collisions.max_radius;
+            // Pairs of big particles are visited once
+            if (j == i || (also_big && j < i)) continue;
+            collide_particles(&collisions, big, p);
+        }
+    }
+    return collisions.contacts;
+}
+
+// Copies particles into the solver's structure of arrays
+void load_bodies(void) {
+    if (!grav_bodies_reserve(&bodies, particles.capacity)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for gravity solver.");
+        exit(-1);
+    }
+    bodies.count = particles.count;
+    for (size_t i = 0; i < particles.count; i++) {
+        bodies.x[i] = particles.items[i].r.x;
+        bodies.y[i] = particles.items[i].r.y;
+        bodies.m[i] = particles.items[i].mass;
+    }
+}
+
+// Runs the selected solver on bodies, for the listed targets or for every
+// body when targets is NULL
+void solve_gravity(GravParams params, const uint32_t *targets, size_t count) {
+    switch (solver) {
+        case SOLVER_DIRECT:
+            if (targets == NULL) {
+                grav_direct_tiled(&bodies, params, &pool);
+            } else {
+                grav_direct_subset(&bodies, params, targets, count, &pool);
+            }
+            break;
+        case SOLVER_BARNES_HUT:
+            if (targets != NULL && count < BLOCK_GATHER_TARGETS) {
+                grav_direct_subset(&bodies, params, targets, count, &pool);
+                break;
+            }
+            if (!grav_bh_build(&tree, &bodies, params.theta)) {
+                utl_log(UTL_ERROR, "Couldn't allocate Barnes-Hut tree.");
+                exit(-1);
+            }
+            grav_bh_forces_subset(
+                &tree, &bodies, params, targets, count, &pool
+            );
+            break;
+        case SOLVER_PARTICLE_MESH:
+            // The mesh solve costs about the same for any number of targets
+            if (!grav_pm_forces(&mesh, &bodies, params, &pool)) {
+                utl_log(UTL_ERROR, "Couldn't set up the particle mesh.");
+                exit(-1);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Updates the acceleration of the listed particles, or of every particle
+// when targets is NULL. All particles act as sources.
+void compute_gravity(const uint32_t *targets, size_t count) {
+    load_bodies();
+    if (targets == NULL) count = particles.count;
+    force_evaluations += count;
+    GravParams params = grav_params;
+    params.potential = potential_due && targets == NULL;
+    solve_gravity(params, targets, count);
+    for (size_t k = 0; k < count; k++) {
+        size_t i = targets == NULL ? k : targets[k];
+        particles.items[i].a = (Vector2){bodies.ax[i], bodies.ay[i]};
+    }
+}
+
+Vector2 screen_position(DVector2 r) {
+    return (Vector2){
+        WIN_W / 2 + r.x / world_scale, WIN_H / 2 + r.y / world_scale
+    };
+}
+
+DVector2 world_position(Vector2 r) {
+    return (DVector2){
+        (r.x - WIN_W / 2) * world_scale, (r.y - WIN_H / 2) * world_scale
+    };
+}
+
+void reserve_world(size_t count) {
+    if (count <= world_capacity) return;
+    DParticle *new_world = realloc(world, count * sizeof(*world));
+    if (new_world != NULL) world = new_world;
+    double *new_phi = realloc(world_phi, count * sizeof(*world_phi));
+    if (new_phi != NULL) world_phi = new_phi;
+    if (new_world == NULL || new_phi == NULL) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for world state.");
+        exit(-1);
+    }
+    world_capacity = count;
+}
+
+// Starts the world state from particles, in the same units
+void load_world(void) {
+    reserve_world(particles.count);
+    for (size_t i = 0; i < particles.count; i++) {
+        const Particle *p = particles.items + i;
+        world[i] = (DParticle){
+            .is_static = p->is_static,
+            .r = world_position(p->r),
+            .v = {p->v.x * world_scale, p->v.y * world_scale},
+            .mass = p->mass,
+        };
+    }
+}
+
+// Copies the world state to particles in pixels and simulated seconds
+void mirror_world(void) {
+    double v_scale = time_scale / world_scale;
+    double a_scale = v_scale * time_scale;
+    for (size_t i = 0; i < particles.count; i++) {
+        Particle *p = particles.items + i;
+        p->r = screen_position(world[i].r);
+        p->v = (Vector2){world[i].v.x * v_scale, world[i].v.y * v_scale};
+        p->a = (Vector2){world[i].a.x * a_scale, world[i].a.y * a_scale};
+    }
+}
+
+// Accelerations, and potentials when they're due, of the world particles.
+// Double precision sums every pair in double. Mixed precision gives the
+// float solver positions relative to the center of mass in pixels and
+// masses as fractions of the total, with G = 1, and scales the results.
+void compute_world_gravity(void) {
+    size_t n = particles.count;
+    force_evaluations += n;
+    double eps = grav_params.softening * world_scale;
+    if (precision == PRECISION_DOUBLE) {
+        for (size_t i = 0; i < n; i++) {
+            world[i].a = (DVector2){0, 0};
+            world_phi[i] = 0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            DParticle *p = world + i;
+            for (size_t j = i + 1; j < n; j++) {
+                DParticle *q = world + j;
+                double dx = q->r.x - p->r.x;
+                double dy = q->r.y - p->r.y;
+                double r_sq = dx * dx + dy * dy + eps * eps;
+                if (r_sq == 0) continue;
+                double inv_r = 1 / sqrt(r_sq);
+                double inv_r3 = inv_r * inv_r * inv_r;
+                p->a.x += dx * inv_r3 * q->mass;
+                p->a.y += dy * inv_r3 * q->mass;
+                q->a.x -= dx * inv_r3 * p->mass;
+                q->a.y -= dy * inv_r3 * p->mass;
+                if (!potential_due) continue;
+                world_phi[i] -= inv_r * q->mass;
+                world_phi[j] -= inv_r * p->mass;
             }
         }
+        for (size_t i = 0; i < n; i++) {
+            world[i].a = mot_dvec_scale(world[i].a, world_g);
+            world_phi[i] *= world_g;
+        }
+        return;
+    }
+
+    DVector2 center = {0, 0};
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        DVector2 moment = mot_dvec_scale(world[i].r, world[i].mass);
+        center = mot_dvec_add(center, moment);
+        total += world[i].mass;
+    }
+    if (!(total > 0)) total = 1;
+    center = mot_dvec_scale(center, 1 / total);
+
+    if (!grav_bodies_reserve(&bodies, particles.capacity)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for gravity solver.");
+        exit(-1);
+    }
+    // The mesh only covers the window
+    Vector2 offset = {0, 0};
+    if (solver == SOLVER_PARTICLE_MESH) {
+        offset = (Vector2){WIN_W / 2, WIN_H / 2};
+    }
+    bodies.count = n;
+    for (size_t i = 0; i < n; i++) {
+        bodies.x[i] = offset.x + (world[i].r.x - center.x) / world_scale;
+        bodies.y[i] = offset.y + (world[i].r.y - center.y) / world_scale;
+        bodies.m[i] = world[i].mass / total;
+    }
+    GravParams params = grav_params;
+    params.g = 1;
+    params.potential = potential_due;
+    solve_gravity(params, NULL, n);
+
+    double a_scale = world_g * total / (world_scale * world_scale);
+    double phi_scale = world_g * total / world_scale;
+    for (size_t i = 0; i < n; i++) {
+        world[i].a = (DVector2){bodies.ax[i] * a_scale, bodies.ay[i] * a_scale};
+        if (potential_due) world_phi[i] = bodies.phi[i] * phi_scale;
+    }
+}
+
+// Smallest power of two subdivision of dt that satisfies the usual
+// h = eta * sqrt(softening / |a|) criterion, capped at max_level
+int timestep_level(Vector2 a, float dt) {
+    float a_length = Vector2Length(a);
+    if (!(a_length > 0)) return 0;
+    float h = BLOCK_ETA * sqrtf(fmaxf(grav_params.softening, 1) / a_length);
+    int level = 0;
+    while (level < max_level && dt / (1 << level) > h) level++;
+    return level;
+}
+
+// Block timesteps: every particle does kick-drift-kick steps of
+// dt / 2^level. Positions drift together, but forces are only recomputed
+// for the particles whose step ends on a given substep, so the cost follows
+// the number of hard particles. All of them are in sync again after dt.
+void update_block_steps(float dt) {
+    if (particles.count > block_capacity) {
+        uint8_t *new_levels = realloc(levels, particles.capacity);
+        uint32_t *new_active =
+            realloc(active, particles.capacity * sizeof(*active));
+        if (new_levels != NULL) levels = new_levels;
+        if (new_active != NULL) active = new_active;
+        if (new_levels == NULL || new_active == NULL) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for timesteps.");
+            exit(-1);
+        }
+        block_capacity = particles.capacity;
+    }
+    block_evaluations = 0;
+    if (!forces_ready) {
+        compute_gravity(NULL, 0);
+        block_evaluations += particles.count;
+        forces_ready = true;
     }
 
-    // Change particles' position based on their acceleration
+    // Particles are in sync here, so each can pick any level
+    block_top_level = 0;
+    for (size_t i = 0; i < particles.count; i++) {
+        levels[i] = timestep_level(particles.items[i].a, dt);
+        if (levels[i] > block_top_level) block_top_level = levels[i];
+    }
     for (size_t i = 0; i < particles.count; i++) {
         Particle *p = particles.items + i;
-        update_particle(p, a_buffer.items[i], dt);
-        a_buffer.items[i] = p->a;
-        // Update particle trace
-        Trace *trace = traces.items + i;
-        trace->index = utl_safe_wrap(trace->index - 1, TRACE_SIZE);
-        trace->points[trace->index] = p->r;
+        float step = dt / (1 << levels[i]);
+        p->v = Vector2Add(p->v, Vector2Scale(p->a, step / 2));
+    }
+
+    size_t substeps = (size_t)1 << block_top_level;
+    float h = dt / substeps;
+    size_t drifted = 0;
+    for (size_t s = 1; s <= substeps; s++) {
+        size_t count = 0;
+        for (size_t i = 0; i < particles.count; i++) {
+            if (s % (substeps >> levels[i]) == 0) active[count++] = i;
+        }
+        if (count == 0) continue;
+
+        // Drifting is cheap, so it's deferred until forces are needed
+        float drift = (s - drifted) * h;
+        for (size_t i = 0; i < particles.count; i++) {
+            Particle *p = particles.items + i;
+            p->r = Vector2Add(p->r, Vector2Scale(p->v, drift));
+            bounce_off_walls(p);
+        }
+        drifted = s;
+
+        compute_gravity(count == particles.count ? NULL : active, count);
+        block_evaluations += count;
+        for (size_t k = 0; k < count; k++) {
+            size_t i = active[k];
+            Particle *p = particles.items + i;
+            float step = dt / (1 << levels[i]);
+            p->v = Vector2Add(p->v, Vector2Scale(p->a, step / 2));
+            if (s == substeps) continue;
+
+            // A particle can move to a finer level at the end of any step,
+            // those are aligned to every finer level as well
+            int level = timestep_level(p->a, dt);
+            if (level > block_top_level) level = block_top_level;
+            if (level > levels[i]) levels[i] = level;
+            step = dt / (1 << levels[i]);
+            p->v = Vector2Add(p->v, Vector2Scale(p->a, step / 2));
+        }
+    }
+}
+
+// Sums up the current state. The potential comes from the full force pass
+// that just ran with potential_due set, so this stays O(N).
+// Each step gets a single row in the diagnostics file.
+void measure_diagnostics(size_t step) {
+    bool repeated = diagnostics_count > 0 && diagnostics.step == step;
+    Diagnostics d = {.step = step};
+    for (size_t i = 0; i < particles.count; i++) {
+        const Particle *p = particles.items + i;
+        double m = p->mass, x = p->r.x, y = p->r.y, vx = p->v.x, vy = p->v.y;
+        double phi = bodies.phi[i];
+        if (precision != PRECISION_FLOAT) {
+            // In world units
+            const DParticle *q = world + i;
+            m = q->mass, x = q->r.x, y = q->r.y, vx = q->v.x, vy = q->v.y;
+            phi = world_phi[i];
+        }
+        d.kinetic += 0.5 * m * (vx * vx + vy * vy);
+        // Every pair shows up in the potential of both of its bodies
+        d.potential += 0.5 * m * phi;
+        d.momentum_x += m * vx;
+        d.momentum_y += m * vy;
+        d.angular_momentum += m * (x * vy - y * vx);
+    }
+    diagnostics = d;
+    if (diagnostics_count++ == 0) first_diagnostics = d;
+
+    if (diagnostics_file == NULL || repeated) return;
+    fprintf(
+        diagnostics_file,
+        "%zu,%.6f,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e\n",
+        d.step,
+        d.step / (double)FPS,
+        d.kinetic,
+        d.potential,
+        d.kinetic + d.potential,
+        d.momentum_x,
+        d.momentum_y,
+        d.angular_momentum
+    );
+}
+
+// Extra force pass to measure the current state, e.g. around timed runs.
+// It leaves the same accelerations a step would compute.
+void measure_now(void) {
+    potential_due = true;
+    if (precision == PRECISION_FLOAT) {
+        compute_gravity(NULL, 0);
+    } else {
+        compute_world_gravity();
+    }
+    potential_due = false;
+    forces_ready = true;
+    measure_diagnostics(step_count);
+}
+
+double relative_drift(double initial, double final) {
+    return (final - initial) / fabs(initial);
+}
+
+// FNV-1a over the bits of every particle's state, a word at a time.
+// Runs that agree on it took bit identical steps, as long as they also
+// agree on the particle order, which reordering keeps deterministic.
+uint64_t state_checksum(void) {
+    uint64_t hash = 0xcbf29ce484222325;
+    if (precision != PRECISION_FLOAT) {
+        for (size_t i = 0; i < particles.count; i++) {
+            const DParticle *p = world + i;
+            double fields[] = {
+                p->r.x, p->r.y, p->v.x, p->v.y, p->a.x, p->a.y, p->mass
+            };
+            for (size_t k = 0; k < utl_array_size(fields); k++) {
+                uint64_t bits;
+                memcpy(&bits, fields + k, sizeof(bits));
+                hash = (hash ^ (uint32_t)bits) * 0x100000001b3;
+                hash = (hash ^ (bits >> 32)) * 0x100000001b3;
+            }
+            hash = (hash ^ p->is_static) * 0x100000001b3;
+        }
+        return hash;
+    }
+    for (size_t i = 0; i < particles.count; i++) {
+        const Particle *p = particles.items + i;
+        float fields[] = {
+            p->r.x, p->r.y, p->v.x, p->v.y, p->a.x, p->a.y, p->mass
+        };
+        for (size_t k = 0; k < utl_array_size(fields); k++) {
+            uint32_t bits;
+            memcpy(&bits, fields + k, sizeof(bits));
+            hash = (hash ^ bits) * 0x100000001b3;
+        }
+        hash = (hash ^ p->is_static) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Sorts particles along a Z-order curve, so bodies that are close in space
+// are also close in memory for the collision grid and the gravity solvers.
+// a_buffer, traces and handles are permuted in the same batch, through
+// spare arrays that are swapped in, so it only allocates after they grow.
+void reorder_particles(void) {
+    if (!sgrid_morton_sort(
+            &morton,
+            &particles.items[0].r,
+            particles.count,
+            sizeof(*particles.items)
+        )) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for reordering.");
+        exit(-1);
+    }
+    if (sorted_particles.capacity != particles.capacity) {
+        utl_da_resize(sorted_particles, particles.capacity);
+    }
+    if (sorted_a.capacity != a_buffer.capacity) {
+        utl_da_resize(sorted_a, a_buffer.capacity);
+    }
+    if (!trc_permute(&traces, morton.order) ||
+        !hdl_permute(&handles, morton.order)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for reordering.");
+        exit(-1);
+    }
+
+    for (size_t k = 0; k < particles.count; k++) {
+        size_t i = morton.order[k];
+        sorted_particles.items[k] = particles.items[i];
+        sorted_a.items[k] = a_buffer.items[i];
+    }
+    Particle *items = particles.items;
+    particles.items = sorted_particles.items;
+    sorted_particles.items = items;
+    Vector2 *a_items = a_buffer.items;
+    a_buffer.items = sorted_a.items;
+    sorted_a.items = a_items;
+}
+
+// Gives handles to particles that were appended directly, like the ones
+// loaded at startup
+void track_particles(void) {
+    while (handles.count < particles.count) {
+        if (hdl_push(&handles) == HDL_NONE) {
+            utl_log(UTL_ERROR, "Couldn't allocate particle handles.");
+            exit(-1);
+        }
+    }
+}
+
+// Appends a particle and keeps a_buffer, traces and handles in step with
+// it. They all grow geometrically and never shrink, so a stream of spawns
+// and deletes settles without further allocations.
+HdlHandle spawn_particle(Particle p) {
+    utl_da_append(particles, p);
+    if (a_buffer.capacity < particles.capacity) {
+        utl_da_resize(a_buffer, particles.capacity);
+        a_buffer.count = a_buffer.capacity;
+    }
+    a_buffer.items[particles.count - 1] = p.a;
+
+    HdlHandle handle = hdl_push(&handles);
+    // Headless runs have no traces
+    if (handle == HDL_NONE ||
+        (traces.length > 0 && !trc_resize(&traces, particles.count))) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for particle.");
+        exit(-1);
+    }
+    // The block stepper needs the new particle's force before its first kick
+    forces_ready = false;
+    pick_grid_stale = true;
+    return handle;
+}
+
+// Moves the last particle into the hole, so arrays stay packed.
+// Stale handles are ignored.
+void delete_particle(HdlHandle handle) {
+    size_t i;
+    if (!hdl_index(&handles, handle, &i)) return;
+    size_t last = particles.count - 1;
+    particles.items[i] = particles.items[last];
+    a_buffer.items[i] = a_buffer.items[last];
+    particles.count--;
+    if (traces.length > 0) trc_swap_remove(&traces, i);
+    hdl_swap_remove(&handles, i);
+    // The block stepper's forces still hold the deleted particle's pull
+    forces_ready = false;
+    pick_grid_stale = true;
+}
+
+// Weighted average of two particles' vectors
+Vector2 mass_average(Vector2 v1, float m1, Vector2 v2, float m2) {
+    return Vector2Scale(
+        Vector2Add(Vector2Scale(v1, m1), Vector2Scale(v2, m2)), 1 / (m1 + m2)
+    );
+}
+
+// Folds every group of particles that touched during the last
+// resolve_collisions into its first particle, then deletes the others in
+// one batch. Mass and momentum are conserved, except that static particles
+// stay in place and absorb the momentum of what hits them.
+// Returns the number of particles that were absorbed.
+size_t merge_particles(void) {
+    size_t absorbed = 0;
+    for (size_t i = 0; i < particles.count; i++) {
+        size_t root = merge_find(merge_roots, i);
+        if (root == i) continue;
+        // Roots come first, so they haven't been absorbed themselves
+        Particle *into = particles.items + root;
+        const Particle *from = particles.items + i;
+        float m1 = into->mass, m2 = from->mass;
+        if (from->is_static && !into->is_static) {
+            into->r = from->r;
+            into->v = Vector2Zero();
+            into->is_static = true;
+        } else if (!into->is_static) {
+            into->r = mass_average(into->r, m1, from->r, m2);
+            into->v = mass_average(into->v, m1, from->v, m2);
+        }
+        // Forces between the two cancel out, so this is the new body's
+        // acceleration and the block stepper can keep its forces
+        into->a = mass_average(into->a, m1, from->a, m2);
+        a_buffer.items[root] =
+            mass_average(a_buffer.items[root], m1, a_buffer.items[i], m2);
+        into->mass = m1 + m2;
+        merge_handles[absorbed++] = hdl_handle(&handles, i);
+    }
+    // Merged particles pull like the groups they replace, so the forces
+    // stay valid through the deletes
+    bool ready = forces_ready;
+    for (size_t k = 0; k < absorbed; k++) delete_particle(merge_handles[k]);
+    forces_ready = ready;
+    merge_count += absorbed;
+    return absorbed;
+}
+
+// Null when the particle has been deleted
+Particle *handle_particle(HdlHandle handle) {
+    size_t i;
+    return hdl_index(&handles, handle, &i) ? particles.items + i : NULL;
+}
+
+HdlHandle particle_handle(const Particle *p) {
+    return p == NULL ? HDL_NONE : hdl_handle(&handles, p - particles.items);
+}
+
+// Queues the particles' state for the snapshot writer thread
+void write_snapshot(void) {
+    SnapFrame *frame = snap_frame_begin(&snapshots, particles.count);
+    if (frame == NULL) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for snapshot.");
+        exit(-1);
+    }
+    frame->step = step_count;
+    frame->time = step_count / (double)FPS;
+    for (size_t i = 0; i < particles.count; i++) {
+        const Particle *p = particles.items + i;
+        frame->blocks[SNAP_X][i] = p->r.x;
+        frame->blocks[SNAP_Y][i] = p->r.y;
+        frame->blocks[SNAP_VX][i] = p->v.x;
+        frame->blocks[SNAP_VY][i] = p->v.y;
+        frame->blocks[SNAP_AX][i] = p->a.x;
+        frame->blocks[SNAP_AY][i] = p->a.y;
+        frame->blocks[SNAP_M][i] = p->mass;
+        frame->flags[i] = p->is_static ? SNAP_FLAG_STATIC : 0;
+    }
+    snap_frame_submit(&snapshots, frame);
+}
+
+// Replaces the particles with a frame of a snapshot stream
+void load_snapshot(const char *path, long index) {
+    SnapReader reader;
+    SnapFrameView view;
+    if (!snap_reader_open(&reader, path)) {
+        utl_log(UTL_ERROR, "Couldn't read snapshot stream \"%s\".", path);
+        exit(-1);
+    }
+    if (index < 0) index += reader.frame_count;
+    if (index < 0 || !snap_reader_frame(&reader, index, &view)) {
+        utl_log(
+            UTL_ERROR,
+            "\"%s\" has %zu frames, there's no frame %ld.",
+            path,
+            reader.frame_count,
+            index
+        );
+        exit(-1);
+    }
+
+    size_t count = view.header->count;
+    float *values = malloc((SnapBlockCount * count + 1) * sizeof(float));
+    if (values == NULL) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for snapshot.");
+        exit(-1);
+    }
+    for (int block = 0; block < SnapBlockCount; block++) {
+        snap_decode(&view, block, values + block * count);
+    }
+    particles.count = 0;
+    for (size_t i = 0; i < count; i++) {
+        Particle p = {
+            .r = {values[SNAP_X * count + i], values[SNAP_Y * count + i]},
+            .v = {values[SNAP_VX * count + i], values[SNAP_VY * count + i]},
+            .a = {values[SNAP_AX * count + i], values[SNAP_AY * count + i]},
+            .mass = values[SNAP_M * count + i],
+            .is_static = view.flags[i] & SNAP_FLAG_STATIC,
+        };
+        utl_da_append(particles, p);
+    }
+    step_count = view.header->step;
+    utl_log(
+        UTL_INFO,
+        "Restarted from frame %ld of \"%s\", step %zu with %zu bodies",
+        index,
+        path,
+        step_count,
+        count
+    );
+    free(values);
+    snap_reader_close(&reader);
+}
+
+// Bookkeeping shared by every kind of step
+void end_step(void) {
+    // Headless runs have no traces
+    for (size_t i = 0; i < traces.traces; i++) {
+        trc_record(&traces, i, particles.items[i].r.x, particles.items[i].r.y);
+    }
+
+    pick_grid_stale = true;
+    step_count++;
+    if (checksums_file != NULL) {
+        fprintf(
+            checksums_file,
+            "%zu,%016llx\n",
+            step_count,
+            (unsigned long long)state_checksum()
+        );
+    }
+    if (snapshot_path != NULL && step_count % snapshot_interval == 0) {
+        write_snapshot();
+    }
+}
+
+// Velocity Verlet on the world state, the force pass that closes a step
+// also opens the next one. Walls and collisions don't apply in world units.
+void update_world(double h) {
+    // Bodies can be locked from the window
+    for (size_t i = 0; i < particles.count; i++) {
+        world[i].is_static = particles.items[i].is_static;
+    }
+    if (!forces_ready) compute_world_gravity();
+    for (size_t i = 0; i < particles.count; i++) {
+        if (world[i].is_static) continue;
+        mot_verlet_begin_d(&world[i].r, &world[i].v, world[i].a, h);
+    }
+
+    // Like the block stepper, it measures the state it ends with
+    size_t measured_step = step_count + 1;
+    potential_due =
+        diagnostics_interval > 0 && measured_step % diagnostics_interval == 0;
+    compute_world_gravity();
+    for (size_t i = 0; i < particles.count; i++) {
+        if (!world[i].is_static) mot_verlet_end_d(&world[i].v, world[i].a, h);
+    }
+    forces_ready = true;
+    if (potential_due) measure_diagnostics(measured_step);
+    potential_due = false;
+    mirror_world();
+}
+
+void update_physics(float dt) {
+    if (precision != PRECISION_FLOAT) {
+        update_world(dt * time_scale);
+        end_step();
+        return;
+    }
+    // Keyed on the step count, which restarts restore, so a restarted run
+    // reorders at the same steps as the original one
+    if (reorder_interval > 0 && (step_count + 1) % reorder_interval == 0) {
+        reorder_particles();
+    }
+
+    // The shared stepper measures the state it starts from, the block one
+    // the state it ends with
+    size_t measured_step = step_count + (stepper == STEPPER_BLOCK);
+    potential_due =
+        diagnostics_interval > 0 && measured_step % diagnostics_interval == 0;
+    if (stepper == STEPPER_BLOCK) {
+        update_block_steps(dt);
+        // Nothing moved since the force pass that closed the step
+        if (potential_due) measure_diagnostics(measured_step);
+        resolve_collisions();
+        if (collision_mode == COLLISION_MERGE) merge_particles();
+    } else {
+        compute_gravity(NULL, 0);
+        if (potential_due) measure_diagnostics(measured_step);
+        resolve_collisions();
+        if (collision_mode == COLLISION_MERGE) merge_particles();
+
+        // Change particles' position based on their acceleration
+        for (size_t i = 0; i < particles.count; i++) {
+            Particle *p = particles.items + i;
+            update_particle(p, a_buffer.items[i], dt);
+            a_buffer.items[i] = p->a;
+        }
+    }
+    potential_due = false;
+    end_step();
+}
+
+void init_traces(void) {
+    trc_init(
+        &traces,
+        trace_length,
+        trace_decimation,
+        trace_distance,
+        0,
+        0,
+        WIN_W,
+        WIN_H
+    );
+    trace_colors = malloc(traces.length * sizeof(*trace_colors));
+    if (trace_colors == NULL || !trc_resize(&traces, particles.count)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for traces.");
+        exit(-1);
+    }
+    // Points are about `decimation` steps apart, fade them accordingly
+    float fade = powf(TRACE_FADE, traces.decimation);
+    float alpha = 1.0;
+    for (size_t i = 0; i < traces.length; i++) {
+        trace_colors[i] = ColorAlpha(WHITE, alpha);
+        alpha *= fade;
+    }
+    utl_log(
+        UTL_INFO,
+        "Traces: %zu points every %zu steps, %.1f KiB for %zu bodies",
+        traces.length,
+        traces.decimation,
+        trc_memory(&traces) / 1024.0,
+        traces.traces
+    );
+}
+
+// Sends every trace segment as one stream of line vertices, which rlgl
+// flushes in a few large batches instead of a draw call per segment.
+// Each trace starts at its particle, so decimation doesn't leave a gap.
+void draw_traces(void) {
+    rlBegin(RL_LINES);
+    for (size_t i = 0; i < traces.traces; i++) {
+        float x = particles.items[i].r.x;
+        float y = particles.items[i].r.y;
+        for (size_t k = 0; k < traces.count[i]; k++) {
+            float next_x, next_y;
+            trc_point(&traces, i, k, &next_x, &next_y);
+            Color color = trace_colors[k];
+            rlColor4ub(color.r, color.g, color.b, color.a);
+            rlVertex2f(x, y);
+            rlVertex2f(next_x, next_y);
+            x = next_x;
+            y = next_y;
+        }
+    }
+    rlEnd();
+}
+
+// Adds every body's mass to the pixel under it and draws the log of the
+// sums as one texture, which stays cheap long after a circle per body isn't
+void draw_density(void) {
+    if (density.pixels == NULL) {
+        if (!dens_init(&density, WIN_W, WIN_H, 0, 0, 1)) {
+            utl_log(UTL_ERROR, "Couldn't allocate density image.");
+            exit(-1);
+        }
+        Image blank = GenImageColor(WIN_W, WIN_H, BLANK);
+        density_texture = LoadTextureFromImage(blank);
+        UnloadImage(blank);
+        SetTextureFilter(density_texture, TEXTURE_FILTER_POINT);
+    }
+    if (!dens_splat(
+            &density,
+            &particles.items[0].r,
+            &particles.items[0].mass,
+            particles.count,
+            sizeof(*particles.items),
+            &pool
+        )) {
+        utl_log(UTL_ERROR, "Couldn't allocate density layers.");
+        exit(-1);
+    }
+
+    // A pixel holding one body of average mass is the darkest shade
+    double mass = 0;
+    for (size_t i = 0; i < particles.count; i++) {
+        mass += particles.items[i].mass;
+    }
+    dens_tone_map(&density, mass / particles.count, &pool);
+    UpdateTexture(density_texture, density.pixels);
+    DrawTexture(density_texture, 0, 0, WHITE);
+
+    // Static bodies are few and should still stand out
+    for (size_t i = 0; i < particles.count; i++) {
+        const Particle p = particles.items[i];
+        if (p.is_static) {
+            DrawCircle(p.r.x, p.r.y, particle_radius(p.mass), RED);
+        }
     }
 }
 
@@ -162,24 +1203,44 @@ void update_draw_frame(void) {
     if (IsKeyPressed(KEY_ENTER)) update_physics(1 / (float)FPS);
 
     Vector2 mouse_pos = GetMousePosition();
+    // The world state keeps the bodies it started with
+    bool editable = precision == PRECISION_FLOAT;
+    if (editable && IsMouseButtonPressed(MOUSE_BUTTON_MIDDLE)) {
+        spawn_particle((Particle){.r = mouse_pos, .mass = SPAWN_MASS});
+    }
+    if (editable && IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
+        delete_particle(
+            particle_handle(nearest_particle(particles, mouse_pos))
+        );
+    }
+
+    // Particles move in memory, so the clicked one is kept by handle
+    Particle *clicked_node = handle_particle(clicked);
     if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-        // Set clicked_particle before dragging starts
+        // Set clicked_particle when the button goes down
         // so it doesn't change with mouse pos
-        if (!dragging) {
+        if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
             clicked_node = nearest_particle(particles, mouse_pos);
+            clicked = particle_handle(clicked_node);
         }
         // Initiate dragging if mouse position delta is big enough
         if (Vector2Length(GetMouseDelta()) > 1.0 && clicked_node != NULL) {
             dragging = true;
         }
         // Update particle position based on mouse position
-        if (dragging) {
+        if (dragging && clicked_node != NULL) {
             Vector2 drag_acc = Vector2Scale(
                 Vector2Subtract(mouse_pos, clicked_node->r), 10.0
             );
             mot_integrate_verlet(
                 &clicked_node->r, drag_acc, clicked_node->r, 0.1, 0
             );
+            pick_grid_stale = true;
+            if (precision != PRECISION_FLOAT) {
+                size_t i = clicked_node - particles.items;
+                world[i].r = world_position(clicked_node->r);
+                forces_ready = false;
+            }
         }
     }
     if (IsMouseButtonReleased(MOUSE_LEFT_BUTTON)) {
@@ -208,38 +1269,86 @@ void update_draw_frame(void) {
 
     if (!paused) update_physics(1 / (float)FPS);
 
-    int trace_count = TRACE_SIZE;
-    if (traced_frames < trace_count) {
-        trace_count = traced_frames;
-        traced_frames++;
-    }
-
     BeginDrawing();
     {
         ClearBackground(BLACK);
+        int y = 50;
         DrawText(
-            TextFormat("FPS: %d", (int)(1.0 / GetFrameTime())), 50, 50, 20,
+            TextFormat("FPS: %d", (int)(1.0 / GetFrameTime())), 50, y, 20,
             WHITE
         );
-
-        for (size_t i = 0; i < particles.count; i++) {
-            const Particle p = particles.items[i];
-            DrawCircle(
-                p.r.x, p.r.y, particle_radius(p.mass), p.is_static ? RED : WHITE
+        DrawText(
+            TextFormat("Traces: %.1f KiB", trc_memory(&traces) / 1024.0),
+            50,
+            y += 25,
+            20,
+            WHITE
+        );
+        DrawText(
+            TextFormat("Bodies: %zu, %zu merged", particles.count, merge_count),
+            50,
+            y += 25,
+            20,
+            WHITE
+        );
+        if (diagnostics_count > 0) {
+            const Diagnostics *d = &diagnostics;
+            double energy = d->kinetic + d->potential;
+            double first_energy =
+                first_diagnostics.kinetic + first_diagnostics.potential;
+            DrawText(
+                TextFormat(
+                    "Energy: %.4e = K %.3e + U %.3e, drift %.2e",
+                    energy,
+                    d->kinetic,
+                    d->potential,
+                    relative_drift(first_energy, energy)
+                ),
+                50,
+                y += 25,
+                20,
+                WHITE
+            );
+            DrawText(
+                TextFormat(
+                    "Momentum: (%.3e, %.3e), angular %.4e",
+                    d->momentum_x,
+                    d->momentum_y,
+                    d->angular_momentum
+                ),
+                50,
+                y += 25,
+                20,
+                WHITE
             );
+        }
+        if (stepper == STEPPER_BLOCK) {
+            DrawText(
+                TextFormat(
+                    "Forces: %zu per frame, finest step dt/%d",
+                    block_evaluations,
+                    1 << block_top_level
+                ),
+                50,
+                y += 25,
+                20,
+                WHITE
+            );
+        }
 
-            // Draw particle's trace
-            Trace trace = traces.items[i];
-            float alpha = 1.0;
-            for (int i = 0; i < trace_count - 1; i++) {
-                size_t index = utl_safe_wrap(i + trace.index, TRACE_SIZE);
-                size_t next_index =
-                    utl_safe_wrap(1 + i + trace.index, TRACE_SIZE);
-                DrawLineV(
-                    trace.points[index], trace.points[next_index],
-                    ColorAlpha(WHITE, alpha)
+        if (particles.count > splat_threshold) {
+            // Traces of that many bodies would only cover the density
+            draw_density();
+        } else {
+            draw_traces();
+            for (size_t i = 0; i < particles.count; i++) {
+                const Particle p = particles.items[i];
+                DrawCircle(
+                    p.r.x,
+                    p.r.y,
+                    particle_radius(p.mass),
+                    p.is_static ? RED : WHITE
                 );
-                alpha *= 0.987;  // fadeout trace
             }
         }
 
@@ -249,20 +1358,11 @@ void update_draw_frame(void) {
     EndDrawing();
 }
 
-int main(void) {
-    help_rect = (Rectangle){HELP_X - 13, HELP_Y - 8, 41, 41};
-    utl_da_init(particles, 0);
-    utl_da_init(a_buffer, particles.capacity);
-    a_buffer.count = a_buffer.capacity;
-
-    if (particles.items == NULL || a_buffer.items == NULL) {
-        utl_log(UTL_ERROR, "Couldn't allocate memory for simulation.");
-        exit(-1);
-    }
-
-    // Initialize particles
-    memset(a_buffer.items, 0, a_buffer.capacity * sizeof(*a_buffer.items));
+float random_range(float min, float max) {
+    return min + (max - min) * (rand() / (float)RAND_MAX);
+}
 
+void add_three_body(void) {
     Particle test[] = {
         {
             .r = (Vector2){WIN_W / 2, WIN_H / 2},
@@ -286,46 +1386,1440 @@ int main(void) {
             .is_static = false,
         }
     };
-    const float AU_SCALE =
-        3.0 / 8.8 * WIN_H / 1;  // fill 3/8 of window with 1 AU
-    Particle solar_system[] = {
-        {
-            // sun
-            .r = WIN_H / 2,
-            .v = (Vector2){0, 0},
-            .a = (Vector2){0, 0},
-            .mass = 1.99e19,
-            .is_static = false,
+    utl_da_append_many(particles, test, utl_array_size(test));
+}
 
-        },
+// Samples a Plummer sphere of scale radius `radius` in 3D and keeps the
+// x and y of positions and velocities. Velocities come from the Plummer
+// distribution function with the rejection method of Aarseth et al. 1974.
+void add_plummer(
+    Vector2 center,
+    Vector2 velocity,
+    float radius,
+    float mass,
+    size_t count
+) {
+    for (size_t i = 0; i < count; i++) {
+        // Inverse of the cumulative mass, cut at 10 scale radii
+        float r;
+        do {
+            float u = random_range(1e-6, 1);
+            r = radius / sqrtf(powf(u, -2.0 / 3.0) - 1);
+        } while (r > 10 * radius);
+        float z = random_range(-1, 1);
+        float phi = random_range(0, 2 * PI);
+        float planar = sqrtf(1 - z * z);
+
+        float q, g;
+        do {
+            q = random_range(0, 1);
+            g = random_range(0, 0.1);
+        } while (g > q * q * powf(1 - q * q, 3.5));
+        float escape =
+            sqrtf(2 * G * mass) * powf(r * r + radius * radius, -0.25);
+        float vz = random_range(-1, 1);
+        float v_phi = random_range(0, 2 * PI);
+        float v_planar = sqrtf(1 - vz * vz);
+
+        Particle p = {
+            .r = {center.x + r * planar * cosf(phi),
+                  center.y + r * planar * sinf(phi)},
+            .v = {velocity.x + q * escape * v_planar * cosf(v_phi),
+                  velocity.y + q * escape * v_planar * sinf(v_phi)},
+            .mass = mass / count,
+        };
+        utl_da_append(particles, p);
+    }
+}
+
+// Uniform disk rotating counterclockwise, on circular orbits around the
+// mass enclosed by each body's radius plus an optional central body.
+// Bodies start clear of the central body so they don't collide with it.
+void add_disk(
+    Vector2 center,
+    Vector2 velocity,
+    float radius,
+    float mass,
+    float central_mass,
+    size_t count
+) {
+    if (central_mass > 0) {
+        Particle core = {.r = center, .v = velocity, .mass = central_mass};
+        utl_da_append(particles, core);
+    }
+    float inner = central_mass > 0 ? 2 * particle_radius(central_mass) : 0;
+    float area = radius * radius - inner * inner;
+    float eps_sq = grav_params.softening * grav_params.softening;
+    for (size_t i = 0; i < count; i++) {
+        float r = sqrtf(inner * inner + area * random_range(0, 1));
+        float phi = random_range(0, 2 * PI);
+        float enclosed = central_mass + mass * (r * r - inner * inner) / area;
+        // v^2 / r equals the softened pull toward the center
+        float v = r * sqrtf(G * enclosed / powf(r * r + eps_sq, 1.5));
+        Particle p = {
+            .r = {center.x + r * cosf(phi), center.y + r * sinf(phi)},
+            .v = {velocity.x - v * sinf(phi), velocity.y + v * cosf(phi)},
+            .mass = mass / count,
+        };
+        utl_da_append(particles, p);
+    }
+}
+
+// Appends the bodies of the selected scenario, seeded with `seed`
+// Sun, Earth and Moon in SI units on circular orbits, an hour per step.
+// Float can't run it: G * M of the sun is 1.3e20 m^3/s^2 and the Moon's
+// orbit is 2.6e-3 AU, less than a pixel across.
+void add_solar_system(void) {
+    const double SUN_MASS = 1.989e30;
+    const double EARTH_MASS = 5.972e24;
+    const double MOON_MASS = 7.342e22;
+    const double MOON_DISTANCE = 3.844e8;
+    world_g = G_SI;
+    world_scale = AU / (3.0 / 8 * WIN_H);  // 1 AU fills 3/8 of the window
+    time_scale = SOLAR_SYSTEM_STEP * FPS;
+
+    double earth_speed = sqrt(G_SI * SUN_MASS / AU);
+    double moon_speed = sqrt(G_SI * EARTH_MASS / MOON_DISTANCE);
+    DParticle solar_system[] = {
+        {.r = {0, 0}, .mass = SUN_MASS},
+        {.r = {AU, 0}, .v = {0, earth_speed}, .mass = EARTH_MASS},
         {
-            // earth
-            .r = WIN_H / 2 + 1 * AU_SCALE,
-            .v = (Vector2){0, 0},
-            .a = (Vector2){0, 0},
-            .mass = 5.97e13,
-            .is_static = false,
+            .r = {AU + MOON_DISTANCE, 0},
+            .v = {0, earth_speed + moon_speed},
+            .mass = MOON_MASS,
+        },
+    };
+    // The sun recoils, so the total momentum is 0
+    double momentum = EARTH_MASS * earth_speed +
+                      MOON_MASS * (earth_speed + moon_speed);
+    solar_system[0].v.y = -momentum / SUN_MASS;
+    // Masses of the mirrored particles, only used for their radius
+    const float DRAWN_MASS[] = {40, 12, 5};
+
+    size_t count = utl_array_size(solar_system);
+    reserve_world(count);
+    for (size_t i = 0; i < count; i++) {
+        world[i] = solar_system[i];
+        utl_da_append(particles, ((Particle){.mass = DRAWN_MASS[i]}));
+    }
+    mirror_world();
+}
 
+void load_scenario(void) {
+    const Vector2 CENTER = {WIN_W / 2, WIN_H / 2};
+    srand(seed);
+    switch (scenario) {
+        case SCENARIO_THREE_BODY:
+            add_three_body();
+            break;
+        case SCENARIO_PLUMMER:
+            add_plummer(
+                CENTER, Vector2Zero(), SCENARIO_RADIUS, SCENARIO_MASS,
+                scenario_count
+            );
+            break;
+        case SCENARIO_DISK:
+            add_disk(
+                CENTER, Vector2Zero(), 2 * SCENARIO_RADIUS, SCENARIO_MASS, 0,
+                scenario_count
+            );
+            break;
+        case SCENARIO_GALAXIES: {
+            // Two disks with heavy cores, a quarter of each galaxy's mass,
+            // passing each other off center
+            const float OFFSET = 2.5 * SCENARIO_RADIUS;
+            const float APPROACH_SPEED = 150;
+            float galaxy_mass = SCENARIO_MASS / 2;
+            size_t half = scenario_count < 4 ? 1 : scenario_count / 2 - 1;
+            add_disk(
+                (Vector2){CENTER.x - OFFSET, CENTER.y - OFFSET / 4},
+                (Vector2){APPROACH_SPEED, 0},
+                SCENARIO_RADIUS,
+                0.75 * galaxy_mass,
+                0.25 * galaxy_mass,
+                half
+            );
+            add_disk(
+                (Vector2){CENTER.x + OFFSET, CENTER.y + OFFSET / 4},
+                (Vector2){-APPROACH_SPEED, 0},
+                SCENARIO_RADIUS,
+                0.75 * galaxy_mass,
+                0.25 * galaxy_mass,
+                scenario_count < 4 ? 1 : scenario_count - half - 2
+            );
+            break;
         }
-    };
+        case SCENARIO_SOLAR_SYSTEM:
+            add_solar_system();
+            return;  // already in world units
+        default:
+            break;
+    }
+    if (precision != PRECISION_FLOAT) load_world();
+}
 
-    utl_da_append_many(particles, test, utl_array_size(test));
+void run_headless(size_t steps) {
+    const float dt = 1 / (float)FPS;
+    size_t n = particles.count;
+    if (restart_path != NULL) {
+        printf(
+            "Restarted from \"%s\" at step %zu, N = %zu",
+            restart_path,
+            step_count,
+            n
+        );
+    } else {
+        printf(
+            "Scenario %s, N = %zu, seed %u", SCENARIO_NAMES[scenario], n, seed
+        );
+    }
+    printf(
+        ", %s solver, %s stepper, %zu threads%s\n",
+        SOLVER_NAMES[solver],
+        STEPPER_NAMES[stepper],
+        pool.thread_count,
+        grav_params.deterministic ? ", deterministic" : ""
+    );
+    if (precision != PRECISION_FLOAT) {
+        printf("%s precision, world units\n", PRECISION_NAMES[precision]);
+    }
+
+    measure_now();
+    Diagnostics initial = diagnostics;
+    double interactions = 0;
+    double start = utl_time();
+    for (size_t k = 0; k < steps; k++) {
+        // Merging changes N along the way
+        size_t evaluations = force_evaluations;
+        size_t live = particles.count;
+        update_physics(dt);
+        evaluations = force_evaluations - evaluations;
+        interactions += (double)evaluations * (live > 0 ? live - 1 : 0);
+    }
+    double elapsed = utl_time() - start;
+    measure_now();
+    Diagnostics final = diagnostics;
+
+    printf(
+        "%zu steps in %.3f s: %.2f steps/s, %.3e interactions/s\n",
+        steps,
+        elapsed,
+        steps / elapsed,
+        interactions / elapsed
+    );
+    if (collision_mode == COLLISION_MERGE) {
+        printf(
+            "bodies: %zu -> %zu, %zu merged\n",
+            n,
+            particles.count,
+            merge_count
+        );
+    }
+    double initial_energy = initial.kinetic + initial.potential;
+    double final_energy = final.kinetic + final.potential;
+    printf(
+        "energy: %.6e -> %.6e, relative drift %.3e\n",
+        initial_energy,
+        final_energy,
+        relative_drift(initial_energy, final_energy)
+    );
+    printf(
+        "momentum: (%.4e, %.4e) -> (%.4e, %.4e)\n",
+        initial.momentum_x,
+        initial.momentum_y,
+        final.momentum_x,
+        final.momentum_y
+    );
+    printf(
+        "angular momentum: %.6e -> %.6e, relative drift %.3e\n",
+        initial.angular_momentum,
+        final.angular_momentum,
+        relative_drift(initial.angular_momentum, final.angular_momentum)
+    );
+    printf("checksum: %016llx\n", (unsigned long long)state_checksum());
+}
 
-    // Initialize traces to out of screen
-    utl_da_init(traces, 0);
+// Fills bodies with a uniform random distribution inside the window
+void random_bodies(GravBodies *b, size_t count) {
+    if (!grav_bodies_reserve(b, count)) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for %zu bodies.", count);
+        exit(-1);
+    }
+    b->count = count;
+    for (size_t i = 0; i < count; i++) {
+        b->x[i] = WIN_W * (rand() / (float)RAND_MAX);
+        b->y[i] = WIN_H * (rand() / (float)RAND_MAX);
+        b->m[i] = 1 + 9 * (rand() / (float)RAND_MAX);
+    }
+}
+
+// Relative error of the accelerations in ax/ay on the worst body, against
+// the double precision sum for each body
+double direct_error(const GravBodies *b, const float *ax, const float *ay) {
+    double err_max = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        double ref_x, ref_y;
+        grav_direct_at(b, grav_params, i, &ref_x, &ref_y);
+        double norm = hypot(ref_x, ref_y);
+        double err = hypot(ax[i] - ref_x, ay[i] - ref_y) / norm;
+        if (norm > 0 && err > err_max) err_max = err;
+    }
+    return err_max;
+}
+
+// Compares the tiled SIMD kernel against the scalar one, and both against
+// the double precision reference. Returns non zero value when the tiled
+// kernel's error is past the tolerance.
+int bench_direct(void) {
+    const size_t SIZES[] = {1000, 4000, 16000};
+    // A float sum of N terms is good to about N * FLT_EPSILON of the sum of
+    // their magnitudes. On these random bodies both kernels stay under a
+    // quarter of that, while a rsqrt without its Newton step is 20 to 300
+    // times past it.
+    const double TOLERANCE = FLT_EPSILON / 4;
+    GravBodies b = {0};
+    size_t failures = 0;
+    srand(42);
+
+    printf("Direct summation benchmark (%s, 1 thread)\n", grav_simd_name());
+    printf(
+        "%9s %12s %12s %12s %9s %11s %11s %11s\n",
+        "N",
+        "scalar ms",
+        "tiled ms",
+        "Gpairs/s",
+        "speedup",
+        "scalar err",
+        "tiled err",
+        "tolerance"
+    );
+
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        random_bodies(&b, n);
+
+        double start = utl_time();
+        grav_direct(&b, grav_params);
+        double scalar_time = utl_time() - start;
+
+        float *ref_x = malloc(n * sizeof(float));
+        float *ref_y = malloc(n * sizeof(float));
+        if (ref_x == NULL || ref_y == NULL) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for benchmark.");
+            exit(-1);
+        }
+        memcpy(ref_x, b.ax, n * sizeof(float));
+        memcpy(ref_y, b.ay, n * sizeof(float));
+
+        const int STEPS = 5;
+        start = utl_time();
+        for (int k = 0; k < STEPS; k++) {
+            grav_direct_tiled(&b, grav_params, NULL);
+        }
+        double tiled_time = (utl_time() - start) / STEPS;
+
+        double scalar_err = direct_error(&b, ref_x, ref_y);
+        double tiled_err = direct_error(&b, b.ax, b.ay);
+        double tolerance = n * TOLERANCE;
+        free(ref_x);
+        free(ref_y);
+        if (!(tiled_err <= tolerance)) failures++;
+
+        printf(
+            "%9zu %12.3f %12.3f %12.3f %8.1fx %11.2e %11.2e %11.2e\n",
+            n,
+            scalar_time * 1e3,
+            tiled_time * 1e3,
+            (double)n * (n - 1) / 2 / tiled_time * 1e-9,
+            scalar_time / tiled_time,
+            scalar_err,
+            tiled_err,
+            tolerance
+        );
+    }
+    grav_bodies_free(&b);
+
+    printf(
+        "Tiled forces: %zu failures in %zu sizes\n",
+        failures,
+        utl_array_size(SIZES)
+    );
+    if (failures > 0) {
+        utl_log(UTL_ERROR, "The tiled kernel is past its error tolerance.");
+        return -1;
+    }
+    return 0;
+}
+
+// Headless comparison of Barnes-Hut against direct summation.
+// Direct summation is timed on a sample of bodies and scaled up to N,
+// as running it in full for a million bodies would take minutes.
+void bench_barnes_hut(void) {
+    const size_t SIZES[] = {1000, 10000, 100000, 1000000};
+    const size_t SAMPLE_SIZE = 1000;
+    GravBodies b = {0};
+    GravTree t = {0};
+    srand(42);
+
+    printf(
+        "Barnes-Hut benchmark, theta = %.2f, softening = %.2f, %zu threads\n",
+        grav_params.theta,
+        grav_params.softening,
+        pool.thread_count
+    );
+    printf(
+        "%9s %10s %10s %10s %12s %11s %11s\n",
+        "N",
+        "build ms",
+        "walk ms",
+        "ms/step",
+        "direct ms*",
+        "rms error",
+        "max error"
+    );
+
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        random_bodies(&b, n);
+
+        int steps = n >= 100000 ? 1 : 10;
+        double build_time = 0, walk_time = 0;
+        for (int k = 0; k < steps; k++) {
+            double start = utl_time();
+            if (!grav_bh_build(&t, &b, grav_params.theta)) {
+                utl_log(UTL_ERROR, "Couldn't allocate Barnes-Hut tree.");
+                exit(-1);
+            }
+            double built = utl_time();
+            grav_bh_forces(&t, &b, grav_params, &pool);
+            build_time += built - start;
+            walk_time += utl_time() - built;
+        }
+
+        // Compare against exact forces on evenly spaced sample bodies
+        size_t sample = n < SAMPLE_SIZE ? n : SAMPLE_SIZE;
+        double err_sq_sum = 0, err_max = 0;
+        double start = utl_time();
+        for (size_t k = 0; k < sample; k++) {
+            size_t i = k * (n / sample);
+            double ax, ay;
+            grav_direct_at(&b, grav_params, i, &ax, &ay);
+            double ex = b.ax[i] - ax;
+            double ey = b.ay[i] - ay;
+            double err = sqrt((ex * ex + ey * ey) / (ax * ax + ay * ay));
+            err_sq_sum += err * err;
+            if (err > err_max) err_max = err;
+        }
+        // grav_direct visits each pair once, so it's half of n sampled rows
+        double direct_time = (utl_time() - start) / sample * n / 2;
+
+        printf(
+            "%9zu %10.3f %10.3f %10.3f %12.3f %11.2e %11.2e\n",
+            n,
+            build_time / steps * 1e3,
+            walk_time / steps * 1e3,
+            (build_time + walk_time) / steps * 1e3,
+            direct_time * 1e3,
+            sqrt(err_sq_sum / sample),
+            err_max
+        );
+    }
+    printf("* direct summation time is extrapolated from the sample\n");
+
+    grav_tree_free(&t);
+    grav_bodies_free(&b);
+}
+
+// Strong scaling of the parallel force passes over a fixed problem size
+void bench_scaling(void) {
+    const size_t DIRECT_N = 16000;
+    const size_t TREE_N = 200000;
+    GravBodies b = {0};
+    GravTree t = {0};
+    double direct_base = 0, tree_base = 0;
+    srand(42);
+
+    printf(
+        "Strong scaling, direct N = %zu, Barnes-Hut N = %zu\n",
+        DIRECT_N,
+        TREE_N
+    );
+    printf(
+        "%8s %11s %10s %11s %10s\n",
+        "threads",
+        "direct ms",
+        "direct eff",
+        "tree ms",
+        "tree eff"
+    );
+    for (size_t threads = 1; threads <= pool.thread_count; threads *= 2) {
+        WrkPool scaling_pool;
+        wrk_pool_init(&scaling_pool, threads);
+
+        random_bodies(&b, DIRECT_N);
+        double start = utl_time();
+        grav_direct_tiled(&b, grav_params, &scaling_pool);
+        double direct_time = utl_time() - start;
+
+        random_bodies(&b, TREE_N);
+        if (!grav_bh_build(&t, &b, grav_params.theta)) {
+            utl_log(UTL_ERROR, "Couldn't allocate Barnes-Hut tree.");
+            exit(-1);
+        }
+        start = utl_time();
+        grav_bh_forces(&t, &b, grav_params, &scaling_pool);
+        double tree_time = utl_time() - start;
+
+        if (threads == 1) {
+            direct_base = direct_time;
+            tree_base = tree_time;
+        }
+        // efficiency = T(1) / (p * T(p))
+        printf(
+            "%8zu %11.3f %9.1f%% %11.3f %9.1f%%\n",
+            scaling_pool.thread_count,
+            direct_time * 1e3,
+            100 * direct_base / (threads * direct_time),
+            tree_time * 1e3,
+            100 * tree_base / (threads * tree_time)
+        );
+        wrk_pool_free(&scaling_pool);
+    }
+    grav_tree_free(&t);
+    grav_bodies_free(&b);
+}
+
+// Particle-mesh cost is dominated by the FFT for small N and by deposit
+// and interpolation for large N. Errors are against direct summation.
+void bench_particle_mesh(void) {
+    const size_t SIZES[] = {10000, 100000, 1000000, 4000000};
+    const size_t SAMPLE_SIZE = 200;
+    GravBodies b = {0};
+    GravMesh m;
+    srand(42);
+
+    if (!grav_pm_init(&m, 0, 0, WIN_W, WIN_H, mesh_cell)) {
+        utl_log(UTL_ERROR, "Couldn't set up the particle mesh.");
+        exit(-1);
+    }
+    printf(
+        "Particle-mesh benchmark, %zux%zu mesh of %.1f px cells, %zu threads\n",
+        m.nx,
+        m.ny,
+        m.cell,
+        pool.thread_count
+    );
+    printf("%9s %10s %11s %11s\n", "N", "ms/step", "rms error", "max error");
+
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        random_bodies(&b, n);
+
+        int steps = n >= 1000000 ? 2 : 10;
+        double start = utl_time();
+        for (int k = 0; k < steps; k++) {
+            if (!grav_pm_forces(&m, &b, grav_params, &pool)) {
+                utl_log(UTL_ERROR, "Couldn't set up the particle mesh.");
+                exit(-1);
+            }
+        }
+        double step_time = (utl_time() - start) / steps;
+
+        double err_sq_sum = 0, err_max = 0;
+        for (size_t k = 0; k < SAMPLE_SIZE; k++) {
+            size_t i = k * (n / SAMPLE_SIZE);
+            double ax, ay;
+            grav_direct_at(&b, grav_params, i, &ax, &ay);
+            double ex = b.ax[i] - ax;
+            double ey = b.ay[i] - ay;
+            double err = sqrt((ex * ex + ey * ey) / (ax * ax + ay * ay));
+            err_sq_sum += err * err;
+            if (err > err_max) err_max = err;
+        }
+        printf(
+            "%9zu %10.3f %11.2e %11.2e\n",
+            n,
+            step_time * 1e3,
+            sqrt(err_sq_sum / SAMPLE_SIZE),
+            err_max
+        );
+    }
+    printf(
+        "* the mesh can't resolve neighbours closer than a few cells, and\n"
+        "  those dominate the force in uniform random sets\n"
+    );
+    grav_pm_free(&m);
+    grav_bodies_free(&b);
+}
+
+// Grid broadphase against the all pairs check it replaced
+void bench_collisions(void) {
+    const size_t SIZES[] = {1000, 10000, 100000, 1000000};
+    const size_t ALL_PAIRS_MAX = 10000;
+    srand(42);
+
+    printf("Collision benchmark, masses in [1, 10]\n");
+    printf(
+        "%9s %10s %10s %14s %14s\n",
+        "N",
+        "grid ms",
+        "contacts",
+        "all pairs ms",
+        "all contacts"
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        particles.count = 0;
+        for (size_t i = 0; i < n; i++) {
+            Particle p = {
+                .r = {WIN_W * (rand() / (float)RAND_MAX),
+                      WIN_H * (rand() / (float)RAND_MAX)},
+                .mass = 1 + 9 * (rand() / (float)RAND_MAX),
+            };
+            utl_da_append(particles, p);
+        }
+
+        double start = utl_time();
+        size_t contacts = resolve_collisions();
+        double grid_time = utl_time() - start;
+        printf("%9zu %10.3f %10zu ", n, grid_time * 1e3, contacts);
+        if (n > ALL_PAIRS_MAX) {
+            printf("%14s %14s\n", "-", "-");
+            continue;
+        }
+
+        // Bouncing only changes velocities, so both should see equal contacts
+        start = utl_time();
+        size_t all_contacts = 0;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i + 1; j < n; j++) {
+                Particle *p1 = particles.items + i;
+                Particle *p2 = particles.items + j;
+                float d = particle_radius(p1->mass) + particle_radius(p2->mass);
+                if (Vector2DistanceSqr(p1->r, p2->r) <= d * d) all_contacts++;
+            }
+        }
+        printf("%14.3f %14zu\n", (utl_time() - start) * 1e3, all_contacts);
+    }
+    particles.count = 0;
+}
+
+// Memory and recording cost of the trace store, compared to the old layout
+// of TRACE_SIZE = 222 full Vector2 points per body
+void bench_traces(void) {
+    const size_t SIZES[] = {1000, 100000, 1000000};
+    const size_t LEGACY_SIZE = 222;
+    const int STEPS = 50;
+    TraceStore store;
+    srand(42);
+
+    printf(
+        "Trace benchmark, %zu points every %zu steps or %.1f px\n",
+        trace_length,
+        trace_decimation,
+        trace_distance
+    );
+    printf(
+        "%9s %12s %12s %12s %12s\n",
+        "N",
+        "legacy MiB",
+        "store MiB",
+        "record ms",
+        "recorded %"
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        trc_init(
+            &store,
+            trace_length,
+            trace_decimation,
+            trace_distance,
+            0,
+            0,
+            WIN_W,
+            WIN_H
+        );
+        if (!trc_resize(&store, n)) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for traces.");
+            exit(-1);
+        }
+        // Bodies drift along random directions at up to 4 px per step
+        float *x = malloc(4 * n * sizeof(float));
+        if (x == NULL) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for benchmark.");
+            exit(-1);
+        }
+        float *y = x + n, *vx = y + n, *vy = vx + n;
+        for (size_t i = 0; i < n; i++) {
+            x[i] = WIN_W * (rand() / (float)RAND_MAX);
+            y[i] = WIN_H * (rand() / (float)RAND_MAX);
+            vx[i] = 4 * (rand() / (float)RAND_MAX) - 2;
+            vy[i] = 4 * (rand() / (float)RAND_MAX) - 2;
+        }
+
+        size_t recorded = 0;
+        double start = utl_time();
+        for (int k = 0; k < STEPS; k++) {
+            for (size_t i = 0; i < n; i++) {
+                x[i] += vx[i];
+                y[i] += vy[i];
+                trc_record(&store, i, x[i], y[i]);
+                recorded += store.age[i] == 0;
+            }
+        }
+        double record_time = (utl_time() - start) / STEPS;
+
+        size_t legacy = n * (LEGACY_SIZE * sizeof(Vector2) + sizeof(size_t));
+        printf(
+            "%9zu %12.1f %12.1f %12.3f %12.1f\n",
+            n,
+            legacy / 1048576.0,
+            trc_memory(&store) / 1048576.0,
+            record_time * 1e3,
+            100.0 * recorded / ((double)n * STEPS)
+        );
+        free(x);
+        trc_free(&store);
+    }
+}
+
+// Collision and Barnes-Hut passes over particles in random order, then
+// again after a Z-order sort
+void bench_locality(void) {
+    const size_t SIZES[] = {10000, 100000, 1000000};
+    const size_t TREE_MAX = 100000;
+    const int STEPS = 3;
+    srand(42);
+
+    printf("Locality benchmark, %zu threads\n", pool.thread_count);
+    printf(
+        "%9s %9s %11s %11s %11s %11s\n",
+        "N",
+        "sort ms",
+        "collide ms",
+        "sorted ms",
+        "tree ms",
+        "sorted ms"
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        particles.count = 0;
+        for (size_t i = 0; i < n; i++) {
+            Particle p = {
+                .r = {WIN_W * (rand() / (float)RAND_MAX),
+                      WIN_H * (rand() / (float)RAND_MAX)},
+                .mass = 1 + 9 * (rand() / (float)RAND_MAX),
+            };
+            utl_da_append(particles, p);
+        }
+        utl_da_resize(a_buffer, particles.capacity);
+        a_buffer.count = a_buffer.capacity;
+        trc_init(&traces, trace_length, trace_decimation, 0, 0, 0, 1, 1);
+        if (!trc_resize(&traces, n)) {
+            utl_log(UTL_ERROR, "Couldn't allocate memory for traces.");
+            exit(-1);
+        }
+
+        double collide_time[2], tree_time[2], sort_time = 0;
+        for (int sorted = 0; sorted < 2; sorted++) {
+            if (sorted) {
+                double start = utl_time();
+                reorder_particles();
+                sort_time = utl_time() - start;
+            }
+            double start = utl_time();
+            for (int k = 0; k < STEPS; k++) resolve_collisions();
+            collide_time[sorted] = (utl_time() - start) / STEPS;
+
+            tree_time[sorted] = 0;
+            if (n > TREE_MAX) continue;
+            load_bodies();
+            start = utl_time();
+            if (!grav_bh_build(&tree, &bodies, grav_params.theta)) {
+                utl_log(UTL_ERROR, "Couldn't allocate Barnes-Hut tree.");
+                exit(-1);
+            }
+            grav_bh_forces(&tree, &bodies, grav_params, &pool);
+            tree_time[sorted] = utl_time() - start;
+        }
+
+        printf(
+            "%9zu %9.3f %11.3f %11.3f ",
+            n,
+            sort_time * 1e3,
+            collide_time[0] * 1e3,
+            collide_time[1] * 1e3
+        );
+        if (n > TREE_MAX) {
+            printf("%11s %11s\n", "-", "-");
+        } else {
+            printf("%11.3f %11.3f\n", tree_time[0] * 1e3, tree_time[1] * 1e3);
+        }
+        trc_free(&traces);
+    }
+    particles.count = 0;
+}
+
+// Block timesteps on random bodies around a tight, heavy binary. A shared
+// step would need every body at the finest level, which costs 2^level
+// full force evaluations per frame.
+void bench_timesteps(void) {
+    const size_t SIZES[] = {1000, 4000, 16000};
+    const int FRAMES = 3;
+    const float dt = 1 / (float)FPS;
+    Solver saved_solver = solver;
+    solver = SOLVER_BARNES_HUT;
+    srand(42);
+
+    printf(
+        "Block timestep benchmark, Barnes-Hut, max level %d, %zu threads\n",
+        max_level,
+        pool.thread_count
+    );
+    printf(
+        "%9s %10s %12s %14s %11s %12s\n",
+        "N",
+        "top level",
+        "forces",
+        "shared forces",
+        "block ms",
+        "shared ms*"
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        particles.count = 0;
+        Particle binary[] = {
+            {.r = {WIN_W / 2 - 4, WIN_H / 2}, .v = {0, -1000}, .mass = 120},
+            {.r = {WIN_W / 2 + 4, WIN_H / 2}, .v = {0, 1000}, .mass = 120},
+        };
+        utl_da_append_many(particles, binary, utl_array_size(binary));
+        while (particles.count < n) {
+            Particle p = {
+                .r = {WIN_W * (rand() / (float)RAND_MAX),
+                      WIN_H * (rand() / (float)RAND_MAX)},
+                .mass = 1 + 9 * (rand() / (float)RAND_MAX),
+            };
+            utl_da_append(particles, p);
+        }
+
+        double start = utl_time();
+        compute_gravity(NULL, 0);
+        double full_time = utl_time() - start;
+        forces_ready = true;
+
+        size_t evaluations = 0, shared_evaluations = 0;
+        double shared_time = 0;
+        start = utl_time();
+        for (int k = 0; k < FRAMES; k++) {
+            update_block_steps(dt);
+            evaluations += block_evaluations;
+            shared_evaluations += n << block_top_level;
+            shared_time += full_time * (1 << block_top_level);
+        }
+        double block_time = (utl_time() - start) / FRAMES;
+
+        printf(
+            "%9zu %10d %12zu %14zu %11.3f %12.3f\n",
+            n,
+            block_top_level,
+            evaluations / FRAMES,
+            shared_evaluations / FRAMES,
+            block_time * 1e3,
+            shared_time / FRAMES * 1e3
+        );
+        forces_ready = false;
+    }
+    printf("* from the time of one full force evaluation\n");
+    particles.count = 0;
+    solver = saved_solver;
+}
+
+// Batches of spawns and deletes on a live set of bodies, traces included.
+// The slowest batch shows whether growing the pool causes spikes.
+void bench_spawning(void) {
+    const size_t SIZES[] = {10000, 100000, 1000000};
+    const size_t BATCH = 1000;
+    const int BATCHES = 200;
+    srand(42);
+
+    printf(
+        "Spawn benchmark, batches of %zu spawns and %zu deletes\n",
+        BATCH,
+        BATCH
+    );
+    printf(
+        "%9s %12s %14s %13s\n", "N", "events/s", "mean batch ms", "max batch ms"
+    );
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        particles.count = 0;
+        hdl_free(&handles);
+        trc_init(&traces, trace_length, trace_decimation, 0, 0, 0, 1, 1);
+        for (size_t i = 0; i < n; i++) {
+            Particle p = {
+                .r = {WIN_W * (rand() / (float)RAND_MAX),
+                      WIN_H * (rand() / (float)RAND_MAX)},
+                .mass = 1 + 9 * (rand() / (float)RAND_MAX),
+            };
+            spawn_particle(p);
+        }
+
+        double total_time = 0, max_time = 0;
+        for (int b = 0; b < BATCHES; b++) {
+            double start = utl_time();
+            for (size_t k = 0; k < BATCH; k++) {
+                Particle p = {
+                    .r = {WIN_W * (rand() / (float)RAND_MAX),
+                          WIN_H * (rand() / (float)RAND_MAX)},
+                    .mass = 1 + 9 * (rand() / (float)RAND_MAX),
+                };
+                spawn_particle(p);
+            }
+            for (size_t k = 0; k < BATCH; k++) {
+                size_t i = rand() % particles.count;
+                delete_particle(hdl_handle(&handles, i));
+            }
+            double time = utl_time() - start;
+            total_time += time;
+            if (time > max_time) max_time = time;
+        }
+
+        printf(
+            "%9zu %12.3g %14.3f %13.3f\n",
+            n,
+            2.0 * BATCH * BATCHES / total_time,
+            total_time / BATCHES * 1e3,
+            max_time * 1e3
+        );
+        trc_free(&traces);
+    }
+    particles.count = 0;
+    hdl_free(&handles);
+    forces_ready = false;
+}
+
+// Snapshots a Plummer sphere with the default reorder interval, then
+// restarts from every frame and compares the checksum after each step with
+// the original run's
+void bench_restart(void) {
+    const size_t N = 2000;
+    const size_t STEPS = 200;
+    const size_t EVERY = 50;
+    const char *PATH = "n_body_restart.snap";
+    const float dt = 1 / (float)FPS;
+    Scenario saved_scenario = scenario;
+    size_t saved_count = scenario_count;
+    Solver saved_solver = solver;
+    Stepper saved_stepper = stepper;
+    size_t saved_reorder = reorder_interval;
+    size_t saved_interval = snapshot_interval;
+    scenario = SCENARIO_PLUMMER;
+    scenario_count = N;
+    solver = SOLVER_DIRECT;
+    stepper = STEPPER_SHARED;
+    reorder_interval = REORDER_INTERVAL;
+    snapshot_interval = EVERY;
+
+    printf(
+        "Restart benchmark, plummer, N = %zu, a snapshot every %zu steps, "
+        "reordering every %zu\n",
+        N,
+        EVERY,
+        reorder_interval
+    );
+    uint64_t *checksums = malloc((STEPS + 1) * sizeof(*checksums));
+    if (checksums == NULL) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for checksums.");
+        exit(-1);
+    }
+    particles.count = 0;
+    load_scenario();
+    utl_da_resize(a_buffer, particles.capacity);
+    a_buffer.count = a_buffer.capacity;
+    for (size_t i = 0; i < particles.count; i++) {
+        a_buffer.items[i] = particles.items[i].a;
+    }
+    hdl_free(&handles);
+    track_particles();
+    step_count = 0;
+    forces_ready = false;
+    if (!snap_writer_open(&snapshots, PATH, SNAP_FLOAT32)) {
+        utl_log(UTL_ERROR, "Couldn't create \"%s\".", PATH);
+        exit(-1);
+    }
+    snapshot_path = PATH;
+    write_snapshot();
+    double start = utl_time();
+    checksums[0] = state_checksum();
+    while (step_count < STEPS) {
+        update_physics(dt);
+        checksums[step_count] = state_checksum();
+    }
+    double run_time = utl_time() - start;
+    snapshot_path = NULL;
+    if (!snap_writer_close(&snapshots)) {
+        utl_log(UTL_ERROR, "Couldn't write \"%s\".", PATH);
+        exit(-1);
+    }
+    printf("%zu steps in %.3f s\n", STEPS, run_time);
+
+    printf("%6s %6s %9s %15s\n", "frame", "step", "matched", "first mismatch");
+    // The last frame is the end of the run
+    for (size_t f = 0; f < STEPS / EVERY; f++) {
+        load_snapshot(PATH, f);
+        for (size_t i = 0; i < particles.count; i++) {
+            a_buffer.items[i] = particles.items[i].a;
+        }
+        hdl_free(&handles);
+        track_particles();
+        forces_ready = false;
+        size_t first = step_count, mismatch = 0, matched = 0;
+        while (step_count < STEPS) {
+            update_physics(dt);
+            if (state_checksum() == checksums[step_count]) {
+                matched++;
+            } else if (mismatch == 0) {
+                mismatch = step_count;
+            }
+        }
+        printf("%6zu %6zu %4zu/%-4zu ", f, first, matched, STEPS - first);
+        if (mismatch == 0) {
+            printf("%15s\n", "-");
+        } else {
+            printf("%15zu\n", mismatch);
+        }
+    }
+
+    remove(PATH);
+    free(checksums);
+    particles.count = 0;
+    hdl_free(&handles);
+    step_count = 0;
+    forces_ready = false;
+    scenario = saved_scenario;
+    scenario_count = saved_count;
+    solver = saved_solver;
+    stepper = saved_stepper;
+    reorder_interval = saved_reorder;
+    snapshot_interval = saved_interval;
+}
+
+// CPU side of the density renderer, splatting and tone mapping a frame.
+// Uploading is a single texture update of the window size on top of this.
+void bench_density(void) {
+    const size_t SIZES[] = {10000, 100000, 1000000, 4000000};
+    const int FRAMES = 20;
+    srand(42);
+
+    if (!dens_init(&density, WIN_W, WIN_H, 0, 0, 1)) {
+        utl_log(UTL_ERROR, "Couldn't allocate density image.");
+        exit(-1);
+    }
+    printf(
+        "Density benchmark, %dx%d pixels, %zu threads\n",
+        WIN_W,
+        WIN_H,
+        pool.thread_count
+    );
+    printf("%9s %10s %13s %10s\n", "N", "splat ms", "tone map ms", "frames/s");
+    for (size_t s = 0; s < utl_array_size(SIZES); s++) {
+        size_t n = SIZES[s];
+        particles.count = 0;
+        add_plummer(
+            (Vector2){WIN_W / 2, WIN_H / 2},
+            Vector2Zero(),
+            SCENARIO_RADIUS,
+            SCENARIO_MASS,
+            n
+        );
+
+        double splat_time = 0, tone_time = 0;
+        for (int f = 0; f < FRAMES; f++) {
+            double start = utl_time();
+            if (!dens_splat(
+                    &density,
+                    &particles.items[0].r,
+                    &particles.items[0].mass,
+                    particles.count,
+                    sizeof(*particles.items),
+                    &pool
+                )) {
+                utl_log(UTL_ERROR, "Couldn't allocate density layers.");
+                exit(-1);
+            }
+            double middle = utl_time();
+            dens_tone_map(&density, SCENARIO_MASS / n, &pool);
+            splat_time += middle - start;
+            tone_time += utl_time() - middle;
+        }
+        printf(
+            "%9zu %10.3f %13.3f %10.1f\n",
+            n,
+            splat_time / FRAMES * 1e3,
+            tone_time / FRAMES * 1e3,
+            FRAMES / (splat_time + tone_time)
+        );
+    }
+    particles.count = 0;
+    dens_free(&density);
+}
+
+void print_usage(const char *program) {
+    printf(
+        "Usage: %s [options]\n"
+        "  --solver direct|barnes-hut|particle-mesh\n"
+        "                              gravity solver (default: direct)\n"
+        "  --theta VALUE               Barnes-Hut opening angle (default: %.2f)\n"
+        "  --mesh-cell VALUE           particle-mesh cell size (default: %.1f)\n"
+        "  --softening VALUE           softening length in pixels (default:\n"
+        "                              %.2f, 0 for solar-system)\n"
+        "  --stepper shared|block      shared adaptive steps or power of two\n"
+        "                              block timesteps (default: shared)\n"
+        "  --max-level COUNT           finest block step is dt / 2^COUNT\n"
+        "                              (default: %d)\n"
+        "  --collisions bounce|merge   elastic bounces, or merges that keep\n"
+        "                              mass and momentum (default: bounce)\n"
+        "  --threads COUNT             worker threads (default: all cores)\n"
+        "  --scenario three-body|plummer|disk|galaxies|solar-system\n"
+        "                              initial bodies (default: three-body)\n"
+        "  --precision float|double|mixed\n"
+        "                              state and integrator precision, mixed\n"
+        "                              keeps float solvers (default: float,\n"
+        "                              mixed for solar-system)\n"
+        "  --count COUNT               bodies of generated scenarios\n"
+        "                              (default: %d)\n"
+        "  --seed VALUE                random seed of scenarios (default: 1)\n"
+        "  --headless STEPS            run STEPS steps without a window, then\n"
+        "                              print throughput and energy drift\n"
+        "  --diagnostics FILE          write energy and momentum as CSV\n"
+        "  --diagnostics-every STEPS   steps between energy and momentum\n"
+        "                              measurements, 0 disables (default: %d)\n"
+        "  --deterministic             same results for any thread count, the\n"
+        "                              direct solver does twice the work\n"
+        "  --checksums FILE            write a checksum of the state after\n"
+        "                              every step as CSV\n"
+        "  --snapshot FILE             write a binary snapshot stream\n"
+        "  --snapshot-every STEPS      steps between snapshots (default: %d)\n"
+        "  --snapshot-half             store positions and velocities as\n"
+        "                              float16\n"
+        "  --restart FILE              start from a frame of a snapshot stream\n"
+        "  --frame INDEX               frame to restart from, negative ones\n"
+        "                              count from the end (default: -1)\n"
+        "  --reorder-every STEPS       steps between Z-order sorts of the\n"
+        "                              particles, 0 disables (default: %d)\n"
+        "  --trace-length COUNT        points kept per trace (default: %d)\n"
+        "  --trace-every STEPS         steps between trace points (default: %d)\n"
+        "  --trace-distance VALUE      distance that records a point sooner\n"
+        "                              (default: %.1f)\n"
+        "  --splat-above COUNT         draw a density image instead of each\n"
+        "                              body above COUNT bodies (default: %d)\n"
+        "  --bench [direct|barnes-hut|particle-mesh|collisions|traces|\n"
+        "           locality|timesteps|spawning|restart|density|scaling]\n"
+        "                              run headless benchmarks and exit\n",
+        program,
+        THETA,
+        MESH_CELL,
+        SOFTENING,
+        BLOCK_MAX_LEVEL,
+        SCENARIO_COUNT,
+        DIAGNOSTICS_INTERVAL,
+        SNAPSHOT_INTERVAL,
+        REORDER_INTERVAL,
+        TRACE_LENGTH,
+        TRACE_DECIMATION,
+        TRACE_DISTANCE,
+        SPLAT_THRESHOLD
+    );
+}
+
+int main(int argc, char **argv) {
+    const char *bench = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--bench") == 0) {
+            bench = "all";
+            if (value != NULL && value[0] != '-') bench = argv[++i];
+        } else if (strcmp(arg, "--solver") == 0 && value != NULL) {
+            solver = 0;
+            while (solver < SolverCount &&
+                   strcmp(value, SOLVER_NAMES[solver]) != 0) {
+                solver++;
+            }
+            if (solver == SolverCount) {
+                utl_log(UTL_ERROR, "Unknown solver \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--stepper") == 0 && value != NULL) {
+            stepper = 0;
+            while (stepper < StepperCount &&
+                   strcmp(value, STEPPER_NAMES[stepper]) != 0) {
+                stepper++;
+            }
+            if (stepper == StepperCount) {
+                utl_log(UTL_ERROR, "Unknown stepper \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--collisions") == 0 && value != NULL) {
+            collision_mode = 0;
+            while (collision_mode < CollisionModeCount &&
+                   strcmp(value, COLLISION_MODE_NAMES[collision_mode]) != 0) {
+                collision_mode++;
+            }
+            if (collision_mode == CollisionModeCount) {
+                utl_log(UTL_ERROR, "Unknown collision mode \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--max-level") == 0 && value != NULL) {
+            max_level = atoi(value);
+            if (max_level < 0) max_level = 0;
+            if (max_level > BLOCK_MAX_LEVEL * 2) max_level = BLOCK_MAX_LEVEL * 2;
+            i++;
+        } else if (strcmp(arg, "--scenario") == 0 && value != NULL) {
+            scenario = 0;
+            while (scenario < ScenarioCount &&
+                   strcmp(value, SCENARIO_NAMES[scenario]) != 0) {
+                scenario++;
+            }
+            if (scenario == ScenarioCount) {
+                utl_log(UTL_ERROR, "Unknown scenario \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--precision") == 0 && value != NULL) {
+            precision = 0;
+            while (precision < PrecisionCount &&
+                   strcmp(value, PRECISION_NAMES[precision]) != 0) {
+                precision++;
+            }
+            if (precision == PrecisionCount) {
+                utl_log(UTL_ERROR, "Unknown precision \"%s\".", value);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--count") == 0 && value != NULL) {
+            scenario_count = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--seed") == 0 && value != NULL) {
+            seed = strtoul(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "--headless") == 0 && value != NULL) {
+            headless_steps = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--snapshot") == 0 && value != NULL) {
+            snapshot_path = value;
+            i++;
+        } else if (strcmp(arg, "--diagnostics") == 0 && value != NULL) {
+            diagnostics_path = value;
+            i++;
+        } else if (strcmp(arg, "--diagnostics-every") == 0 && value != NULL) {
+            diagnostics_interval = atoll(value);
+            i++;
+        } else if (strcmp(arg, "--deterministic") == 0) {
+            grav_params.deterministic = true;
+        } else if (strcmp(arg, "--checksums") == 0 && value != NULL) {
+            checksums_path = value;
+            i++;
+        } else if (strcmp(arg, "--snapshot-every") == 0 && value != NULL) {
+            snapshot_interval = atoll(value);
+            if (snapshot_interval < 1) snapshot_interval = 1;
+            i++;
+        } else if (strcmp(arg, "--snapshot-half") == 0) {
+            snapshot_format = SNAP_FLOAT16;
+        } else if (strcmp(arg, "--restart") == 0 && value != NULL) {
+            restart_path = value;
+            i++;
+        } else if (strcmp(arg, "--frame") == 0 && value != NULL) {
+            restart_frame = atol(value);
+            i++;
+        } else if (strcmp(arg, "--mesh-cell") == 0 && value != NULL) {
+            mesh_cell = atof(value);
+            if (!(mesh_cell > 0)) {
+                utl_log(UTL_ERROR, "Mesh cells must be larger than 0.");
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--theta") == 0 && value != NULL) {
+            grav_params.theta = atof(value);
+            i++;
+        } else if (strcmp(arg, "--threads") == 0 && value != NULL) {
+            thread_count = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--softening") == 0 && value != NULL) {
+            grav_params.softening = atof(value);
+            i++;
+        } else if (strcmp(arg, "--reorder-every") == 0 && value != NULL) {
+            reorder_interval = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--trace-length") == 0 && value != NULL) {
+            trace_length = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--trace-every") == 0 && value != NULL) {
+            trace_decimation = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--trace-distance") == 0 && value != NULL) {
+            trace_distance = atof(value);
+            i++;
+        } else if (strcmp(arg, "--splat-above") == 0 && value != NULL) {
+            splat_threshold = atoll(value);
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : -1;
+        }
+    }
+
+    bool solar_system = scenario == SCENARIO_SOLAR_SYSTEM;
+    if (precision == PrecisionCount) {
+        precision = solar_system ? PRECISION_MIXED : PRECISION_FLOAT;
+    }
+    if (grav_params.softening < 0) {
+        grav_params.softening = solar_system ? 0 : SOFTENING;
+    }
+    if (solar_system && precision == PRECISION_FLOAT) {
+        utl_log(UTL_ERROR, "The solar system needs double or mixed precision.");
+        return -1;
+    }
+    if (precision != PRECISION_FLOAT &&
+        (stepper == STEPPER_BLOCK || collision_mode == COLLISION_MERGE ||
+         snapshot_path != NULL || restart_path != NULL)) {
+        utl_log(
+            UTL_ERROR,
+            "Block steps, merging and snapshots need float precision."
+        );
+        return -1;
+    }
+
+    wrk_pool_init(&pool, thread_count);
+    hdl_init(&handles);
+
+    if (bench != NULL) {
+        bool all = strcmp(bench, "all") == 0;
+        int result = 0;
+        if (all || strcmp(bench, "direct") == 0) result = bench_direct();
+        if (all || strcmp(bench, "barnes-hut") == 0) bench_barnes_hut();
+        if (all || strcmp(bench, "particle-mesh") == 0) bench_particle_mesh();
+        if (all || strcmp(bench, "collisions") == 0) bench_collisions();
+        if (all || strcmp(bench, "traces") == 0) bench_traces();
+        if (all || strcmp(bench, "locality") == 0) bench_locality();
+        if (all || strcmp(bench, "timesteps") == 0) bench_timesteps();
+        if (all || strcmp(bench, "spawning") == 0) bench_spawning();
+        if (all || strcmp(bench, "restart") == 0) bench_restart();
+        if (all || strcmp(bench, "density") == 0) bench_density();
+        if (all || strcmp(bench, "scaling") == 0) bench_scaling();
+        wrk_pool_free(&pool);
+        return result;
+    }
+
+    if (solver == SOLVER_PARTICLE_MESH &&
+        !grav_pm_init(&mesh, 0, 0, WIN_W, WIN_H, mesh_cell)) {
+        utl_log(UTL_ERROR, "Couldn't set up the particle mesh.");
+        exit(-1);
+    }
+
+    help_rect = (Rectangle){HELP_X - 13, HELP_Y - 8, 41, 41};
+    utl_da_init(particles, 0);
+    if (restart_path != NULL) {
+        load_snapshot(restart_path, restart_frame);
+    } else {
+        load_scenario();
+    }
+    utl_da_init(a_buffer, particles.capacity);
+    a_buffer.count = a_buffer.capacity;
+
+    if (particles.items == NULL || a_buffer.items == NULL) {
+        utl_log(UTL_ERROR, "Couldn't allocate memory for simulation.");
+        exit(-1);
+    }
+
+    // Initialize particles
+    memset(a_buffer.items, 0, a_buffer.capacity * sizeof(*a_buffer.items));
     for (size_t i = 0; i < particles.count; i++) {
-        utl_da_append(traces, (Trace){0});
+        a_buffer.items[i] = particles.items[i].a;
     }
+    track_particles();
 
-    SetTraceLogLevel(LOG_WARNING);
-    InitWindow(WIN_W, WIN_H, "N-Body Simulation");
-    SetTargetFPS(FPS);
+    if (diagnostics_path != NULL) {
+        diagnostics_file = fopen(diagnostics_path, "w");
+        if (diagnostics_file == NULL) {
+            utl_log(UTL_ERROR, "Couldn't create \"%s\".", diagnostics_path);
+            exit(-1);
+        }
+        fprintf(
+            diagnostics_file,
+            "step,time,kinetic,potential,total,momentum_x,momentum_y,"
+            "angular_momentum\n"
+        );
+    }
+    if (checksums_path != NULL) {
+        checksums_file = fopen(checksums_path, "w");
+        if (checksums_file == NULL) {
+            utl_log(UTL_ERROR, "Couldn't create \"%s\".", checksums_path);
+            exit(-1);
+        }
+        fprintf(checksums_file, "step,checksum\n");
+    }
+    if (snapshot_path != NULL) {
+        if (!snap_writer_open(&snapshots, snapshot_path, snapshot_format)) {
+            utl_log(UTL_ERROR, "Couldn't create \"%s\".", snapshot_path);
+            exit(-1);
+        }
+        write_snapshot();
+    }
+
+    if (headless_steps > 0) {
+        run_headless(headless_steps);
+    } else {
+        init_traces();
+
+        SetTraceLogLevel(LOG_WARNING);
+        InitWindow(WIN_W, WIN_H, "N-Body Simulation");
+        SetTargetFPS(FPS);
+
+        rayutl_mainloop(update_draw_frame, FPS);
 
-    rayutl_mainloop(update_draw_frame, FPS);
+        if (density.pixels != NULL) UnloadTexture(density_texture);
+        CloseWindow();
+    }
 
-    CloseWindow();
+    if (snapshot_path != NULL) {
+        if (!snap_writer_close(&snapshots)) {
+            utl_log(UTL_ERROR, "Couldn't write \"%s\".", snapshot_path);
+        }
+        utl_log(
+            UTL_INFO,
+            "Wrote %zu snapshots, %.1f MiB to \"%s\"",
+            snapshots.frames_written,
+            snapshots.bytes_written / 1048576.0,
+            snapshot_path
+        );
+    }
+    if (diagnostics_file != NULL) fclose(diagnostics_file);
+    if (checksums_file != NULL) fclose(checksums_file);
     utl_da_free(a_buffer);
     utl_da_free(particles);
+    utl_da_free(sorted_a);
+    utl_da_free(sorted_particles);
+    hdl_free(&handles);
+    trc_free(&traces);
+    free(trace_colors);
+    grav_tree_free(&tree);
+    grav_pm_free(&mesh);
+    grav_bodies_free(&bodies);
+    sgrid_free(&collision_grid);
+    sgrid_free(&pick_grid);
+    sgrid_morton_free(&morton);
+    dens_free(&density);
+    free(levels);
+    free(active);
+    free(merge_roots);
+    free(merge_handles);
+    free(world);
+    free(world_phi);
+    wrk_pool_free(&pool);
 
     return 0;
 }
\ No newline at end of file